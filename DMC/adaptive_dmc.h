@@ -0,0 +1,728 @@
+//
+//  adaptive_dmc.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef adaptive_dmc_h
+#define adaptive_dmc_h
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <vector>
+
+#include "utils.h"
+#include "parallel.h"
+#include "dmc.h"
+
+namespace dmc
+{
+    // Default coarsest octree level of run_adaptive_dmc: leaves of up to 2^4 = 16 voxels a side.
+    const unsigned ADAPTIVE_MAX_LEVEL = 4;
+    // Voxel z-slabs per parallel_for chunk of the adaptive face pass.
+    const size_t ADAPTIVE_SLAB_GRAIN = 2;
+    
+    // Offset of each voxel corner, in the corner order of voxel_config_mask.
+    const uint8_t voxel_corner_offset_lut[VOXEL_NUM_PTS][3] =
+    {
+        {0, 0, 0}, {1, 0, 0}, {1, 1, 0}, {0, 1, 0},
+        {0, 0, 1}, {1, 0, 1}, {1, 1, 1}, {0, 1, 1}
+    };
+    
+    // The two corners of each voxel edge (see pt_pair_edge_lut), the one with the smaller
+    // coordinate first, the direction sample_edge_intersection_vertices interpolates in.
+    const voxel_pt_index_type edge_corner_lut[VOXEL_NUM_EDGES][2] =
+    {
+        {0, 1}, {1, 2}, {3, 2}, {0, 3}, {0, 4}, {1, 5}, {2, 6}, {3, 7}, {4, 5}, {5, 6}, {7, 6}, {4, 7}
+    };
+    
+    // The values of the 8 corners of the cube of 'size' voxels a side from grid point 'base' on,
+    // in the corner order of voxel_config_mask. For size 1 this is gather_voxel_values.
+    template <typename Grid>
+    void gather_node_values(float* node_vals, const Grid& scalar_grid, const uint3& base, unsigned size)
+    {
+        for (voxel_pt_index_type pt = 0; pt < VOXEL_NUM_PTS; ++pt)
+        {
+            node_vals[pt] = scalar_grid(base.x + voxel_corner_offset_lut[pt][0] * size,
+                                        base.y + voxel_corner_offset_lut[pt][1] * size,
+                                        base.z + voxel_corner_offset_lut[pt][2] * size);
+        }
+    }
+    
+    // Whether run_dmc switches the voxel 'voxel3D', whose corners make 'config', to LUT 2 (see
+    // correct_voxels_info): it and the voxel across its ambiguous face both have a 2B or 3B
+    // config. The voxel across the face then switches too.
+    template <typename Grid>
+    bool voxel_uses_lut2(const Grid& scalar_grid, const uint3& num_voxels_dim, const uint3& voxel3D,
+                         voxel_config_type config, float iso_value)
+    {
+        uint8_t config_index;
+        if (!is_ambiguous_config(config, config_index))
+        {
+            return false;
+        }
+        CHECK_DIR dir = face_to_check_dir_lut[config_2B_3B_ambiguous_face[config_index]];
+        if (will_exceed_boundary(voxel3D, num_voxels_dim, dir))
+        {
+            return false;
+        }
+        
+        float adj_vals[8];
+        gather_voxel_values(adj_vals, scalar_grid, get_index3D_by_dir(voxel3D, dir));
+        uint8_t adj_config_index;
+        return is_ambiguous_config(voxel_config_mask(adj_vals, iso_value), adj_config_index);
+    }
+    
+    // Octree over the voxels of a scalar grid, the leaves of run_adaptive_dmc. A node of level l
+    // covers 2^l voxels a side, from grid point node3D << l on, and the level 0 nodes are the
+    // voxels. Only the nodes entirely inside the grid exist, num_voxels_dim >> l of them.
+    //
+    // A node is collapsed, i.e. it is a leaf or inside one, if its children are collapsed and
+    //  - the sign (value < iso_value) of each of the 27 corners of its children equals the sign
+    //    of a corner of the smallest edge, face or cube of the node with it inside. By induction
+    //    each node edge then changes sign at most once along its grid points, and a face or a
+    //    whole node whose corners have the same sign has no sign change at all,
+    //  - its corners make a config with at most one DMC iso vertex (num_vertex_lut1),
+    //  - it has no sign change, or the field deviates by at most 'max_error' from the trilinear
+    //    interpolation of the node corners. The deviation is bounded by the one of the 27 points
+    //    plus the largest one of the children, so the grid is read once per level,
+    //  - none of its voxels uses LUT 2 (voxel_uses_lut2). Those voxels, and so the ones across
+    //    their ambiguous faces, stay leaves and are resolved like in run_dmc.
+    // The leaves are the collapsed nodes whose parent is not, plus the voxels in no collapsed node.
+    class VoxelOctree
+    {
+    public:
+        template <typename Layout, typename Allocator>
+        VoxelOctree(const utils::Array3D<float, Layout, Allocator>& scalar_grid, float iso_value, float max_error,
+                    unsigned max_level = ADAPTIVE_MAX_LEVEL)
+        {
+            get_num_voxels_dim_from_scalar_grid(m_num_voxels_dim, scalar_grid);
+            
+            // Deviation bound of each node of the level below, 0 for the voxels.
+            std::vector<float> child_errors;
+            for (unsigned level = 1; level <= max_level; ++level)
+            {
+                const uint3 nodes_dim = num_nodes_dim(level);
+                const uint3 children_dim = num_nodes_dim(level - 1);
+                const size_t num_nodes = (size_t)nodes_dim.x * nodes_dim.y * nodes_dim.z;
+                if (!num_nodes)
+                {
+                    break;
+                }
+                
+                std::vector<flag_type> collapsed(num_nodes);
+                std::vector<float> errors(num_nodes);
+                parallel_for(0, nodes_dim.z, 1, [&](size_t k_begin, size_t k_end)
+                {
+                    for (unsigned k = (unsigned)k_begin; k < k_end; ++k)
+                    {
+                        for (unsigned j = 0; j < nodes_dim.y; ++j)
+                        {
+                            for (unsigned i = 0; i < nodes_dim.x; ++i)
+                            {
+                                bool children_collapsed = true;
+                                float child_error = 0.0f;
+                                if (level > 1)
+                                {
+                                    for (voxel_pt_index_type pt = 0; pt < VOXEL_NUM_PTS; ++pt)
+                                    {
+                                        size_t child;
+                                        index3D_to_1D(2 * i + voxel_corner_offset_lut[pt][0],
+                                                      2 * j + voxel_corner_offset_lut[pt][1],
+                                                      2 * k + voxel_corner_offset_lut[pt][2],
+                                                      children_dim.x, children_dim.y, child);
+                                        children_collapsed &= (bool)m_collapsed.back()[child];
+                                        child_error = std::max(child_error, child_errors[child]);
+                                    }
+                                }
+                                
+                                size_t node;
+                                index3D_to_1D(i, j, k, nodes_dim.x, nodes_dim.y, node);
+                                // Neither this node nor any above it can be collapsed, its error is not needed.
+                                collapsed[node] = 0;
+                                errors[node] = 0.0f;
+                                if (!children_collapsed)
+                                {
+                                    continue;
+                                }
+                                
+                                float deviation;
+                                bool has_sign_change;
+                                bool collapsible = test_node(scalar_grid, make_uint3(i << level, j << level, k << level),
+                                                             1u << (level - 1), iso_value, deviation, has_sign_change);
+                                errors[node] = child_error + deviation;
+                                collapsed[node] = collapsible && (!has_sign_change || errors[node] <= max_error);
+                                if ((level == 1) && collapsed[node] && has_sign_change)
+                                {
+                                    collapsed[node] = !has_lut2_voxel(scalar_grid, make_uint3(2 * i, 2 * j, 2 * k),
+                                                                      iso_value);
+                                }
+                            }
+                        }
+                    }
+                });
+                
+                // No node can be collapsed above a level without any.
+                if (std::find(collapsed.begin(), collapsed.end(), (flag_type)1) == collapsed.end())
+                {
+                    break;
+                }
+                m_collapsed.push_back(std::move(collapsed));
+                child_errors.swap(errors);
+            }
+            
+            // Every collapsed node but the leaves has its 8 children collapsed.
+            m_num_leaves.resize(coarsest_level() + 1);
+            size_t num_above = 0;
+            for (unsigned level = coarsest_level() + 1; level-- > 0; )
+            {
+                const uint3 nodes_dim = num_nodes_dim(level);
+                size_t num_collapsed = level ? std::count(m_collapsed[level - 1].begin(), m_collapsed[level - 1].end(), 1)
+                                             : (size_t)nodes_dim.x * nodes_dim.y * nodes_dim.z;
+                m_num_leaves[level] = num_collapsed - VOXEL_NUM_PTS * num_above;
+                num_above = num_collapsed;
+            }
+        }
+        
+        // The coarsest level with a collapsed node, 0 if there is none.
+        unsigned coarsest_level() const { return (unsigned)m_collapsed.size(); }
+        const uint3& num_voxels_dim() const { return m_num_voxels_dim; }
+        
+        uint3 num_nodes_dim(unsigned level) const
+        {
+            return make_uint3(m_num_voxels_dim.x >> level, m_num_voxels_dim.y >> level, m_num_voxels_dim.z >> level);
+        }
+        
+        // Always true for the voxels (level 0).
+        bool is_collapsed(unsigned level, const uint3& node3D) const
+        {
+            if (level == 0)
+            {
+                return true;
+            }
+            const uint3 nodes_dim = num_nodes_dim(level);
+            if ((node3D.x >= nodes_dim.x) || (node3D.y >= nodes_dim.y) || (node3D.z >= nodes_dim.z))
+            {
+                return false;
+            }
+            size_t node;
+            index3D_to_1D(node3D, nodes_dim, node);
+            return (bool)m_collapsed[level - 1][node];
+        }
+        
+        // Level of the leaf holding the voxel 'voxel3D'.
+        unsigned leaf_level(const uint3& voxel3D) const
+        {
+            unsigned level = 0;
+            while ((level < coarsest_level()) &&
+                   is_collapsed(level + 1, make_uint3(voxel3D.x >> (level + 1), voxel3D.y >> (level + 1),
+                                                      voxel3D.z >> (level + 1))))
+            {
+                ++level;
+            }
+            return level;
+        }
+        
+        size_t num_leaves(unsigned level) const { return level <= coarsest_level() ? m_num_leaves[level] : 0; }
+        
+        size_t num_leaves() const
+        {
+            size_t num = 0;
+            for (size_t num_level_leaves : m_num_leaves)
+            {
+                num += num_level_leaves;
+            }
+            return num;
+        }
+    
+    private:
+        // Set the 27 points of 'out' (indexed like the ones of test_node) to the corners of 'in', then
+        // fill the points in the middle of an edge, face or the cube along x, then y, then z, each
+        // with combine() of the two points around it along the axis.
+        template <typename T, typename Combine>
+        static void fill_from_corners(T* out, const T* in, const Combine& combine)
+        {
+            for (unsigned c = 0; c < 3; c += 2)
+            {
+                for (unsigned b = 0; b < 3; b += 2)
+                {
+                    for (unsigned a = 0; a < 3; a += 2)
+                    {
+                        out[a + 3 * b + 9 * c] = in[a + 3 * b + 9 * c];
+                    }
+                    out[1 + 3 * b + 9 * c] = combine(out[3 * b + 9 * c], out[2 + 3 * b + 9 * c]);
+                }
+                for (unsigned a = 0; a < 3; ++a)
+                {
+                    out[a + 3 + 9 * c] = combine(out[a + 9 * c], out[a + 6 + 9 * c]);
+                }
+            }
+            for (unsigned p = 9; p < 18; ++p)
+            {
+                out[p] = combine(out[p - 9], out[p + 9]);
+            }
+        }
+        
+        // The sign and config tests of the node from grid point 'base' on whose children are 'half'
+        // voxels a side. 'deviation' gets the largest difference between the children's corners and
+        // the trilinear interpolation of the node corners, 'has_sign_change' whether they do not
+        // all have the same sign.
+        template <typename Grid>
+        static bool test_node(const Grid& scalar_grid, const uint3& base, unsigned half, float iso_value,
+                              float& deviation, bool& has_sign_change)
+        {
+            // vals[a + 3 * b + 9 * c] is the point (a, b, c) * half from 'base'.
+            float vals[27];
+            for (unsigned c = 0; c < 3; ++c)
+            {
+                for (unsigned b = 0; b < 3; ++b)
+                {
+                    for (unsigned a = 0; a < 3; ++a)
+                    {
+                        vals[a + 3 * b + 9 * c] = scalar_grid(base.x + a * half, base.y + b * half, base.z + c * half);
+                    }
+                }
+            }
+            
+            // The trilinear interpolation of the node corners at the 27 points.
+            float trilinear[27];
+            fill_from_corners(trilinear, vals, [](float v0, float v1) { return 0.5f * (v0 + v1); });
+            
+            float min_val = vals[0], max_val = vals[0];
+            deviation = 0.0f;
+            for (unsigned p = 0; p < 27; ++p)
+            {
+                min_val = std::min(min_val, vals[p]);
+                max_val = std::max(max_val, vals[p]);
+                deviation = std::max(deviation, std::fabs(vals[p] - trilinear[p]));
+            }
+            has_sign_change = (min_val < iso_value) && (max_val >= iso_value);
+            if (!has_sign_change)
+            {
+                return true;
+            }
+            
+            // Bit 0 / 1 of sides[p]: whether a corner of the smallest edge, face or cube with the
+            // point p in its middle is below / not below 'iso_value'.
+            uint8_t signs[27], sides[27];
+            for (unsigned p = 0; p < 27; ++p)
+            {
+                signs[p] = (vals[p] < iso_value) ? 0x01 : 0x02;
+            }
+            fill_from_corners(sides, signs, [](uint8_t s0, uint8_t s1) { return (uint8_t)(s0 | s1); });
+            for (unsigned p = 0; p < 27; ++p)
+            {
+                if (!(sides[p] & signs[p]))
+                {
+                    return false;
+                }
+            }
+            
+            float node_vals[8];
+            for (voxel_pt_index_type pt = 0; pt < VOXEL_NUM_PTS; ++pt)
+            {
+                node_vals[pt] = vals[2 * voxel_corner_offset_lut[pt][0] + 6 * voxel_corner_offset_lut[pt][1] +
+                                     18 * voxel_corner_offset_lut[pt][2]];
+            }
+            return (num_vertex_lut1[voxel_config_mask(node_vals, iso_value)] <= 1);
+        }
+        
+        // Whether one of the 2 x 2 x 2 voxels from 'base' on uses LUT 2.
+        template <typename Grid>
+        bool has_lut2_voxel(const Grid& scalar_grid, const uint3& base, float iso_value) const
+        {
+            for (voxel_pt_index_type pt = 0; pt < VOXEL_NUM_PTS; ++pt)
+            {
+                const uint3 voxel3D = make_uint3(base.x + voxel_corner_offset_lut[pt][0],
+                                                 base.y + voxel_corner_offset_lut[pt][1],
+                                                 base.z + voxel_corner_offset_lut[pt][2]);
+                float voxel_vals[8];
+                gather_voxel_values(voxel_vals, scalar_grid, voxel3D);
+                if (voxel_uses_lut2(scalar_grid, m_num_voxels_dim, voxel3D, voxel_config_mask(voxel_vals, iso_value),
+                                    iso_value))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+        
+        uint3 m_num_voxels_dim;
+        // m_collapsed[l - 1][node index1D] for the nodes of level l.
+        std::vector<std::vector<flag_type>> m_collapsed;
+        // Number of leaves per level.
+        std::vector<size_t> m_num_leaves;
+    };
+    
+    // Identifies an iso vertex of a leaf: the leaf's level, its node index1D within the level and
+    // the iso vertex (only voxels can have more than one).
+    typedef uint64_t leaf_vertex_key_type;
+    const unsigned LEAF_VERTEX_LEVEL_SHIFT = 59;
+    
+    inline leaf_vertex_key_type make_leaf_vertex_key(unsigned level, uint64_t node_index1D, iso_vertex_m_type iso_vertex_m)
+    {
+        return ((leaf_vertex_key_type)level << LEAF_VERTEX_LEVEL_SHIFT) | (node_index1D << 2) | iso_vertex_m;
+    }
+    
+    inline void decode_leaf_vertex_key(leaf_vertex_key_type key, unsigned& level, uint64_t& node_index1D,
+                                       iso_vertex_m_type& iso_vertex_m)
+    {
+        level = (unsigned)(key >> LEAF_VERTEX_LEVEL_SHIFT);
+        node_index1D = (key & (((leaf_vertex_key_type)1 << LEAF_VERTEX_LEVEL_SHIFT) - 1)) >> 2;
+        iso_vertex_m = (iso_vertex_m_type)(key & 0x03);
+    }
+    
+    // The iso vertex that the leaf holding the voxel 'voxel3D' has on the voxel's 'edge', which
+    // must be bipolar. A leaf above the voxels has a single iso vertex (see VoxelOctree).
+    template <typename Grid>
+    leaf_vertex_key_type leaf_vertex_key_by_edge(const VoxelOctree& octree, const Grid& scalar_grid, const uint3& voxel3D,
+                                                 voxel_edge_index_type edge, float iso_value)
+    {
+        const unsigned level = octree.leaf_level(voxel3D);
+        uint64_t node_index1D;
+        index3D_to_1D(voxel3D.x >> level, voxel3D.y >> level, voxel3D.z >> level,
+                      octree.num_nodes_dim(level).x, octree.num_nodes_dim(level).y, node_index1D);
+        
+        iso_vertex_m_type iso_vertex_m = 0;
+        if (level == 0)
+        {
+            float voxel_vals[8];
+            gather_voxel_values(voxel_vals, scalar_grid, voxel3D);
+            const voxel_config_type config = voxel_config_mask(voxel_vals, iso_value);
+            const bool use_lut2 = voxel_uses_lut2(scalar_grid, octree.num_voxels_dim(), voxel3D, config, iso_value);
+            const auto& config_edge_lut = use_lut2 ? config_edge_lut2 : config_edge_lut1;
+            iso_vertex_m = config_edge_lut[config][edge];
+            assert(iso_vertex_m != NO_VERTEX);
+        }
+        return make_leaf_vertex_key(level, node_index1D, iso_vertex_m);
+    }
+    
+    // The polygon of a bipolar grid edge: the iso vertices of the leaves around it in the order of
+    // for_each_voxel_quad, a leaf met twice in a row kept once.
+    struct LeafPolygon
+    {
+        leaf_vertex_key_type keys[4];
+        uint8_t num_keys;
+    };
+    
+    // Like generate_triangles, one polygon per bipolar edge 6, 9, 10 of each voxel, with the iso
+    // vertex of the leaf holding each of the four voxels around the edge. A quad with two voxels
+    // in the same leaf becomes a triangle, which is what closes the transitions between levels;
+    // an edge inside a leaf or a face between two leaves gives nothing. Every sign change of the
+    // edges of a leaf is on its own edges, once per edge (see VoxelOctree), so each polygon is
+    // only made once. chunk_polygons[c] gets the polygons of the voxel slabs from
+    // c * ADAPTIVE_SLAB_GRAIN on, in voxel index1D order.
+    template <typename Layout, typename Allocator>
+    void generate_leaf_polygons(std::vector<std::vector<LeafPolygon>>& chunk_polygons, const VoxelOctree& octree,
+                                const utils::Array3D<float, Layout, Allocator>& scalar_grid, float iso_value)
+    {
+        const uint3& num_voxels_dim = octree.num_voxels_dim();
+        const size_t num_chunks = (num_voxels_dim.z + ADAPTIVE_SLAB_GRAIN - 1) / ADAPTIVE_SLAB_GRAIN;
+        chunk_polygons.clear();
+        chunk_polygons.resize(num_chunks);
+        
+        parallel_for(0, num_chunks, 1, [&](size_t chunk_begin, size_t chunk_end)
+        {
+            for (size_t chunk = chunk_begin; chunk < chunk_end; ++chunk)
+            {
+                std::vector<LeafPolygon>& out = chunk_polygons[chunk];
+                const unsigned k_end = (unsigned)std::min<size_t>((chunk + 1) * ADAPTIVE_SLAB_GRAIN, num_voxels_dim.z);
+                for (unsigned k = (unsigned)(chunk * ADAPTIVE_SLAB_GRAIN); k < k_end; ++k)
+                {
+                    for (unsigned j = 0; j < num_voxels_dim.y; ++j)
+                    {
+                        const auto row01 = scalar_grid.row(j + 1, k    );
+                        const auto row10 = scalar_grid.row(j,     k + 1);
+                        const auto row11 = scalar_grid.row(j + 1, k + 1);
+                        
+                        for (unsigned i = 0; i < num_voxels_dim.x; ++i)
+                        {
+                            const uint3 index3D = make_uint3(i, j, k);
+                            // The ends of edge 6 (pt 2, 6), 9 (pt 5, 6) and 10 (pt 7, 6).
+                            const float val6 = row11[i + 1];
+                            const float edge_low_vals[3] = { row01[i + 1], row10[i + 1], row11[i] };
+                            const voxel_edge_index_type edges[3] = { 6, 9, 10 };
+                            
+                            for (unsigned e = 0; e < 3; ++e)
+                            {
+                                if (!is_edge_bipolar(edge_low_vals[e], val6, iso_value) ||
+                                    circular_edge_exceed_boundary(edges[e], index3D, num_voxels_dim))
+                                {
+                                    continue;
+                                }
+                                
+                                LeafPolygon polygon;
+                                polygon.num_keys = 0;
+                                for (auto circular_edge_iter : CircularEdgeRange(edges[e], edge_low_vals[e] < iso_value))
+                                {
+                                    uint3 circular_index3D;
+                                    voxel_edge_index_type circular_edge;
+                                    circular_edge_iter.retrieve(circular_index3D, circular_edge, index3D);
+                                    
+                                    leaf_vertex_key_type key = leaf_vertex_key_by_edge(octree, scalar_grid, circular_index3D,
+                                                                                       circular_edge, iso_value);
+                                    if (!polygon.num_keys || (polygon.keys[polygon.num_keys - 1] != key))
+                                    {
+                                        polygon.keys[polygon.num_keys++] = key;
+                                    }
+                                }
+                                if ((polygon.num_keys > 1) && (polygon.keys[polygon.num_keys - 1] == polygon.keys[0]))
+                                {
+                                    --polygon.num_keys;
+                                }
+                                if (polygon.num_keys >= 3)
+                                {
+                                    out.push_back(polygon);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        });
+    }
+    
+    // Position of each leaf iso vertex in 'vertex_keys': like calc_iso_vertices, the average of the
+    // points where the leaf edges it is on cross the isosurface, found on the grid edge along the
+    // leaf edge that changes sign. For a voxel this is the iso vertex of run_dmc before smoothing,
+    // from LUT 2 where run_dmc uses it.
+    template <typename Layout, typename Allocator>
+    void calc_leaf_vertices(std::vector<float3>& compact_vertices, const std::vector<leaf_vertex_key_type>& vertex_keys,
+                            const VoxelOctree& octree, const utils::Array3D<float, Layout, Allocator>& scalar_grid,
+                            const float3& xyz_min, const float3& xyz_max, float iso_value)
+    {
+        const float3 xyz_range = xyz_max - xyz_min;
+        const uint3& num_voxels_dim = octree.num_voxels_dim();
+        auto grid_point_xyz = [&](const uint3& pt)
+        {
+            return make_float3(ijk_to_xyz(pt.x, num_voxels_dim.x, xyz_range.x, xyz_min.x),
+                               ijk_to_xyz(pt.y, num_voxels_dim.y, xyz_range.y, xyz_min.y),
+                               ijk_to_xyz(pt.z, num_voxels_dim.z, xyz_range.z, xyz_min.z));
+        };
+        
+        compact_vertices.resize(vertex_keys.size());
+        parallel_for(0, vertex_keys.size(), VERTEX_PASS_GRAIN, [&](size_t vertex_begin, size_t vertex_end)
+        {
+            for (size_t vertex = vertex_begin; vertex < vertex_end; ++vertex)
+            {
+                unsigned level;
+                uint64_t node_index1D;
+                iso_vertex_m_type iso_vertex_m;
+                decode_leaf_vertex_key(vertex_keys[vertex], level, node_index1D, iso_vertex_m);
+                
+                uint3 node3D;
+                index1D_to_3D(node_index1D, octree.num_nodes_dim(level), node3D);
+                const unsigned size = 1u << level;
+                const uint3 base = make_uint3(node3D.x << level, node3D.y << level, node3D.z << level);
+                
+                float node_vals[8];
+                gather_node_values(node_vals, scalar_grid, base, size);
+                const voxel_config_type config = voxel_config_mask(node_vals, iso_value);
+                const bool use_lut2 = (level == 0) && voxel_uses_lut2(scalar_grid, num_voxels_dim, base, config, iso_value);
+                const auto& config_edge_lut = use_lut2 ? config_edge_lut2 : config_edge_lut1;
+                
+                float3 sum = make_float3(0, 0, 0);
+                unsigned num_incident = 0;
+                for (voxel_edge_index_type edge = 0; edge < VOXEL_NUM_EDGES; ++edge)
+                {
+                    if (config_edge_lut[config][edge] != iso_vertex_m)
+                    {
+                        continue;
+                    }
+                    
+                    const uint8_t* low = voxel_corner_offset_lut[edge_corner_lut[edge][0]];
+                    const uint8_t* high = voxel_corner_offset_lut[edge_corner_lut[edge][1]];
+                    const uint3 step = make_uint3(high[0] - low[0], high[1] - low[1], high[2] - low[2]);
+                    uint3 pt0 = make_uint3(base.x + low[0] * size, base.y + low[1] * size, base.z + low[2] * size);
+                    for (unsigned t = 0; t < size; ++t)
+                    {
+                        const uint3 pt1 = make_uint3(pt0.x + step.x, pt0.y + step.y, pt0.z + step.z);
+                        const float val0 = scalar_grid(pt0.x, pt0.y, pt0.z);
+                        const float val1 = scalar_grid(pt1.x, pt1.y, pt1.z);
+                        if (is_edge_bipolar(val0, val1, iso_value))
+                        {
+                            sum += lerp_float3(grid_point_xyz(pt0), grid_point_xyz(pt1), val0, val1, iso_value);
+                            ++num_incident;
+                            break;
+                        }
+                        pt0 = pt1;
+                    }
+                }
+                assert(num_incident);
+                compact_vertices[vertex] = sum / (float)std::max(1u, num_incident);
+            }
+        });
+    }
+    
+    // Adaptive extraction over a VoxelOctree built from the same grid and iso value: one iso vertex
+    // per leaf (per patch for the voxels) and the polygons of generate_leaf_polygons, split like
+    // generate_triangles. The mesh is closed across the level transitions since the polygons on
+    // both sides of a leaf face share the leaf's vertex. Vertices are ordered by leaf level, then
+    // by node index1D within the level.
+    //
+    // The voxels use LUT 2 where run_dmc does (voxel_uses_lut2), so the 3B/2B ambiguities are
+    // resolved the same way and the mesh is as manifold as the one of run_dmc. There is no
+    // smoothing.
+    template <typename Layout, typename Allocator>
+    void extract_adaptive_dmc(std::vector<float3>& compact_vertices, std::vector<uint3>& compact_triangles,
+                              const VoxelOctree& octree, const utils::Array3D<float, Layout, Allocator>& scalar_grid,
+                              const float3& xyz_min, const float3& xyz_max, float iso_value,
+                              DmcStats* stats = nullptr, Timer* timer = nullptr)
+    {
+        std::vector<std::vector<LeafPolygon>> chunk_polygons;
+        generate_leaf_polygons(chunk_polygons, octree, scalar_grid, iso_value);
+        const size_t num_chunks = chunk_polygons.size();
+        
+        // The keys of each chunk, sorted and unique, and the one of each polygon corner (polygon
+        // p, corner n at 4 * p + n) as a position in them. Then the keys of all the chunks; most
+        // vertices are only used by one chunk, so few go through the global sort twice.
+        std::vector<std::vector<leaf_vertex_key_type>> chunk_keys(num_chunks);
+        std::vector<std::vector<unsigned>> chunk_corner_keys(num_chunks);
+        parallel_for(0, num_chunks, 1, [&](size_t chunk_begin, size_t chunk_end)
+        {
+            for (size_t chunk = chunk_begin; chunk < chunk_end; ++chunk)
+            {
+                const std::vector<LeafPolygon>& polygons = chunk_polygons[chunk];
+                std::vector<std::pair<leaf_vertex_key_type, unsigned>> corners;
+                for (size_t p = 0; p < polygons.size(); ++p)
+                {
+                    for (uint8_t n = 0; n < polygons[p].num_keys; ++n)
+                    {
+                        corners.push_back(std::make_pair(polygons[p].keys[n], (unsigned)(4 * p + n)));
+                    }
+                }
+                std::sort(corners.begin(), corners.end());
+                
+                std::vector<leaf_vertex_key_type>& keys = chunk_keys[chunk];
+                std::vector<unsigned>& corner_keys = chunk_corner_keys[chunk];
+                corner_keys.resize(4 * polygons.size());
+                for (const auto& corner : corners)
+                {
+                    if (keys.empty() || (keys.back() != corner.first))
+                    {
+                        keys.push_back(corner.first);
+                    }
+                    corner_keys[corner.second] = (unsigned)(keys.size() - 1);
+                }
+            }
+        });
+        
+        std::vector<leaf_vertex_key_type> vertex_keys;
+        for (const std::vector<leaf_vertex_key_type>& keys : chunk_keys)
+        {
+            vertex_keys.insert(vertex_keys.end(), keys.begin(), keys.end());
+        }
+        parallel_sort(vertex_keys.begin(), vertex_keys.end(), std::less<leaf_vertex_key_type>());
+        vertex_keys.erase(std::unique(vertex_keys.begin(), vertex_keys.end()), vertex_keys.end());
+        
+        // The vertex of each chunk key, found in the part of vertex_keys after the previous one,
+        // then the triangles of the chunk.
+        std::vector<std::vector<uint3>> chunk_triangles(num_chunks);
+        parallel_for(0, num_chunks, 1, [&](size_t chunk_begin, size_t chunk_end)
+        {
+            for (size_t chunk = chunk_begin; chunk < chunk_end; ++chunk)
+            {
+                const std::vector<leaf_vertex_key_type>& keys = chunk_keys[chunk];
+                std::vector<vertex_index_type> key_vertices(keys.size());
+                auto vertex_key_iter = vertex_keys.begin();
+                for (size_t n = 0; n < keys.size(); ++n)
+                {
+                    vertex_key_iter = std::lower_bound(vertex_key_iter, vertex_keys.end(), keys[n]);
+                    key_vertices[n] = (vertex_index_type)(vertex_key_iter - vertex_keys.begin());
+                }
+                
+                const std::vector<LeafPolygon>& polygons = chunk_polygons[chunk];
+                const unsigned* corner_keys = chunk_corner_keys[chunk].data();
+                std::vector<uint3>& triangles = chunk_triangles[chunk];
+                for (size_t p = 0; p < polygons.size(); ++p)
+                {
+                    const unsigned* polygon_keys = corner_keys + 4 * p;
+                    triangles.push_back(make_uint3(key_vertices[polygon_keys[0]], key_vertices[polygon_keys[1]],
+                                                   key_vertices[polygon_keys[2]]));
+                    if (polygons[p].num_keys == 4)
+                    {
+                        triangles.push_back(make_uint3(key_vertices[polygon_keys[2]], key_vertices[polygon_keys[3]],
+                                                       key_vertices[polygon_keys[0]]));
+                    }
+                }
+            }
+        });
+        
+        compact_triangles.clear();
+        for (const std::vector<uint3>& triangles : chunk_triangles)
+        {
+            compact_triangles.insert(compact_triangles.end(), triangles.begin(), triangles.end());
+        }
+        if (stats && timer) stats->generate_triangles_ms = timer->lap_ms();
+        
+        calc_leaf_vertices(compact_vertices, vertex_keys, octree, scalar_grid, xyz_min, xyz_max, iso_value);
+        if (stats && timer) stats->calc_iso_vertices_ms = timer->lap_ms();
+    }
+    
+    // Adaptive run_dmc: builds a VoxelOctree of leaves up to 2^max_level voxels a side whose field
+    // is within 'max_error' (in field units) of trilinear, then extracts it with
+    // extract_adaptive_dmc. Flat or empty regions get few, large leaves while the curved parts of
+    // the surface keep the grid resolution. With max_error = 0 only regions where the field is
+    // exactly trilinear are merged, and the mesh is the one of run_dmc without smoothing, but for
+    // the iso vertices of the voxels on the x = 0, y = 0 and z = 0 faces of the grid: run_dmc
+    // leaves the crossings of the grid edges in those faces out of their average.
+    template <typename Layout, typename Allocator>
+    void run_adaptive_dmc(std::vector<float3>& compact_vertices, std::vector<uint3>& compact_triangles,
+                          const utils::Array3D<float, Layout, Allocator>& scalar_grid, const float3& xyz_min,
+                          const float3& xyz_max, float iso_value, float max_error,
+                          unsigned max_level = ADAPTIVE_MAX_LEVEL, DmcStats* stats = nullptr)
+    {
+        Timer timer;
+        if (stats) *stats = DmcStats();
+        
+        VoxelOctree octree(scalar_grid, iso_value, max_error, max_level);
+        if (stats) stats->build_octree_ms = timer.lap_ms();
+        
+        extract_adaptive_dmc(compact_vertices, compact_triangles, octree, scalar_grid, xyz_min, xyz_max, iso_value,
+                             stats, &timer);
+        
+        if (stats)
+        {
+            stats->total_ms = timer.elapsed_ms();
+            stats->num_voxels = (size_t)octree.num_voxels_dim().x * octree.num_voxels_dim().y * octree.num_voxels_dim().z;
+            stats->num_octree_leaves = octree.num_leaves();
+            stats->num_vertices = compact_vertices.size();
+            stats->num_triangles = compact_triangles.size();
+            record_peak_bytes(stats->compact_vertices_bytes, compact_vertices);
+            record_peak_bytes(stats->compact_triangles_bytes, compact_triangles);
+        }
+    }
+    
+    // Number of edges of 'compact_triangles' shared by more than two triangles. The meshes of
+    // run_dmc and run_adaptive_dmc have none.
+    inline size_t count_non_manifold_edges(const std::vector<uint3>& compact_triangles)
+    {
+        std::vector<uint64_t> edges;
+        edges.reserve(3 * compact_triangles.size());
+        for (const uint3& tri : compact_triangles)
+        {
+            const vertex_index_type corners[3] = { tri.x, tri.y, tri.z };
+            for (unsigned n = 0; n < 3; ++n)
+            {
+                uint64_t v0 = corners[n], v1 = corners[(n + 1) % 3];
+                edges.push_back((std::min(v0, v1) << 32) | std::max(v0, v1));
+            }
+        }
+        parallel_sort(edges.begin(), edges.end(), std::less<uint64_t>());
+        
+        // Counted when its third triangle comes up.
+        size_t num_non_manifold = 0;
+        unsigned num_triangles = 0;
+        for (size_t i = 0; i < edges.size(); ++i)
+        {
+            num_triangles = (i && (edges[i] == edges[i - 1])) ? num_triangles + 1 : 1;
+            num_non_manifold += (num_triangles == 3);
+        }
+        return num_non_manifold;
+    }
+}; // namespace dmc
+
+#endif /* adaptive_dmc_h */
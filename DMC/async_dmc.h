@@ -0,0 +1,137 @@
+//
+//  async_dmc.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef async_dmc_h
+#define async_dmc_h
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "utils.h"
+#include "parallel.h"
+#include "dmc.h"
+#include "incremental.h"
+
+namespace dmc
+{
+    // Called by an AsyncDmc with each finished chunk: its index1D in num_chunks_dim(), its chunk
+    // coordinates and its mesh, which the callback may move from.
+    typedef std::function<void(size_t chunk, const uint3& chunk3D, DmcChunkMesh& mesh)> ChunkMeshCallback;
+    
+    // The pool AsyncDmc runs on unless given another one. It is separate from thread_pool(), so a
+    // background extraction does not hold up the parallel passes of the rest of the application.
+    inline ThreadPool& background_thread_pool()
+    {
+        static ThreadPool pool(num_worker_threads());
+        return pool;
+    }
+    
+    // Asynchronous run_dmc for interactive applications. The constructor returns at once and the
+    // grid is extracted in the background as the chunks of a ChunkedDmc, one window per row of
+    // chunks along x, the windows in parallel on 'pool'. Each chunk mesh is final on its own, so
+    // on_chunk gets it as soon as its window is done; put together the chunk meshes are the
+    // run_dmc mesh. on_chunk is called from the pool's threads, one call at a time, for every
+    // chunk, the empty ones included so that what an earlier extraction showed there is cleared.
+    //
+    // cancel() stops the extraction: no window is started and no on_chunk call made after it
+    // returns, except the ones already running, and the windows in flight give up at their next
+    // stage or chunk (see ChunkedDmc::extract_chunks). Start the extraction for a new iso value
+    // right away. AsyncDmcs on the same pool take turns (ThreadPool::run), so it begins once the
+    // cancelled one has stopped; give extractions that should overlap different pools.
+    // 'scalar_grid' is kept by reference and must not change until wait() returns. The
+    // destructor cancels and waits.
+    class AsyncDmc
+    {
+    public:
+        AsyncDmc(const scalar_grid_type& scalar_grid, const float3& xyz_min, const float3& xyz_max, float iso_value,
+                 unsigned num_smooth, ChunkMeshCallback on_chunk, unsigned chunk_size = DMC_CHUNK_SIZE,
+                 ThreadPool& pool = background_thread_pool())
+        : m_chunked(scalar_grid, xyz_min, xyz_max, iso_value, num_smooth, chunk_size)
+        , m_on_chunk(std::move(on_chunk))
+        , m_pool(pool)
+        , m_cancelled(false)
+        , m_num_chunks_done(0)
+        , m_result(m_promise.get_future().share())
+        {
+            m_thread = std::thread([this]() { run(); });
+        }
+        
+        ~AsyncDmc()
+        {
+            cancel();
+            m_thread.join();
+        }
+        
+        // The background thread captures 'this'.
+        AsyncDmc(const AsyncDmc&) = delete;
+        AsyncDmc& operator=(const AsyncDmc&) = delete;
+        AsyncDmc(AsyncDmc&&) = delete;
+        AsyncDmc& operator=(AsyncDmc&&) = delete;
+        
+        void cancel() { m_cancelled = true; }
+        bool cancelled() const { return m_cancelled; }
+        
+        // Ready once the extraction has stopped: true if every chunk was extracted, false if it
+        // was cancelled first.
+        std::shared_future<bool> result() const { return m_result; }
+        bool wait() const { return m_result.get(); }
+        bool finished() const { return m_result.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+        
+        const uint3& num_chunks_dim() const { return m_chunked.num_chunks_dim(); }
+        size_t num_chunks() const { return m_chunked.num_chunks(); }
+        size_t num_chunks_done() const { return m_num_chunks_done; }
+        // Fraction of the chunks extracted so far, empty ones included.
+        float progress() const { return num_chunks() ? (float)num_chunks_done() / num_chunks() : 1.0f; }
+    
+    private:
+        void run()
+        {
+            const uint3& num_chunks_dim = m_chunked.num_chunks_dim();
+            const size_t num_windows = (size_t)num_chunks_dim.y * num_chunks_dim.z;
+            std::atomic<size_t> next_window(0);
+            std::mutex callback_mutex;
+            
+            m_pool.run(m_pool.num_threads(), [&](unsigned)
+            {
+                for (size_t window = next_window++; (window < num_windows) && !m_cancelled; window = next_window++)
+                {
+                    const unsigned cy = (unsigned)(window % num_chunks_dim.y);
+                    const unsigned cz = (unsigned)(window / num_chunks_dim.y);
+                    m_chunked.extract_chunks(make_uint3(0, cy, cz), make_uint3(num_chunks_dim.x, cy + 1, cz + 1),
+                                             [&](size_t chunk, DmcChunkMesh& mesh)
+                    {
+                        std::lock_guard<std::mutex> lock(callback_mutex);
+                        if (m_cancelled) return;
+                        
+                        uint3 chunk3D;
+                        index1D_to_3D(chunk, num_chunks_dim, chunk3D);
+                        m_on_chunk(chunk, chunk3D, mesh);
+                        ++m_num_chunks_done;
+                    }, &m_cancelled);
+                }
+            });
+            m_promise.set_value(!m_cancelled && (m_num_chunks_done == num_chunks()));
+        }
+        
+        ChunkedDmc m_chunked;
+        ChunkMeshCallback m_on_chunk;
+        ThreadPool& m_pool;
+        std::atomic<bool> m_cancelled;
+        std::atomic<size_t> m_num_chunks_done;
+        std::promise<bool> m_promise;
+        std::shared_future<bool> m_result;
+        std::thread m_thread;
+    };
+}; // namespace dmc
+
+#endif /* async_dmc_h */
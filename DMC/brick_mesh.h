@@ -0,0 +1,247 @@
+//
+//  brick_mesh.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef brick_mesh_h
+#define brick_mesh_h
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "utils.h"
+#include "parallel.h"
+#include "dmc.h"
+
+namespace dmc
+{
+    // Edge length, in voxels, of the bricks of a BrickMesh. The triangles of a brick only use the
+    // iso vertices of its voxels and of their direct neighbours, at most 4 * (16 + 2)^3 of them,
+    // so 16-bit local indices always suffice.
+    const unsigned BRICK_MESH_SIZE = 16;
+    
+    // Brick-local output of run_dmc, in place of the triangle buffer: the triangles of
+    // generate_triangles grouped by the BRICK_MESH_SIZE^3 brick of the voxel that generated them,
+    // each brick with its own vertex list and its triangles as Index triples local to that list.
+    //
+    // With uint16_t the triangles take half the memory of uint3 ones, but the vertex lists add a
+    // 32-bit id per vertex and brick, the vertices on brick borders being listed by every brick
+    // that uses them (about 12% more ids than vertices on a gyroid). With two triangles per
+    // vertex, the whole mesh is about 0.7 times the size of the uint3 triangle buffer; num_bytes()
+    // (compact_triangles_bytes in DmcStats) gives the exact figure.
+    template <typename Index>
+    struct BrickMesh
+    {
+        typedef tuple3<Index> triangle_type;
+        
+        struct Brick
+        {
+            // The brick covers the voxels [index3D * BRICK_MESH_SIZE, (index3D + 1) * BRICK_MESH_SIZE).
+            uint3 index3D;
+            // Bounding box of its vertices.
+            float3 xyz_min;
+            float3 xyz_max;
+            // Its vertices are brick_vertices[vertex_base, vertex_base + vertex_count), its
+            // triangles triangles[triangle_offset, triangle_offset + triangle_count).
+            unsigned vertex_base;
+            unsigned vertex_count;
+            unsigned triangle_offset;
+            unsigned triangle_count;
+        };
+        
+        std::vector<Brick> bricks;
+        // Indices into compact_vertices. A vertex shared by several bricks is listed by each.
+        std::vector<vertex_index_type> brick_vertices;
+        std::vector<triangle_type> triangles;
+        
+        void clear()
+        {
+            bricks.clear();
+            brick_vertices.clear();
+            triangles.clear();
+        }
+        
+        size_t num_triangles() const { return triangles.size(); }
+        
+        size_t num_bytes() const
+        {
+            return bricks.capacity() * sizeof(Brick) + brick_vertices.capacity() * sizeof(vertex_index_type) +
+                   triangles.capacity() * sizeof(triangle_type);
+        }
+    };
+    
+    // Append the brick 'brick_index1D', whose active voxels are 'voxels' (in index1D order), to
+    // 'mesh'. 'brick_triangles' is scratch space.
+    template <typename Index, typename IndexMap>
+    void append_brick(BrickMesh<Index>& mesh, std::vector<uint3>& brick_triangles, voxel_index1D_type brick_index1D,
+                      const uint3& num_bricks_dim, const compact_index_type* voxels, size_t num_voxels,
+                      const std::vector<float3>& compact_vertices, const std::vector<_VoxelInfo>& compact_voxel_info,
+                      const IndexMap& full_voxel_index_map, const uint3& num_voxels_dim)
+    {
+        brick_triangles.clear();
+        for (size_t i = 0; i < num_voxels; ++i)
+        {
+            generate_voxel_triangles(brick_triangles, compact_voxel_info[voxels[i]], compact_voxel_info,
+                                     full_voxel_index_map, num_voxels_dim);
+        }
+        if (brick_triangles.empty())
+        {
+            return;
+        }
+        
+        typename BrickMesh<Index>::Brick brick;
+        index1D_to_3D(brick_index1D, num_bricks_dim, brick.index3D);
+        brick.vertex_base = (unsigned)mesh.brick_vertices.size();
+        brick.triangle_offset = (unsigned)mesh.triangles.size();
+        brick.triangle_count = (unsigned)brick_triangles.size();
+        
+        // The brick's vertices, sorted so that the local indices follow the vertex order.
+        for (const uint3& tri : brick_triangles)
+        {
+            mesh.brick_vertices.push_back(tri.x);
+            mesh.brick_vertices.push_back(tri.y);
+            mesh.brick_vertices.push_back(tri.z);
+        }
+        auto vertices_begin = mesh.brick_vertices.begin() + brick.vertex_base;
+        std::sort(vertices_begin, mesh.brick_vertices.end());
+        mesh.brick_vertices.erase(std::unique(vertices_begin, mesh.brick_vertices.end()), mesh.brick_vertices.end());
+        brick.vertex_count = (unsigned)(mesh.brick_vertices.size() - brick.vertex_base);
+        assert(brick.vertex_count - 1 <= std::numeric_limits<Index>::max());
+        
+        const vertex_index_type* local_begin = mesh.brick_vertices.data() + brick.vertex_base;
+        const vertex_index_type* local_end = local_begin + brick.vertex_count;
+        auto to_local = [&](vertex_index_type v)
+        {
+            return (Index)(std::lower_bound(local_begin, local_end, v) - local_begin);
+        };
+        for (const uint3& tri : brick_triangles)
+        {
+            mesh.triangles.push_back(typename BrickMesh<Index>::triangle_type(to_local(tri.x), to_local(tri.y),
+                                                                               to_local(tri.z)));
+        }
+        
+        brick.xyz_min = brick.xyz_max = compact_vertices[*local_begin];
+        for (const vertex_index_type* v = local_begin; v != local_end; ++v)
+        {
+            const float3& pt = compact_vertices[*v];
+            brick.xyz_min = make_float3(std::min(brick.xyz_min.x, pt.x), std::min(brick.xyz_min.y, pt.y),
+                                        std::min(brick.xyz_min.z, pt.z));
+            brick.xyz_max = make_float3(std::max(brick.xyz_max.x, pt.x), std::max(brick.xyz_max.y, pt.y),
+                                        std::max(brick.xyz_max.z, pt.z));
+        }
+        mesh.bricks.push_back(brick);
+    }
+    
+    // Brick-local output for finish_dmc, built like the meshlets: the active voxels are bucketed
+    // by brick, chunks of bricks (weighted by active voxels) are built in parallel and then
+    // concatenated in brick order.
+    template <typename Index, typename IndexMap>
+    void generate_faces(BrickMesh<Index>& mesh, const std::vector<float3>& compact_vertices,
+                        const std::vector<_VoxelInfo>& compact_voxel_info,
+                        const IndexMap& full_voxel_index_map, const uint3& num_voxels_dim)
+    {
+        static_assert(4 * (BRICK_MESH_SIZE + 2) * (BRICK_MESH_SIZE + 2) * (BRICK_MESH_SIZE + 2) - 1 <=
+                      (size_t)std::numeric_limits<Index>::max(), "Index is too narrow for BRICK_MESH_SIZE");
+        mesh.clear();
+        
+        const unsigned B = BRICK_MESH_SIZE;
+        const uint3 num_bricks_dim = make_uint3((num_voxels_dim.x + B - 1) / B, (num_voxels_dim.y + B - 1) / B,
+                                                (num_voxels_dim.z + B - 1) / B);
+        std::vector<compact_index_type> voxels;
+        std::vector<size_t> brick_begin;
+        std::vector<voxel_index1D_type> brick_ids;
+        bucket_voxels_by_brick(voxels, brick_begin, &brick_ids, compact_voxel_info, num_voxels_dim, B);
+        
+        const size_t num_bricks = brick_ids.size();
+        std::vector<size_t> chunk_begin;
+        split_by_weight(chunk_begin, brick_begin, num_bricks, VERTEX_PASS_GRAIN);
+        std::vector<BrickMesh<Index>> chunk_meshes(chunk_begin.size() - 1);
+        parallel_for(0, chunk_meshes.size(), 1, [&](size_t chunk, size_t)
+        {
+            BrickMesh<Index>& chunk_mesh = chunk_meshes[chunk];
+            std::vector<uint3> brick_triangles;
+            for (size_t brick = chunk_begin[chunk]; brick < chunk_begin[chunk + 1]; ++brick)
+            {
+                append_brick(chunk_mesh, brick_triangles, brick_ids[brick], num_bricks_dim,
+                             voxels.data() + brick_begin[brick], brick_begin[brick + 1] - brick_begin[brick],
+                             compact_vertices, compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+            }
+        });
+        
+        size_t num_bricks_total = 0, num_brick_vertices = 0, num_triangles = 0;
+        for (const BrickMesh<Index>& chunk_mesh : chunk_meshes)
+        {
+            num_bricks_total += chunk_mesh.bricks.size();
+            num_brick_vertices += chunk_mesh.brick_vertices.size();
+            num_triangles += chunk_mesh.triangles.size();
+        }
+        mesh.bricks.reserve(num_bricks_total);
+        mesh.brick_vertices.reserve(num_brick_vertices);
+        mesh.triangles.reserve(num_triangles);
+        
+        for (const BrickMesh<Index>& chunk_mesh : chunk_meshes)
+        {
+            const unsigned vertex_base = (unsigned)mesh.brick_vertices.size();
+            const unsigned triangle_base = (unsigned)mesh.triangles.size();
+            for (typename BrickMesh<Index>::Brick brick : chunk_mesh.bricks)
+            {
+                brick.vertex_base += vertex_base;
+                brick.triangle_offset += triangle_base;
+                mesh.bricks.push_back(brick);
+            }
+            mesh.brick_vertices.insert(mesh.brick_vertices.end(), chunk_mesh.brick_vertices.begin(),
+                                       chunk_mesh.brick_vertices.end());
+            mesh.triangles.insert(mesh.triangles.end(), chunk_mesh.triangles.begin(), chunk_mesh.triangles.end());
+        }
+    }
+    
+    // Per vertex data (positions, normals) laid out brick by brick, so that the local indices of
+    // each brick index directly into its [vertex_base, vertex_base + vertex_count) slice.
+    template <typename Index, typename T>
+    void gather_brick_vertices(std::vector<T>& brick_data, const BrickMesh<Index>& mesh,
+                               const std::vector<T>& compact_data)
+    {
+        brick_data.resize(mesh.brick_vertices.size());
+        parallel_for(0, mesh.brick_vertices.size(), VERTEX_PASS_GRAIN, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                brick_data[i] = compact_data[mesh.brick_vertices[i]];
+            }
+        });
+    }
+    
+    // The hooks finish_dmc and compact_iso_vertices use for the other face buffers. The remap of
+    // compact_iso_vertices keeps the vertex order, so each brick's list stays sorted.
+    template <typename Index>
+    void remap_faces(BrickMesh<Index>& mesh, const std::vector<vertex_index_type>& vertex_remap)
+    {
+        parallel_for(0, mesh.brick_vertices.size(), VERTEX_PASS_GRAIN, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                mesh.brick_vertices[i] = vertex_remap[mesh.brick_vertices[i]];
+            }
+        });
+    }
+    
+    template <typename Index>
+    void record_face_counts(DmcStats& stats, const BrickMesh<Index>& mesh)
+    {
+        stats.num_triangles = mesh.num_triangles();
+    }
+    
+    template <typename Index>
+    void record_peak_bytes(size_t& peak_bytes, const BrickMesh<Index>& mesh)
+    {
+        peak_bytes = std::max(peak_bytes, mesh.num_bytes());
+    }
+}; // namespace dmc
+
+#endif /* brick_mesh_h */
@@ -17,6 +17,8 @@
 #include <bitset>
 
 #include "utils.h"
+#include "parallel.h"
+#include "huge_pages.h"
 
 namespace dmc
 {
@@ -34,7 +36,11 @@ namespace dmc
     typedef uint8_t voxel_face_index_type;
     
     typedef uint8_t voxel_config_type;
-    typedef unsigned voxel_index1D_type;
+    // 64-bit so that volumes with more than 2^32 voxels (e.g. fused extraction of a procedural
+    // field) can still be indexed.
+    typedef uint64_t voxel_index1D_type;
+    // Position of an active voxel in compact_voxel_info.
+    typedef unsigned compact_index_type;
     typedef uint8_t iso_vertex_m_type;
     typedef unsigned vertex_index_type;
     typedef unsigned char flag_type;
@@ -46,8 +52,9 @@ namespace dmc
     const unsigned VOXEL_NUM_EDGES = 12;
     const unsigned VOXEL_NUM_FACES = 6;
     
+    const voxel_index1D_type INVALID_INDEX_1D = ~(voxel_index1D_type)0;
     // For inactive voxel index_1D in full_voxel_index_map, this value is stored.
-    const voxel_index1D_type INVALID_INDEX_1D = INVALID_UINT32;
+    const compact_index_type INVALID_COMPACT_INDEX = INVALID_UINT32;
     const voxel_config_type MAX_VOXEL_CONFIG_MASK = INVALID_UINT8;
     // Used in config_edge_lut1[2]
     const iso_vertex_m_type NO_VERTEX = INVALID_UINT8;
@@ -824,47 +831,80 @@ namespace dmc
         return mask;
     }
     
-    // Scan through and flag out the active voxels according to its voxel config.
-    void flag_active_voxels(std::vector<flag_type>& voxel_flags,
-                            const utils::Array3D<float>& scalar_grid, float iso_value)
+    // The values of the 8 corners of the voxel 'index3D', in the corner order of voxel_config_mask.
+    template <typename Grid>
+    void gather_voxel_values(float* voxel_vals, const Grid& scalar_grid, const uint3& index3D)
+    {
+        const auto row00 = scalar_grid.row(index3D.y,     index3D.z    );
+        const auto row01 = scalar_grid.row(index3D.y + 1, index3D.z    );
+        const auto row10 = scalar_grid.row(index3D.y,     index3D.z + 1);
+        const auto row11 = scalar_grid.row(index3D.y + 1, index3D.z + 1);
+        const unsigned i = index3D.x;
+        
+        voxel_vals[0] = row00[i];
+        voxel_vals[1] = row00[i + 1];
+        voxel_vals[2] = row01[i + 1];
+        voxel_vals[3] = row01[i];
+        voxel_vals[4] = row10[i];
+        voxel_vals[5] = row10[i + 1];
+        voxel_vals[6] = row11[i + 1];
+        voxel_vals[7] = row11[i];
+    }
+    
+    // Scan through and flag out the active voxels according to its voxel config. The voxel
+    // z-slabs are split between the threads with parallel_for_static, the partition the grid and
+    // the flags are first touched with (see huge_pages.h). Each thread visits its voxels brick by
+    // brick in the storage order of the grid's layout (for LinearLayout this is the plain k, j, i
+    // order). Every flag is written, so 'voxel_flags' may come uninitialized from its allocator.
+    template <typename FlagVector, typename Layout, typename Allocator>
+    void flag_active_voxels(FlagVector& voxel_flags,
+                            const utils::Array3D<float, Layout, Allocator>& scalar_grid, float iso_value)
     {
         unsigned num_voxels_i = scalar_grid.dim_x() - 1;
         unsigned num_voxels_j = scalar_grid.dim_y() - 1;
         unsigned num_voxels_k = scalar_grid.dim_z() - 1;
         
-        voxel_flags.clear();
-        voxel_flags.resize(num_voxels_i * num_voxels_j * num_voxels_k);
+        voxel_flags.resize((size_t)num_voxels_i * num_voxels_j * num_voxels_k);
         
-        unsigned index1D;
-        for (unsigned k = 0; k < num_voxels_k; ++k)
+        parallel_for_static(0, num_voxels_k, [&](size_t k_begin, size_t k_end)
         {
-            for (unsigned j = 0; j < num_voxels_j; ++j)
+            for_each_brick(make_uint3(num_voxels_i, num_voxels_j, num_voxels_k), scalar_grid.brick_dim(),
+                           [&](const uint3& brick_begin, const uint3& brick_end)
             {
-                for (unsigned i = 0; i < num_voxels_i; ++i)
+                // Only the part of the brick within this thread's slabs.
+                const unsigned k0 = std::max(brick_begin.z, (unsigned)k_begin);
+                const unsigned k1 = std::min(brick_end.z, (unsigned)k_end);
+                
+                voxel_index1D_type index1D;
+                for (unsigned k = k0; k < k1; ++k)
                 {
-                    float voxel_vals[8] =
+                    for (unsigned j = brick_begin.y; j < brick_end.y; ++j)
                     {
-                        scalar_grid(i,      j,      k       ),
-                        scalar_grid(i + 1,  j,      k       ),
-                        scalar_grid(i + 1,  j + 1,  k       ),
-                        scalar_grid(i,      j + 1,  k       ),
-                        scalar_grid(i,      j,      k + 1   ),
-                        scalar_grid(i + 1,  j,      k + 1   ),
-                        scalar_grid(i + 1,  j + 1,  k + 1   ),
-                        scalar_grid(i,      j + 1,  k + 1   ),
+                        const auto row00 = scalar_grid.row(j,     k    );
+                        const auto row01 = scalar_grid.row(j + 1, k    );
+                        const auto row10 = scalar_grid.row(j,     k + 1);
+                        const auto row11 = scalar_grid.row(j + 1, k + 1);
                         
-                    };
-                    
-                    voxel_config_type voxel_config = voxel_config_mask(voxel_vals, iso_value);
-                    index3D_to_1D(i, j, k, num_voxels_i, num_voxels_j, index1D);
-                    voxel_flags[index1D] = (voxel_config && voxel_config < MAX_VOXEL_CONFIG_MASK);
+                        for (unsigned i = brick_begin.x; i < brick_end.x; ++i)
+                        {
+                            float voxel_vals[8] =
+                            {
+                                row00[i], row00[i + 1], row01[i + 1], row01[i],
+                                row10[i], row10[i + 1], row11[i + 1], row11[i]
+                            };
+                            
+                            voxel_config_type voxel_config = voxel_config_mask(voxel_vals, iso_value);
+                            index3D_to_1D(i, j, k, num_voxels_i, num_voxels_j, index1D);
+                            voxel_flags[index1D] = (voxel_config && voxel_config < MAX_VOXEL_CONFIG_MASK);
+                        }
+                    }
                 }
-            }
-        }
+            });
+        });
     }
     
-    inline void get_num_voxels_dim_from_scalar_grid(uint3& num_voxels_dim,
-                                                    const scalar_grid_type& scalar_grid)
+    template <typename Grid>
+    inline void get_num_voxels_dim_from_scalar_grid(uint3& num_voxels_dim, const Grid& scalar_grid)
     {
         num_voxels_dim.x = scalar_grid.dim_x() - 1;
         num_voxels_dim.y = scalar_grid.dim_y() - 1;
@@ -916,30 +956,72 @@ namespace dmc
     // Compact to get the active voxels, for each compacted voxel, store its index_1D.
     // [invariant] for 0 <= i < compact_voxel_info.size(),
     //                  full_voxel_index_map[compact_voxel_info[i].index1D] == i
-    void compact_voxel_flags(std::vector<_VoxelInfo>& compact_voxel_info,
-                             std::vector<voxel_index1D_type>& full_voxel_index_map,
-                             const std::vector<flag_type>& flags)
+    //
+    // The map is first touched by voxel slab (num_voxels_xy voxels) with the partition of
+    // flag_active_voxels.
+    template <typename IndexMapVector, typename FlagVector>
+    void compact_voxel_flags(std::vector<_VoxelInfo>& compact_voxel_info, IndexMapVector& full_voxel_index_map,
+                             const FlagVector& flags, size_t num_voxels_xy)
     {
         compact_voxel_info.clear();
-        full_voxel_index_map.clear();
-        full_voxel_index_map.resize(flags.size());
-        std::fill(full_voxel_index_map.begin(), full_voxel_index_map.end(), INVALID_UINT32);
+        parallel_first_touch(full_voxel_index_map, flags.size(), INVALID_COMPACT_INDEX, num_voxels_xy);
         
         for (voxel_index1D_type index1D = 0; index1D < flags.size(); ++index1D)
         {
             if (flags[index1D])
             {
-                full_voxel_index_map[index1D] = (unsigned)compact_voxel_info.size();
+                full_voxel_index_map[index1D] = (compact_index_type)compact_voxel_info.size();
                 compact_voxel_info.push_back(_VoxelInfo(index1D));
             }
         }
     }
     
+    // Initialize the info of one active voxel from its eight corner values: the voxel config and
+    // whether the edges this voxel manages (edge 6, 9, 10) are bipolar.
+    void init_voxel_info(_VoxelInfo& vx_info, const float* voxel_vals, float iso_value)
+    {
+        voxel_config_type voxel_config = voxel_config_mask(voxel_vals, iso_value);
+        vx_info.set_config(voxel_config);
+        // Calculate if the three edges 6, 9, 10 are bipolar
+        auto encode_voxel_edge_info = [=, &vx_info](voxel_pt_index_type p0, voxel_pt_index_type p1)
+        {
+            voxel_edge_index_type edge_index = pt_pair_edge_lut(p0, p1);
+            /*std::cout << "p0: " << (unsigned)p0 << ", p1: " << (unsigned)p1
+            << "val0: " << voxel_vals[p0] << ", val1: " << voxel_vals[p1] << std::endl;*/
+            
+            bool is_bipolar = is_edge_bipolar(voxel_vals[p0], voxel_vals[p1], iso_value);
+            if (is_bipolar)
+            {
+                bool use_ccw = voxel_vals[p0] < iso_value;
+                if (use_ccw)
+                {
+                    assert(voxel_vals[p1] >= iso_value);
+                }
+                else
+                {
+                    assert(voxel_vals[p1] < iso_value);
+                }
+                // assert(use_ccw ? voxel_vals[p1] >= iso_value : voxel_vals[p1] <= iso_value);
+                
+                vx_info.encode_edge_bipolar_info(edge_index, is_bipolar, use_ccw);
+            }
+            else
+            {
+                vx_info.encode_edge_is_bipolar(edge_index, is_bipolar);
+            }
+        };
+        
+        encode_voxel_edge_info(2, 6);   // edge 6
+        encode_voxel_edge_info(5, 6);   // edge 9
+        encode_voxel_edge_info(7, 6);   // edge 10
+    }
+    
     // Initialize the voxel info. During this stage we only store the voxel config and
     // the edges this voxel manages (edge 6, 9, 10) are bipolar. The possible situation
     // where voxels with 2B config and 3B config are adjacent are not resolved at this stage.
+    template <typename Grid>
     void init_voxels_info(std::vector<_VoxelInfo>& compact_voxel_info,
-                          const scalar_grid_type& scalar_grid, float iso_value)
+                          const Grid& scalar_grid, float iso_value)
     {
         
         uint3 num_voxels_dim;
@@ -952,51 +1034,9 @@ namespace dmc
             uint3 index3D;
             index1D_to_3D(index1D, num_voxels_dim, index3D);
             // Calculate the voxel config by eight voxel points value
-            const float voxel_vals[8] =
-            {
-                scalar_grid(index3D.x,     index3D.y,     index3D.z    ),
-                scalar_grid(index3D.x + 1, index3D.y,     index3D.z    ),
-                scalar_grid(index3D.x + 1, index3D.y + 1, index3D.z    ),
-                scalar_grid(index3D.x,     index3D.y + 1, index3D.z    ),
-                scalar_grid(index3D.x,     index3D.y,     index3D.z + 1),
-                scalar_grid(index3D.x + 1, index3D.y,     index3D.z + 1),
-                scalar_grid(index3D.x + 1, index3D.y + 1, index3D.z + 1),
-                scalar_grid(index3D.x,     index3D.y + 1, index3D.z + 1)
-            };
-            voxel_config_type voxel_config = voxel_config_mask(voxel_vals, iso_value);
-            vx_info.set_config(voxel_config);
-            // Calculate if the three edges 6, 9, 10 are bipolar
-            auto encode_voxel_edge_info = [=, &vx_info](voxel_pt_index_type p0, voxel_pt_index_type p1)
-            {
-                voxel_edge_index_type edge_index = pt_pair_edge_lut(p0, p1);
-                /*std::cout << "p0: " << (unsigned)p0 << ", p1: " << (unsigned)p1
-                << "val0: " << voxel_vals[p0] << ", val1: " << voxel_vals[p1] << std::endl;*/
-                
-                bool is_bipolar = is_edge_bipolar(voxel_vals[p0], voxel_vals[p1], iso_value);
-                if (is_bipolar)
-                {
-                    bool use_ccw = voxel_vals[p0] < iso_value;
-                    if (use_ccw)
-                    {
-                        assert(voxel_vals[p1] >= iso_value);
-                    }
-                    else
-                    {
-                        assert(voxel_vals[p1] < iso_value);
-                    }
-                    // assert(use_ccw ? voxel_vals[p1] >= iso_value : voxel_vals[p1] <= iso_value);
-
-                    vx_info.encode_edge_bipolar_info(edge_index, is_bipolar, use_ccw);
-                }
-                else
-                {
-                    vx_info.encode_edge_is_bipolar(edge_index, is_bipolar);
-                }
-            };
-            
-            encode_voxel_edge_info(2, 6);   // edge 6
-            encode_voxel_edge_info(5, 6);   // edge 9
-            encode_voxel_edge_info(7, 6);   // edge 10
+            float voxel_vals[8];
+            gather_voxel_values(voxel_vals, scalar_grid, index3D);
+            init_voxel_info(vx_info, voxel_vals, iso_value);
         }
     }
     
@@ -1086,13 +1126,23 @@ namespace dmc
         }
     }
     
+    // Whether 'IndexMap' may be missing a neighbor of an active voxel that should be there, as on
+    // the border of a windowed extraction or an approximate narrow band. The stages below then
+    // skip that neighbor; with the dense map of a full grid it can only be a bug, and they assert.
+    template <typename IndexMap>
+    struct index_map_traits
+    {
+        static const bool may_miss_voxels = false;
+    };
+    
     // Check if the active voxel indicated by 'cur_compact_index' has an adjacent voxel which has
     // an ambiguous config that will result in non-manifold situation.
     // [precondition] compact_voxel_info[cur_compact_index].config == config_2B_3B_lut[cur_config_index]
-    bool is_adjacent_ambiguous_config(voxel_index1D_type& adjacent_compact_index,
-                                      voxel_index1D_type cur_compact_index, uint8_t cur_config_index,
+    template <typename IndexMap>
+    bool is_adjacent_ambiguous_config(compact_index_type& adjacent_compact_index,
+                                      compact_index_type cur_compact_index, uint8_t cur_config_index,
                                       const std::vector<_VoxelInfo>& compact_voxel_info,
-                                      const std::vector<voxel_index1D_type>& full_voxel_index_map,
+                                      const IndexMap& full_voxel_index_map,
                                       const uint3& num_voxels_dim)
     {
         assert(compact_voxel_info[cur_compact_index].config() == config_2B_3B_lut[cur_config_index]);
@@ -1113,8 +1163,12 @@ namespace dmc
         voxel_index1D_type index1D_to_check;
         index3D_to_1D(index3D_to_check, num_voxels_dim, index1D_to_check);
         
-        voxel_index1D_type adjc_compact_index_to_check = full_voxel_index_map[index1D_to_check];
-        assert(adjc_compact_index_to_check != INVALID_INDEX_1D);
+        compact_index_type adjc_compact_index_to_check = full_voxel_index_map[index1D_to_check];
+        if (adjc_compact_index_to_check == INVALID_COMPACT_INDEX)
+        {
+            assert(index_map_traits<IndexMap>::may_miss_voxels);
+            return false;
+        }
         
         uint8_t adj_config_index;
         if (is_ambiguous_config(compact_voxel_info[adjc_compact_index_to_check].config(), adj_config_index))
@@ -1131,8 +1185,13 @@ namespace dmc
     // Correct some of the voxels when it and its adjacent voxel are having ambiguous configs that will
     // result in non-manifold. Returns the actual number of vertices, including both iso-vertex and
     // intersection vertex between voxel bipolar edge and iso-surface.
+    //
+    // The stages from here on only need full_voxel_index_map[index1D] to give the compact index of
+    // an active voxel, so they accept any 'IndexMap' with that operator[]: the dense
+    // std::vector<compact_index_type> or a SparseVoxelIndexMap.
+    template <typename IndexMap>
     unsigned correct_voxels_info(std::vector<_VoxelInfo>& compact_voxel_info,
-                                 const std::vector<voxel_index1D_type>& full_voxel_index_map,
+                                 const IndexMap& full_voxel_index_map,
                                  const uint3& num_voxels_dim)
     {
         for (unsigned compact_index = 0; compact_index < compact_voxel_info.size(); ++compact_index)
@@ -1145,11 +1204,10 @@ namespace dmc
                 continue;
             }
             
-            voxel_index1D_type adjacent_compact_index;
+            compact_index_type adjacent_compact_index;
             if (is_adjacent_ambiguous_config(adjacent_compact_index, compact_index, ambiguous_config_index,
                                              compact_voxel_info, full_voxel_index_map, num_voxels_dim))
             {
-                std::cout << "compact_index " << compact_index << " uses lut2!" << std::endl;
                 compact_voxel_info[compact_index].encode_use_lut2(true);
                 compact_voxel_info[adjacent_compact_index].encode_use_lut2(true);
             }
@@ -1245,168 +1303,268 @@ namespace dmc
         first_bit = entry & 0x80;
         z_offset = get_offset(first_bit);
     }
-    // Sample the intersection vertices positions between voxel bipolar edges and iso-surface.
-    // Each voxel is only responsible for its local edges, namely 6, 9 and 10.
+    // Normalize 'f' unless it is the zero vector (flat field), which is left as is.
+    inline void normalize_if_nonzero(float3& f)
+    {
+        if (dot(f, f) > 0.0f)
+        {
+            normalize(f);
+        }
+    }
+    
+    // Gradient of 'scalar_grid' at the grid point (i, j, k) by central differences, one sided on
+    // the grid boundary. 'voxel_size' is the xyz extent of a voxel.
+    template <typename Grid>
+    float3 grid_point_gradient(const Grid& scalar_grid, unsigned i, unsigned j, unsigned k,
+                               const float3& voxel_size)
+    {
+        unsigned i0 = i ? i - 1 : i, i1 = std::min(i + 1, scalar_grid.dim_x() - 1);
+        unsigned j0 = j ? j - 1 : j, j1 = std::min(j + 1, scalar_grid.dim_y() - 1);
+        unsigned k0 = k ? k - 1 : k, k1 = std::min(k + 1, scalar_grid.dim_z() - 1);
+        
+        return make_float3((scalar_grid(i1, j, k) - scalar_grid(i0, j, k)) / ((i1 - i0) * voxel_size.x),
+                           (scalar_grid(i, j1, k) - scalar_grid(i, j0, k)) / ((j1 - j0) * voxel_size.y),
+                           (scalar_grid(i, j, k1) - scalar_grid(i, j, k0)) / ((k1 - k0) * voxel_size.z));
+    }
+    
+    // Calculate the intersection vertices of one voxel's bipolar local edges (6, 9, 10, in this
+    // order) and store them from 'edge_vertices' on. Returns the number of vertices written,
+    // which is vx_info.num_edge_vertices().
+    //
+    // If 'edge_normals' is given, 'voxel_corner_grads' must hold the field gradient at corners 2, 5, 6
+    // and 7 (the ends of the voxel's own edges). Each edge vertex then gets the gradient interpolated
+    // like its position, normalized.
+    uint8_t calc_voxel_edge_vertices(float3* edge_vertices, const _VoxelInfo& vx_info,
+                                     const float3* voxel_corner_pts, const float* voxel_vals, float iso_value,
+                                     float3* edge_normals = nullptr, const float3* voxel_corner_grads = nullptr)
+    {
+        uint8_t num_edge_vertices = 0;
+        auto calc_edge_vertex = [&](uint8_t edge_index, uint8_t pt0, uint8_t pt1)
+        {
+            if (vx_info.is_edge_bipolar(edge_index))
+            {
+                edge_vertices[num_edge_vertices] = lerp_float3(voxel_corner_pts[pt0],
+                                                               voxel_corner_pts[pt1],
+                                                               voxel_vals[pt0], voxel_vals[pt1],
+                                                               iso_value);
+                if (edge_normals)
+                {
+                    float3& normal = edge_normals[num_edge_vertices];
+                    normal = lerp_float3(voxel_corner_grads[pt0], voxel_corner_grads[pt1],
+                                         voxel_vals[pt0], voxel_vals[pt1], iso_value);
+                    normalize_if_nonzero(normal);
+                }
+                num_edge_vertices += 1;
+            }
+        };
+        
+        calc_edge_vertex(6, 2, 6);      // edge 6, pt 2, 6
+        calc_edge_vertex(9, 5, 6);      // edge 9, pt 5, 6
+        calc_edge_vertex(10, 6, 7);     // edge 10, pt 6, 7
+        
+        assert(num_edge_vertices == vx_info.num_edge_vertices());
+        return num_edge_vertices;
+    }
+    
+    // Active voxels per parallel_for chunk in the per voxel vertex passes.
+    const size_t VERTEX_PASS_GRAIN = 4096;
+    
+    // Each voxel only writes its own edge vertex slots, so the voxels are processed in parallel.
+    // If 'compact_normals' is given it is resized like 'compact_vertices' and its edge vertex slots
+    // get the normalized field gradient: the central difference gradients of the edge ends,
+    // interpolated like the position (the trilinear gradient restricted to the edge).
+    template <typename Grid>
     void sample_edge_intersection_vertices(std::vector<float3>& compact_vertices,
                                            const std::vector<_VoxelInfo>& compact_voxel_info,
-                                           const scalar_grid_type& scalar_grid,
-                                           const float3& xyz_min, const float3& xyz_max, float iso_value)
+                                           const Grid& scalar_grid,
+                                           const float3& xyz_min, const float3& xyz_max, float iso_value,
+                                           std::vector<float3>* compact_normals = nullptr)
     {
         float3 xyz_range = xyz_max - xyz_min;
         
         uint3 num_voxels_dim;
         get_num_voxels_dim_from_scalar_grid(num_voxels_dim, scalar_grid);
         
-        for (const _VoxelInfo& vx_info : compact_voxel_info)
+        const float3 voxel_size = make_float3(xyz_range.x / num_voxels_dim.x, xyz_range.y / num_voxels_dim.y,
+                                              xyz_range.z / num_voxels_dim.z);
+        if (compact_normals)
         {
-            voxel_index1D_type index1D = vx_info.index1D();
-            uint3 index3D;
-            index1D_to_3D(index1D, num_voxels_dim, index3D);
-            
-            float x0 = ijk_to_xyz(index3D.x,     num_voxels_dim.x, xyz_range.x, xyz_min.x);
-            float x1 = ijk_to_xyz(index3D.x + 1, num_voxels_dim.x, xyz_range.x, xyz_min.x);
-            float y0 = ijk_to_xyz(index3D.y,     num_voxels_dim.y, xyz_range.y, xyz_min.y);
-            float y1 = ijk_to_xyz(index3D.y + 1, num_voxels_dim.y, xyz_range.y, xyz_min.y);
-            float z0 = ijk_to_xyz(index3D.z,     num_voxels_dim.z, xyz_range.z, xyz_min.z);
-            float z1 = ijk_to_xyz(index3D.z + 1, num_voxels_dim.z, xyz_range.z, xyz_min.z);
-            
-            const float3 voxel_corner_pts[8] =
-            {
-                {x0, y0, z0},
-                {x1, y0, z0},
-                {x1, y1, z0},
-                {x0, y1, z0},
-                {x0, y0, z1},
-                {x1, y0, z1},
-                {x1, y1, z1},
-                {x0, y1, z1}
-            };
-            
-            const float voxel_vals[8] =
-            {
-                scalar_grid(index3D.x,     index3D.y,     index3D.z    ),
-                scalar_grid(index3D.x + 1, index3D.y,     index3D.z    ),
-                scalar_grid(index3D.x + 1, index3D.y + 1, index3D.z    ),
-                scalar_grid(index3D.x,     index3D.y + 1, index3D.z    ),
-                scalar_grid(index3D.x,     index3D.y,     index3D.z + 1),
-                scalar_grid(index3D.x + 1, index3D.y,     index3D.z + 1),
-                scalar_grid(index3D.x + 1, index3D.y + 1, index3D.z + 1),
-                scalar_grid(index3D.x,     index3D.y + 1, index3D.z + 1)
-            };
-            
-            vertex_index_type vx_edge_vertex_index = vx_info.edge_vertex_begin();
-            auto calc_edge_vertex = [&](uint8_t edge_index, uint8_t pt0, uint8_t pt1)
+            compact_normals->assign(compact_vertices.size(), make_float3(0, 0, 0));
+        }
+        
+        parallel_for(0, compact_voxel_info.size(), VERTEX_PASS_GRAIN, [&](size_t voxel_begin, size_t voxel_end)
+        {
+            for (size_t compact_index = voxel_begin; compact_index < voxel_end; ++compact_index)
             {
-                if (vx_info.is_edge_bipolar(edge_index))
+                const _VoxelInfo& vx_info = compact_voxel_info[compact_index];
+                voxel_index1D_type index1D = vx_info.index1D();
+                uint3 index3D;
+                index1D_to_3D(index1D, num_voxels_dim, index3D);
+                
+                float x0 = ijk_to_xyz(index3D.x,     num_voxels_dim.x, xyz_range.x, xyz_min.x);
+                float x1 = ijk_to_xyz(index3D.x + 1, num_voxels_dim.x, xyz_range.x, xyz_min.x);
+                float y0 = ijk_to_xyz(index3D.y,     num_voxels_dim.y, xyz_range.y, xyz_min.y);
+                float y1 = ijk_to_xyz(index3D.y + 1, num_voxels_dim.y, xyz_range.y, xyz_min.y);
+                float z0 = ijk_to_xyz(index3D.z,     num_voxels_dim.z, xyz_range.z, xyz_min.z);
+                float z1 = ijk_to_xyz(index3D.z + 1, num_voxels_dim.z, xyz_range.z, xyz_min.z);
+                
+                const float3 voxel_corner_pts[8] =
+                {
+                    {x0, y0, z0},
+                    {x1, y0, z0},
+                    {x1, y1, z0},
+                    {x0, y1, z0},
+                    {x0, y0, z1},
+                    {x1, y0, z1},
+                    {x1, y1, z1},
+                    {x0, y1, z1}
+                };
+                
+                float voxel_vals[8];
+                gather_voxel_values(voxel_vals, scalar_grid, index3D);
+                
+                if (!compact_normals)
                 {
-                    compact_vertices[vx_edge_vertex_index] = lerp_float3(voxel_corner_pts[pt0],
-                                                                         voxel_corner_pts[pt1],
-                                                                         voxel_vals[pt0], voxel_vals[pt1],
-                                                                         iso_value);
-                    vx_edge_vertex_index += 1;
+                    calc_voxel_edge_vertices(compact_vertices.data() + vx_info.edge_vertex_begin(), vx_info,
+                                             voxel_corner_pts, voxel_vals, iso_value);
+                    continue;
                 }
-            };
-            
-            calc_edge_vertex(6, 2, 6);      // edge 6, pt 2, 6
-            calc_edge_vertex(9, 5, 6);      // edge 9, pt 5, 6
-            calc_edge_vertex(10, 6, 7);     // edge 10, pt 6, 7
-            
-            assert(vx_edge_vertex_index - vx_info.edge_vertex_begin() == vx_info.num_edge_vertices());
-        }
+                
+                // Only the ends of the voxel's own edges are needed.
+                float3 voxel_corner_grads[8];
+                voxel_corner_grads[2] = grid_point_gradient(scalar_grid, index3D.x + 1, index3D.y + 1, index3D.z,
+                                                            voxel_size);
+                voxel_corner_grads[5] = grid_point_gradient(scalar_grid, index3D.x + 1, index3D.y, index3D.z + 1,
+                                                            voxel_size);
+                voxel_corner_grads[6] = grid_point_gradient(scalar_grid, index3D.x + 1, index3D.y + 1, index3D.z + 1,
+                                                            voxel_size);
+                voxel_corner_grads[7] = grid_point_gradient(scalar_grid, index3D.x, index3D.y + 1, index3D.z + 1,
+                                                            voxel_size);
+                calc_voxel_edge_vertices(compact_vertices.data() + vx_info.edge_vertex_begin(), vx_info,
+                                         voxel_corner_pts, voxel_vals, iso_value,
+                                         compact_normals->data() + vx_info.edge_vertex_begin(), voxel_corner_grads);
+            }
+        });
     }
     
-    // Calculate the iso vertices positions in each voxel.
+    // Calculate the iso vertices positions in each voxel. Each voxel only writes its own iso vertex
+    // slots, so the voxels are processed in parallel. If 'compact_normals' is given (holding the
+    // edge vertex normals of sample_edge_intersection_vertices), each iso vertex also gets the
+    // normalized average of the normals of its edge vertices.
+    template <typename IndexMap>
     void calc_iso_vertices(std::vector<float3>& compact_vertices, const std::vector<_VoxelInfo>& compact_voxel_info,
-                           const std::vector<voxel_index1D_type>& full_voxel_index_map, const uint3& num_voxels_dim)
+                           const IndexMap& full_voxel_index_map, const uint3& num_voxels_dim,
+                           std::vector<float3>* compact_normals = nullptr)
     {
-        for (const _VoxelInfo& vx_info : compact_voxel_info)
+        parallel_for(0, compact_voxel_info.size(), VERTEX_PASS_GRAIN, [&](size_t voxel_begin, size_t voxel_end)
         {
-            voxel_index1D_type index1D = vx_info.index1D();
-            uint3 index3D;
-            index1D_to_3D(index1D, num_voxels_dim, index3D);
-            
-            // const vertex_index_type (*vx_config_edge_lut)[VOXEL_NUM_EDGES];
-            // vx_config_edge_lut = vx_info.use_lut2() ? config_edge_lut2 : config_edge_lut1;
-            uint8_t iso_vertex_num_incident[4] = {0, 0, 0, 0};
-            
-            for (voxel_edge_index_type edge = 0; edge < VOXEL_NUM_EDGES; ++edge)
+            for (size_t compact_index = voxel_begin; compact_index < voxel_end; ++compact_index)
             {
-                // vx_config_edge_lut[vx_info.config][edge];
-                iso_vertex_m_type iso_vertex_m = vx_info.iso_vertex_m_by_edge(edge);
-
-                if (iso_vertex_m == NO_VERTEX)
-                {
-                    continue;
-                }
+                const _VoxelInfo& vx_info = compact_voxel_info[compact_index];
+                voxel_index1D_type index1D = vx_info.index1D();
+                uint3 index3D;
+                index1D_to_3D(index1D, num_voxels_dim, index3D);
                 
-                // Find out the voxel which is responsible for 'edge'. From that voxel we can retrieve
-                // the edge intersect vertex index.
-                uint8_t entry = edge_belonged_voxel_lut[edge];
-                voxel_edge_index_type belonged_edge = 0xff;
-                voxel_index1D_type belonged_index1D = INVALID_INDEX_1D;
+                // const vertex_index_type (*vx_config_edge_lut)[VOXEL_NUM_EDGES];
+                // vx_config_edge_lut = vx_info.use_lut2() ? config_edge_lut2 : config_edge_lut1;
+                uint8_t iso_vertex_num_incident[4] = {0, 0, 0, 0};
                 
-                if (entry == LOCAL_EDGE_ENTRY)
+                for (voxel_edge_index_type edge = 0; edge < VOXEL_NUM_EDGES; ++edge)
                 {
-                    // edge belongs to current voxel
-                    belonged_index1D = index1D;
-                    belonged_edge = edge;
-                }
-                else
-                {
-                    int8_t x_offset = 0xff, y_offset = 0xff, z_offset = 0xff;
-                    decode_edge_belong_voxel_entry(entry, x_offset, y_offset, z_offset, belonged_edge);
-                    // here the voxel we want may actually exceed boundary, so we just ignore it.
-                    bool exceed_boundary  = (x_offset < 0 && index3D.x == 0) ||
-                                            (y_offset < 0 && index3D.y == 0) ||
-                                            (z_offset < 0 && index3D.z == 0);
-                    if (exceed_boundary)
+                    // vx_config_edge_lut[vx_info.config][edge];
+                    iso_vertex_m_type iso_vertex_m = vx_info.iso_vertex_m_by_edge(edge);
+                    
+                    if (iso_vertex_m == NO_VERTEX)
+                    {
+                        continue;
+                    }
+                    
+                    // Find out the voxel which is responsible for 'edge'. From that voxel we can retrieve
+                    // the edge intersect vertex index.
+                    uint8_t entry = edge_belonged_voxel_lut[edge];
+                    voxel_edge_index_type belonged_edge = 0xff;
+                    voxel_index1D_type belonged_index1D = INVALID_INDEX_1D;
+                    
+                    if (entry == LOCAL_EDGE_ENTRY)
+                    {
+                        // edge belongs to current voxel
+                        belonged_index1D = index1D;
+                        belonged_edge = edge;
+                    }
+                    else
                     {
+                        int8_t x_offset = 0xff, y_offset = 0xff, z_offset = 0xff;
+                        decode_edge_belong_voxel_entry(entry, x_offset, y_offset, z_offset, belonged_edge);
+                        // here the voxel we want may actually exceed boundary, so we just ignore it.
+                        bool exceed_boundary  = (x_offset < 0 && index3D.x == 0) ||
+                                                (y_offset < 0 && index3D.y == 0) ||
+                                                (z_offset < 0 && index3D.z == 0);
+                        if (exceed_boundary)
+                        {
+                            continue;
+                        }
+                        
+                        index3D_to_1D(index3D.x + x_offset, index3D.y + y_offset, index3D.z + z_offset,
+                                      num_voxels_dim.x, num_voxels_dim.y, belonged_index1D);
+                    }
+                    // Get the 'belonged_voxel' which manages 'belonged_edge'
+                    compact_index_type belonged_compact_index = full_voxel_index_map[belonged_index1D];
+                    if (belonged_compact_index == INVALID_COMPACT_INDEX)
+                    {
+                        assert(index_map_traits<IndexMap>::may_miss_voxels);
                         continue;
                     }
+                    const _VoxelInfo& belonged_vx_info = compact_voxel_info[belonged_compact_index];
+                    vertex_index_type edge_intersect_vertex_index = belonged_vx_info.edge_vertex_index(belonged_edge);
+                    
+                    vertex_index_type iso_vertex_index = vx_info.iso_vertex_index(iso_vertex_m);
+                    if (iso_vertex_num_incident[iso_vertex_m] == 0)
+                    {
+                        // If this is the first time we see 'iso_vertex_m', we just assign it
+                        compact_vertices[iso_vertex_index] = compact_vertices[edge_intersect_vertex_index];
+                        if (compact_normals)
+                        {
+                            (*compact_normals)[iso_vertex_index] = (*compact_normals)[edge_intersect_vertex_index];
+                        }
+                    }
+                    else
+                    {
+                        // Otherwise we increase it
+                        compact_vertices[iso_vertex_index] += compact_vertices[edge_intersect_vertex_index];
+                        if (compact_normals)
+                        {
+                            (*compact_normals)[iso_vertex_index] += (*compact_normals)[edge_intersect_vertex_index];
+                        }
+                    }
                     
-                    index3D_to_1D(index3D.x + x_offset, index3D.y + y_offset, index3D.z + z_offset,
-                                  num_voxels_dim.x, num_voxels_dim.y, belonged_index1D);
-                    assert(full_voxel_index_map[belonged_index1D] != INVALID_UINT32);
+                    ++iso_vertex_num_incident[iso_vertex_m];
                 }
-                // Get the 'belonged_voxel' which manages 'belonged_edge'
-                const _VoxelInfo& belonged_vx_info = compact_voxel_info[full_voxel_index_map[belonged_index1D]];
-                vertex_index_type edge_intersect_vertex_index = belonged_vx_info.edge_vertex_index(belonged_edge);
-                
-                vertex_index_type iso_vertex_index = vx_info.iso_vertex_index(iso_vertex_m);
-                if (iso_vertex_num_incident[iso_vertex_m] == 0)
+                // For each iso-vertex managed by 'vx_info', calculate its new position by averaging its
+                // associated edges intersection vertex positions.
+                iso_vertex_m_type iso_vertex_m = 0;
+                for (; iso_vertex_m < vx_info.num_iso_vertices(); ++iso_vertex_m)
                 {
-                    // If this is the first time we see 'iso_vertex_m', we just assign it
-                    compact_vertices[iso_vertex_index] = compact_vertices[edge_intersect_vertex_index];
+                    vertex_index_type iso_vertex_index = vx_info.iso_vertex_index(iso_vertex_m);
+                    if (iso_vertex_num_incident[iso_vertex_m])
+                    {
+                        compact_vertices[iso_vertex_index] /= (float)(iso_vertex_num_incident[iso_vertex_m]);
+                        if (compact_normals)
+                        {
+                            normalize_if_nonzero((*compact_normals)[iso_vertex_index]);
+                        }
+                    }
                 }
-                else
+                // post check
+                if (vx_info.use_lut2())
                 {
-                    // Otherwise we increase it
-                    compact_vertices[iso_vertex_index] += compact_vertices[edge_intersect_vertex_index];
+                    assert(iso_vertex_m == num_vertex_lut2[vx_info.config()]);
                 }
-                
-                ++iso_vertex_num_incident[iso_vertex_m];
-            }
-            // For each iso-vertex managed by 'vx_info', calculate its new position by averaging its
-            // associated edges intersection vertex positions.
-            iso_vertex_m_type iso_vertex_m = 0;
-            for (; iso_vertex_m < vx_info.num_iso_vertices(); ++iso_vertex_m)
-            {
-                vertex_index_type iso_vertex_index = vx_info.iso_vertex_index(iso_vertex_m);
-                if (iso_vertex_num_incident[iso_vertex_m])
+                else
                 {
-                    compact_vertices[iso_vertex_index] /= (float)(iso_vertex_num_incident[iso_vertex_m]);
+                    assert(iso_vertex_m == num_vertex_lut1[vx_info.config()]);
                 }
             }
-            // post check
-            if (vx_info.use_lut2())
-            {
-                assert(iso_vertex_m == num_vertex_lut2[vx_info.config()]);
-            }
-            else
-            {
-                assert(iso_vertex_m == num_vertex_lut1[vx_info.config()]);
-            }
-        }
+        });
     }
     
     // Same edge shared by four voxels. Default in CCW order when looking align the positive
@@ -1664,10 +1822,12 @@ namespace dmc
         */
     }
     
-    void get_circular_vertices_by_edge(std::vector<vertex_index_type>& iso_vertex_indices,
+    // Returns false if one of the circular voxels is missing, see index_map_traits.
+    template <typename IndexMap>
+    bool get_circular_vertices_by_edge(std::vector<vertex_index_type>& iso_vertex_indices,
                                        voxel_edge_index_type edge, const uint3& index3D, const _VoxelInfo& vx_info,
                                        const std::vector<_VoxelInfo>& compact_voxel_info,
-                                       const std::vector<voxel_index1D_type>& full_voxel_index_map,
+                                       const IndexMap& full_voxel_index_map,
                                        const uint3& num_voxels_dim)
     {
         for (auto circular_edge_iter : CircularEdgeRange(edge, vx_info.is_edge_ccw(edge)))
@@ -1679,8 +1839,13 @@ namespace dmc
             voxel_index1D_type circular_index1D;
             index3D_to_1D(circular_index3D, num_voxels_dim, circular_index1D);
             
-            assert(full_voxel_index_map[circular_index1D] != INVALID_INDEX_1D);
-            const _VoxelInfo& circular_vx_info = compact_voxel_info[full_voxel_index_map[circular_index1D]];
+            compact_index_type circular_compact_index = full_voxel_index_map[circular_index1D];
+            if (circular_compact_index == INVALID_COMPACT_INDEX)
+            {
+                assert(index_map_traits<IndexMap>::may_miss_voxels);
+                return false;
+            }
+            const _VoxelInfo& circular_vx_info = compact_voxel_info[circular_compact_index];
             
             iso_vertex_m_type circular_iso_vertex_m = circular_vx_info.iso_vertex_m_by_edge(circular_edge);
             assert(circular_iso_vertex_m != NO_VERTEX);
@@ -1689,6 +1854,7 @@ namespace dmc
             iso_vertex_indices.push_back(circular_iso_vertex_index);
         }
         assert(iso_vertex_indices.size() == 4);
+        return true;
     }
     
     void project_vertices_by_shared_edge(std::vector<float2>& projected_vertex_pos,
@@ -1745,10 +1911,12 @@ namespace dmc
         return (-EPSILON < beta) && (-EPSILON < gamma) && (beta + gamma < 1.0 + EPSILON);
     }
     
-    void smooth_edge_vertices(std::vector<float3>& compact_vertices,
-                              const std::vector<_VoxelInfo>& compact_voxel_info,
-                              const std::vector<voxel_index1D_type>& full_voxel_index_map,
-                              const float3& xyz_min, const float3& xyz_max, const uint3& num_voxels_dim)
+    // Returns the number of edge vertices that were moved.
+    template <typename IndexMap>
+    unsigned smooth_edge_vertices(std::vector<float3>& compact_vertices,
+                                  const std::vector<_VoxelInfo>& compact_voxel_info,
+                                  const IndexMap& full_voxel_index_map,
+                                  const float3& xyz_min, const float3& xyz_max, const uint3& num_voxels_dim)
     {
         static const std::vector<voxel_edge_index_type> edges_vec = {6, 9, 10};
         const float3 xyz_range = xyz_max - xyz_min;
@@ -1769,8 +1937,11 @@ namespace dmc
                 }
                 
                 std::vector<vertex_index_type> iso_vertex_indices;
-                get_circular_vertices_by_edge(iso_vertex_indices, edge, index3D, vx_info,
-                                              compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+                if (!get_circular_vertices_by_edge(iso_vertex_indices, edge, index3D, vx_info,
+                                                   compact_voxel_info, full_voxel_index_map, num_voxels_dim))
+                {
+                    continue;
+                }
                 
                 std::vector<float2> projected_vertex_pos;
                 project_vertices_by_shared_edge(projected_vertex_pos, edge,
@@ -1834,47 +2005,289 @@ namespace dmc
             //if (changed > 9)
             //    break;
         }
-        std::cout << "num smoothed: " << changed << std::endl;
+        return changed;
     }
 
+    // Call fn(quad) for the quad of each bipolar edge (6, 9, 10) that 'vx_info' manages: the iso
+    // vertices of the four voxels around the edge, in the order that gives the surface its
+    // orientation.
+    template <typename IndexMap, typename Fn>
+    void for_each_voxel_quad(const _VoxelInfo& vx_info, const std::vector<_VoxelInfo>& compact_voxel_info,
+                             const IndexMap& full_voxel_index_map, const uint3& num_voxels_dim, const Fn& fn)
+    {
+        static const voxel_edge_index_type edges[3] = {6, 9, 10};
+        
+        uint3 index3D;
+        index1D_to_3D(vx_info.index1D(), num_voxels_dim, index3D);
+        
+        for (voxel_edge_index_type edge : edges)
+        {
+            if ((!vx_info.is_edge_bipolar(edge)) ||
+                circular_edge_exceed_boundary(edge, index3D, num_voxels_dim))
+            {
+                continue;
+            }
+            
+            std::vector<vertex_index_type> iso_vertex_indices;
+            if (!get_circular_vertices_by_edge(iso_vertex_indices, edge, index3D, vx_info,
+                                               compact_voxel_info, full_voxel_index_map, num_voxels_dim))
+            {
+                continue;
+            }
+            
+            fn(make_uint4(iso_vertex_indices[0], iso_vertex_indices[1], iso_vertex_indices[2], iso_vertex_indices[3]));
+        }
+    }
+    
+    // Append the two triangles of each quad of 'vx_info', split along the (0, 2) diagonal.
+    template <typename IndexMap>
+    void generate_voxel_triangles(std::vector<uint3>& compact_triangles, const _VoxelInfo& vx_info,
+                                  const std::vector<_VoxelInfo>& compact_voxel_info,
+                                  const IndexMap& full_voxel_index_map,
+                                  const uint3& num_voxels_dim)
+    {
+        for_each_voxel_quad(vx_info, compact_voxel_info, full_voxel_index_map, num_voxels_dim, [&](const uint4& quad)
+        {
+            uint3 tri1 = make_uint3(quad.x, quad.y, quad.z);
+            uint3 tri2 = make_uint3(quad.z, quad.w, quad.x);
+            compact_triangles.push_back(tri1);
+            compact_triangles.push_back(tri2);
+        });
+    }
+    
+    // Append the quads of 'vx_info' as they are.
+    template <typename IndexMap>
+    void generate_voxel_quads(std::vector<uint4>& compact_quads, const _VoxelInfo& vx_info,
+                              const std::vector<_VoxelInfo>& compact_voxel_info,
+                              const IndexMap& full_voxel_index_map,
+                              const uint3& num_voxels_dim)
+    {
+        for_each_voxel_quad(vx_info, compact_voxel_info, full_voxel_index_map, num_voxels_dim, [&](const uint4& quad)
+        {
+            compact_quads.push_back(quad);
+        });
+    }
+    
     // Genreate the actual triangles information of the mesh.
+    template <typename IndexMap>
     void generate_triangles(std::vector<uint3>& compact_triangles,
                             const std::vector<_VoxelInfo>& compact_voxel_info,
-                            const std::vector<voxel_index1D_type>& full_voxel_index_map,
+                            const IndexMap& full_voxel_index_map,
                             const uint3& num_voxels_dim)
     {
         compact_triangles.clear();
         
-        static const std::vector<voxel_edge_index_type> edges_vec = {6, 9, 10};
+        for (const _VoxelInfo& vx_info : compact_voxel_info)
+        {
+            generate_voxel_triangles(compact_triangles, vx_info, compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+        }
+    }
+    
+    // Quad mesh output: the same faces as generate_triangles, before the split. Four indices per
+    // face instead of six; split_quads() turns them into triangles later if needed.
+    template <typename IndexMap>
+    void generate_quads(std::vector<uint4>& compact_quads,
+                        const std::vector<_VoxelInfo>& compact_voxel_info,
+                        const IndexMap& full_voxel_index_map,
+                        const uint3& num_voxels_dim)
+    {
+        compact_quads.clear();
         
         for (const _VoxelInfo& vx_info : compact_voxel_info)
         {
-            uint3 index3D;
-            index1D_to_3D(vx_info.index1D(), num_voxels_dim, index3D);
-
-            for (voxel_edge_index_type edge : edges_vec)
+            generate_voxel_quads(compact_quads, vx_info, compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+        }
+    }
+    
+    // Pick the generator by the type of the output face buffer. 'compact_vertices' holds the final
+    // vertex positions, for the buffers that keep geometric data next to the faces.
+    template <typename IndexMap>
+    void generate_faces(std::vector<uint3>& compact_triangles, const std::vector<float3>& /*compact_vertices*/,
+                        const std::vector<_VoxelInfo>& compact_voxel_info,
+                        const IndexMap& full_voxel_index_map, const uint3& num_voxels_dim)
+    {
+        generate_triangles(compact_triangles, compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+    }
+    
+    template <typename IndexMap>
+    void generate_faces(std::vector<uint4>& compact_quads, const std::vector<float3>& /*compact_vertices*/,
+                        const std::vector<_VoxelInfo>& compact_voxel_info,
+                        const IndexMap& full_voxel_index_map, const uint3& num_voxels_dim)
+    {
+        generate_quads(compact_quads, compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+    }
+    
+    // Group the active voxels by brick of brick_size^3 voxels, for the output modes that build
+    // their faces brick by brick. The compact indices of the voxels of the i-th non empty brick
+    // (in brick index1D order) end up in voxels[brick_begin[i], brick_begin[i + 1]), in index1D
+    // order within the brick; 'brick_ids', if given, gets the index1D of each of those bricks.
+    void bucket_voxels_by_brick(std::vector<compact_index_type>& voxels, std::vector<size_t>& brick_begin,
+                                std::vector<voxel_index1D_type>* brick_ids,
+                                const std::vector<_VoxelInfo>& compact_voxel_info,
+                                const uint3& num_voxels_dim, unsigned brick_size)
+    {
+        const unsigned B = brick_size;
+        const uint3 num_bricks_dim = make_uint3((num_voxels_dim.x + B - 1) / B, (num_voxels_dim.y + B - 1) / B,
+                                                (num_voxels_dim.z + B - 1) / B);
+        struct BrickVoxel
+        {
+            voxel_index1D_type brick;
+            compact_index_type compact_index;
+        };
+        std::vector<BrickVoxel> brick_voxels(compact_voxel_info.size());
+        parallel_for(0, compact_voxel_info.size(), VERTEX_PASS_GRAIN, [&](size_t voxel_begin, size_t voxel_end)
+        {
+            for (size_t compact_index = voxel_begin; compact_index < voxel_end; ++compact_index)
             {
-                /*
-                std::cout << "is edge " << (unsigned)edge << " bipolar: "
-                << vx_info.is_edge_bipolar(edge) << std::endl;
-                std::cout << "edge exceeds boundary: "
-                << circular_edge_exceed_boundary(edge, index3D, num_voxels_dim) << std::endl;
-                */
-                if ((!vx_info.is_edge_bipolar(edge)) ||
-                    circular_edge_exceed_boundary(edge, index3D, num_voxels_dim))
-                {
-                    continue;
-                }
+                uint3 index3D;
+                index1D_to_3D(compact_voxel_info[compact_index].index1D(), num_voxels_dim, index3D);
+                voxel_index1D_type brick;
+                index3D_to_1D(make_uint3(index3D.x / B, index3D.y / B, index3D.z / B), num_bricks_dim, brick);
+                brick_voxels[compact_index] = { brick, (compact_index_type)compact_index };
+            }
+        });
+        parallel_sort(brick_voxels.begin(), brick_voxels.end(), [](const BrickVoxel& a, const BrickVoxel& b)
+        {
+            return (a.brick < b.brick) || ((a.brick == b.brick) && (a.compact_index < b.compact_index));
+        });
+        
+        voxels.resize(brick_voxels.size());
+        brick_begin.clear();
+        if (brick_ids) brick_ids->clear();
+        for (size_t i = 0; i < brick_voxels.size(); ++i)
+        {
+            voxels[i] = brick_voxels[i].compact_index;
+            if ((i == 0) || (brick_voxels[i].brick != brick_voxels[i - 1].brick))
+            {
+                brick_begin.push_back(i);
+                if (brick_ids) brick_ids->push_back(brick_voxels[i].brick);
+            }
+        }
+        brick_begin.push_back(brick_voxels.size());
+    }
+    
+    // Shape quality of the triangle (p0, p1, p2): 4 * sqrt(3) * area / (sum of the squared edge
+    // lengths), 1 for an equilateral triangle and 0 for a degenerate one.
+    inline float triangle_quality(const float3& p0, const float3& p1, const float3& p2)
+    {
+        float3 e0 = p1 - p0, e1 = p2 - p1, e2 = p0 - p2;
+        float sum_sq = dot(e0, e0) + dot(e1, e1) + dot(e2, e2);
+        if (sum_sq <= 0.0f)
+        {
+            return 0.0f;
+        }
+        float3 n = cross(p1 - p0, p2 - p0);
+        return 2.0f * sqrtf(3.0f) * sqrtf(dot(n, n)) / sum_sq;
+    }
+    
+    // Split every quad of 'compact_quads' into two triangles along the diagonal that gives the
+    // better worst triangle (by triangle_quality), keeping the orientation. Quad i becomes
+    // triangles 2i and 2i + 1, so the quads are split in parallel. The (0, 2) diagonal, the one
+    // generate_triangles always uses, wins ties.
+    void split_quads(std::vector<uint3>& compact_triangles, const std::vector<uint4>& compact_quads,
+                     const std::vector<float3>& compact_vertices)
+    {
+        compact_triangles.resize(2 * compact_quads.size());
+        
+        parallel_for(0, compact_quads.size(), VERTEX_PASS_GRAIN, [&](size_t quad_begin, size_t quad_end)
+        {
+            for (size_t quad_index = quad_begin; quad_index < quad_end; ++quad_index)
+            {
+                const uint4& quad = compact_quads[quad_index];
+                const float3& p0 = compact_vertices[quad.x];
+                const float3& p1 = compact_vertices[quad.y];
+                const float3& p2 = compact_vertices[quad.z];
+                const float3& p3 = compact_vertices[quad.w];
                 
-                std::vector<vertex_index_type> iso_vertex_indices;
-                get_circular_vertices_by_edge(iso_vertex_indices, edge, index3D, vx_info,
-                                              compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+                float quality02 = std::min(triangle_quality(p0, p1, p2), triangle_quality(p2, p3, p0));
+                float quality13 = std::min(triangle_quality(p1, p2, p3), triangle_quality(p3, p0, p1));
                 
-                uint3 tri1 = make_uint3(iso_vertex_indices[0], iso_vertex_indices[1], iso_vertex_indices[2]);
-                uint3 tri2 = make_uint3(iso_vertex_indices[2], iso_vertex_indices[3], iso_vertex_indices[0]);
-                compact_triangles.push_back(tri1);
-                compact_triangles.push_back(tri2);
+                uint3* tris = compact_triangles.data() + 2 * quad_index;
+                if (quality13 > quality02)
+                {
+                    tris[0] = make_uint3(quad.y, quad.z, quad.w);
+                    tris[1] = make_uint3(quad.w, quad.x, quad.y);
+                }
+                else
+                {
+                    tris[0] = make_uint3(quad.x, quad.y, quad.z);
+                    tris[1] = make_uint3(quad.z, quad.w, quad.x);
+                }
+            }
+        });
+    }
+    
+    inline void remap_face_vertices(uint3& triangle, const std::vector<vertex_index_type>& vertex_remap)
+    {
+        triangle = make_uint3(vertex_remap[triangle.x], vertex_remap[triangle.y], vertex_remap[triangle.z]);
+    }
+    
+    inline void remap_face_vertices(uint4& quad, const std::vector<vertex_index_type>& vertex_remap)
+    {
+        quad = make_uint4(vertex_remap[quad.x], vertex_remap[quad.y], vertex_remap[quad.z], vertex_remap[quad.w]);
+    }
+    
+    // Remap the vertex indices of every face of 'compact_faces', in parallel.
+    template <typename Face>
+    void remap_faces(std::vector<Face>& compact_faces, const std::vector<vertex_index_type>& vertex_remap)
+    {
+        parallel_for(0, compact_faces.size(), VERTEX_PASS_GRAIN, [&](size_t face_begin, size_t face_end)
+        {
+            for (size_t face_index = face_begin; face_index < face_end; ++face_index)
+            {
+                remap_face_vertices(compact_faces[face_index], vertex_remap);
+            }
+        });
+    }
+    
+    // Output stage: keep only the iso vertices in 'compact_vertices' (and 'compact_normals'). The
+    // edge intersection vertices are only needed to place the iso vertices and to smooth, the faces
+    // never use them. The iso vertices keep their voxel order, and each voxel's new offset comes
+    // from a parallel scan of its iso vertex count; the vertices and then the faces are remapped
+    // in parallel.
+    template <typename FaceBuffer>
+    void compact_iso_vertices(std::vector<float3>& compact_vertices, FaceBuffer& compact_faces,
+                              const std::vector<_VoxelInfo>& compact_voxel_info,
+                              std::vector<float3>* compact_normals = nullptr)
+    {
+        std::vector<vertex_index_type> iso_vertex_offsets;
+        vertex_index_type num_iso_vertices =
+            parallel_exclusive_scan(iso_vertex_offsets, compact_voxel_info.size(), VERTEX_PASS_GRAIN,
+                                    [&](size_t compact_index)
+                                    {
+                                        return (vertex_index_type)compact_voxel_info[compact_index].num_iso_vertices();
+                                    });
+        
+        // Only the iso vertex entries of 'vertex_remap' are set, they are the only ones the faces use.
+        std::vector<vertex_index_type> vertex_remap(compact_vertices.size());
+        std::vector<float3> iso_vertices(num_iso_vertices);
+        std::vector<float3> iso_normals(compact_normals ? num_iso_vertices : 0);
+        
+        parallel_for(0, compact_voxel_info.size(), VERTEX_PASS_GRAIN, [&](size_t voxel_begin, size_t voxel_end)
+        {
+            for (size_t compact_index = voxel_begin; compact_index < voxel_end; ++compact_index)
+            {
+                const _VoxelInfo& vx_info = compact_voxel_info[compact_index];
+                vertex_index_type new_index = iso_vertex_offsets[compact_index];
+                for (iso_vertex_m_type iso_vertex_m = 0; iso_vertex_m < vx_info.num_iso_vertices(); ++iso_vertex_m, ++new_index)
+                {
+                    vertex_index_type iso_vertex_index = vx_info.iso_vertex_index(iso_vertex_m);
+                    iso_vertices[new_index] = compact_vertices[iso_vertex_index];
+                    if (compact_normals)
+                    {
+                        iso_normals[new_index] = (*compact_normals)[iso_vertex_index];
+                    }
+                    vertex_remap[iso_vertex_index] = new_index;
+                }
             }
+        });
+        
+        remap_faces(compact_faces, vertex_remap);
+        
+        compact_vertices.swap(iso_vertices);
+        if (compact_normals)
+        {
+            compact_normals->swap(iso_normals);
         }
     }
     
@@ -1884,41 +2297,446 @@ namespace dmc
         return os;
     }
     
-    void run_dmc(std::vector<float3>& compact_vertices, std::vector<uint3>& compact_triangles,
-                 const scalar_grid_type& scalar_grid, const float3& xyz_min, const float3& xyz_max, float iso_value,
-                 unsigned num_smooth = 0)
+    // Wall time (ms) of each run_dmc stage and the counters of what it produced. run_dmc
+    // only fills this when the caller hands one in; nothing is printed.
+    struct DmcStats
     {
-        compact_triangles.clear();
+        // Field evaluation, only spent by the fused (field functor) run_dmc.
+        double sample_field_ms = 0.0;
+        double flag_active_voxels_ms = 0.0;
+        double compact_voxel_flags_ms = 0.0;
+        double init_voxels_info_ms = 0.0;
+        double correct_voxels_info_ms = 0.0;
+        double sample_edge_vertices_ms = 0.0;
+        double calc_iso_vertices_ms = 0.0;
+        // All the smoothing iterations, including the calc_iso_vertices after each one.
+        double smooth_ms = 0.0;
+        double generate_triangles_ms = 0.0;
+        double compact_iso_vertices_ms = 0.0;
+        double total_ms = 0.0;
+        
+        size_t num_voxels = 0;
+        size_t num_active_voxels = 0;
+        size_t num_lut2_voxels = 0;
+        // Output vertices, the iso vertices only.
+        size_t num_vertices = 0;
+        size_t num_triangles = 0;
+        // Quad output only: the quads emitted. num_triangles then counts the two triangles of each.
+        size_t num_quads = 0;
+        // Meshlet output only.
+        size_t num_meshlets = 0;
+        // Number of edge vertices moved by each smoothing iteration.
+        std::vector<unsigned> num_smoothed_per_iter;
+        
+        // Peak capacity, in bytes, reached by each buffer during the run.
+        size_t voxel_flags_bytes = 0;
+        size_t full_voxel_index_map_bytes = 0;
+        size_t compact_voxel_info_bytes = 0;
+        size_t compact_vertices_bytes = 0;
+        // The face buffer, triangles or quads.
+        size_t compact_triangles_bytes = 0;
+        // Fused and narrow band run_dmc only: the two grid slices (fused) and the edge vertices
+        // kept until the vertex layout is known.
+        size_t field_slices_bytes = 0;
+        size_t edge_vertex_stream_bytes = 0;
+        
+        // Filled by reorder_mesh (mesh_reorder.h), not by run_dmc: its time and the average cache
+        // miss ratio of the triangles before and after it.
+        double reorder_mesh_ms = 0.0;
+        double acmr_before = 0.0;
+        double acmr_after = 0.0;
+        
+        // Filled by run_adaptive_dmc (adaptive_dmc.h), not by run_dmc: the time to build its
+        // octree and the number of leaves of the octree.
+        double build_octree_ms = 0.0;
+        size_t num_octree_leaves = 0;
+    };
+    
+    template <typename Vec>
+    inline void record_peak_bytes(size_t& peak_bytes, const Vec& vec)
+    {
+        peak_bytes = std::max(peak_bytes, vec.capacity() * sizeof(typename Vec::value_type));
+    }
+    
+    inline void record_face_counts(DmcStats& stats, const std::vector<uint3>& compact_triangles)
+    {
+        stats.num_triangles = compact_triangles.size();
+    }
+    
+    inline void record_face_counts(DmcStats& stats, const std::vector<uint4>& compact_quads)
+    {
+        stats.num_quads = compact_quads.size();
+        stats.num_triangles = 2 * compact_quads.size();
+    }
+    
+    // The stages shared by every run_dmc flavour once the edge intersection vertices are in
+    // 'compact_vertices': iso vertices, smoothing, triangles and compact_iso_vertices, so only the
+    // iso vertices are left in the output. Fills the matching 'stats' entries and the counters that
+    // only depend on the compact buffers.
+    //
+    // 'compact_normals', if given, must hold the edge vertex normals; the iso vertex normals are
+    // averaged from them once, before smoothing, and are not updated after it. With num_smooth > 0
+    // they are the normals of the unsmoothed surface, at vertices up to a fraction of a voxel away.
+    //
+    // The faces are triangles, quads (std::vector<uint4>, see generate_quads) or meshlets
+    // (MeshletMesh, see meshlets.h), by the type of 'compact_faces'.
+    template <typename IndexMap, typename FaceBuffer>
+    void finish_dmc(std::vector<float3>& compact_vertices, FaceBuffer& compact_faces,
+                    const std::vector<_VoxelInfo>& compact_voxel_info, const IndexMap& full_voxel_index_map,
+                    const float3& xyz_min, const float3& xyz_max, const uint3& num_voxels_dim,
+                    unsigned num_smooth, DmcStats* stats, Timer& timer,
+                    std::vector<float3>* compact_normals = nullptr)
+    {
+        calc_iso_vertices(compact_vertices, compact_voxel_info, full_voxel_index_map, num_voxels_dim, compact_normals);
+        if (stats) stats->calc_iso_vertices_ms = timer.lap_ms();
+        
+        for (unsigned smooth_iter = 0; smooth_iter < num_smooth; ++smooth_iter)
+        {
+            unsigned num_smoothed = smooth_edge_vertices(compact_vertices, compact_voxel_info, full_voxel_index_map,
+                                                         xyz_min, xyz_max, num_voxels_dim);
+            calc_iso_vertices(compact_vertices, compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+            if (stats) stats->num_smoothed_per_iter.push_back(num_smoothed);
+        }
+        if (stats) stats->smooth_ms = timer.lap_ms();
+        
+        generate_faces(compact_faces, compact_vertices, compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+        if (stats)
+        {
+            stats->generate_triangles_ms = timer.lap_ms();
+            record_peak_bytes(stats->compact_vertices_bytes, compact_vertices);
+        }
+        
+        compact_iso_vertices(compact_vertices, compact_faces, compact_voxel_info, compact_normals);
+        
+        if (stats)
+        {
+            stats->compact_iso_vertices_ms = timer.lap_ms();
+            stats->total_ms = timer.elapsed_ms();
+            
+            stats->num_voxels = (size_t)num_voxels_dim.x * num_voxels_dim.y * num_voxels_dim.z;
+            stats->num_active_voxels = compact_voxel_info.size();
+            stats->num_lut2_voxels = std::count_if(compact_voxel_info.begin(), compact_voxel_info.end(),
+                                                   [](const _VoxelInfo& vx_info) { return vx_info.use_lut2(); });
+            stats->num_vertices = compact_vertices.size();
+            record_face_counts(*stats, compact_faces);
+            
+            record_peak_bytes(stats->compact_voxel_info_bytes, compact_voxel_info);
+            record_peak_bytes(stats->compact_vertices_bytes, compact_vertices);
+            record_peak_bytes(stats->compact_triangles_bytes, compact_faces);
+        }
+    }
+    
+    // If 'compact_normals' is given it gets one normal per entry of 'compact_vertices': the
+    // normalized gradient of 'scalar_grid' (central differences), pointing towards increasing
+    // values, which is the side the triangles face. The normals are taken before smoothing (see
+    // finish_dmc).
+    //
+    // 'compact_faces' is std::vector<uint3> for triangles, std::vector<uint4> for quads (see
+    // generate_quads and split_quads), a MeshletMesh (see meshlets.h) or a BrickMesh (see
+    // brick_mesh.h). 'scalar_grid' can use any Array3D layout; the tiled ones keep the corner
+    // gathers of large grids local.
+    template <typename FaceBuffer, typename Layout, typename Allocator>
+    void run_dmc(std::vector<float3>& compact_vertices, FaceBuffer& compact_faces,
+                 const utils::Array3D<float, Layout, Allocator>& scalar_grid, const float3& xyz_min, const float3& xyz_max, float iso_value,
+                 unsigned num_smooth = 0, DmcStats* stats = nullptr, std::vector<float3>* compact_normals = nullptr)
+    {
+        Timer timer;
+        if (stats) *stats = DmcStats();
+        
+        compact_faces.clear();
         
         uint3 num_voxels_dim;
         get_num_voxels_dim_from_scalar_grid(num_voxels_dim, scalar_grid);
         
-        std::vector<flag_type> voxel_flags;
+        huge_page_vector<flag_type> voxel_flags;
         flag_active_voxels(voxel_flags, scalar_grid, iso_value);
+        if (stats) stats->flag_active_voxels_ms = timer.lap_ms();
         
         std::vector<_VoxelInfo> compact_voxel_info;
-        std::vector<voxel_index1D_type> full_voxel_index_map;
-        compact_voxel_flags(compact_voxel_info, full_voxel_index_map, voxel_flags);
+        huge_page_vector<compact_index_type> full_voxel_index_map;
+        compact_voxel_flags(compact_voxel_info, full_voxel_index_map, voxel_flags,
+                            (size_t)num_voxels_dim.x * num_voxels_dim.y);
+        if (stats)
+        {
+            stats->compact_voxel_flags_ms = timer.lap_ms();
+            record_peak_bytes(stats->voxel_flags_bytes, voxel_flags);
+            record_peak_bytes(stats->full_voxel_index_map_bytes, full_voxel_index_map);
+        }
         
         init_voxels_info(compact_voxel_info, scalar_grid, iso_value);
+        if (stats) stats->init_voxels_info_ms = timer.lap_ms();
+        
         unsigned num_total_vertices = correct_voxels_info(compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+        if (stats) stats->correct_voxels_info_ms = timer.lap_ms();
         
         compact_vertices.clear();
         compact_vertices.resize(num_total_vertices);
         sample_edge_intersection_vertices(compact_vertices, compact_voxel_info, scalar_grid,
-                                          xyz_min, xyz_max, iso_value);
-        calc_iso_vertices(compact_vertices, compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+                                          xyz_min, xyz_max, iso_value, compact_normals);
+        if (stats) stats->sample_edge_vertices_ms = timer.lap_ms();
         
+        finish_dmc(compact_vertices, compact_faces, compact_voxel_info, full_voxel_index_map,
+                   xyz_min, xyz_max, num_voxels_dim, num_smooth, stats, timer, compact_normals);
+    }
+    
+    // Drop-in replacement for the dense full_voxel_index_map whose size scales with the number of
+    // active voxels instead of the volume. 'compact_voxel_info' must be sorted by index1D (every
+    // front end produces it in that order). It keeps the first compact index of each voxel slab
+    // (fixed k) and finds a voxel by binary search within its slab.
+    class SparseVoxelIndexMap
+    {
+    public:
+        SparseVoxelIndexMap(const std::vector<_VoxelInfo>& compact_voxel_info, const uint3& num_voxels_dim)
+        : m_compact_voxel_info(compact_voxel_info)
+        , m_num_voxels_xy((voxel_index1D_type)num_voxels_dim.x * num_voxels_dim.y)
+        , m_slab_begin(num_voxels_dim.z + 1)
+        {
+            compact_index_type compact_index = 0;
+            for (unsigned k = 0; k <= num_voxels_dim.z; ++k)
+            {
+                while ((compact_index < compact_voxel_info.size()) &&
+                       (compact_voxel_info[compact_index].index1D() < k * m_num_voxels_xy))
+                {
+                    ++compact_index;
+                }
+                m_slab_begin[k] = compact_index;
+            }
+        }
         
-        for (unsigned smooth_iter = 0; smooth_iter < num_smooth; ++smooth_iter)
+        // Returns INVALID_COMPACT_INDEX if the voxel is not active.
+        compact_index_type operator[](voxel_index1D_type index1D) const
         {
-            std::cout << "smooth iter: " << smooth_iter << std::endl;
-            smooth_edge_vertices(compact_vertices, compact_voxel_info, full_voxel_index_map,
-                                 xyz_min, xyz_max, num_voxels_dim);
-            calc_iso_vertices(compact_vertices, compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+            unsigned k = (unsigned)(index1D / m_num_voxels_xy);
+            auto first = m_compact_voxel_info.begin() + m_slab_begin[k];
+            auto last = m_compact_voxel_info.begin() + m_slab_begin[k + 1];
+            auto found = std::lower_bound(first, last, index1D,
+                                          [](const _VoxelInfo& vx_info, voxel_index1D_type index1D)
+                                          {
+                                              return vx_info.index1D() < index1D;
+                                          });
+            if ((found == last) || (found->index1D() != index1D))
+            {
+                return INVALID_COMPACT_INDEX;
+            }
+            return (compact_index_type)(found - m_compact_voxel_info.begin());
         }
         
-        generate_triangles(compact_triangles, compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+        size_t num_bytes() const { return m_slab_begin.capacity() * sizeof(compact_index_type); }
+        
+    private:
+        const std::vector<_VoxelInfo>& m_compact_voxel_info;
+        voxel_index1D_type m_num_voxels_xy;
+        std::vector<compact_index_type> m_slab_begin;
+    };
+    
+    // The sparse front ends include the narrow band, which can miss blocks when the Lipschitz
+    // bound is only an estimate.
+    template <>
+    struct index_map_traits<SparseVoxelIndexMap>
+    {
+        static const bool may_miss_voxels = true;
+    };
+    
+    // For the front ends that classify voxels on the fly from their corner values: if the voxel
+    // 'index1D' is active, append its info to 'compact_voxel_info' and its edge intersection
+    // vertices to 'edge_vertex_stream'. The voxel spans [x0, x1] x [y0, y1] x [z0, z1].
+    bool append_if_active(std::vector<_VoxelInfo>& compact_voxel_info, std::vector<float3>& edge_vertex_stream,
+                          voxel_index1D_type index1D, const float* voxel_vals,
+                          float x0, float x1, float y0, float y1, float z0, float z1, float iso_value)
+    {
+        voxel_config_type voxel_config = voxel_config_mask(voxel_vals, iso_value);
+        if (!voxel_config || voxel_config == MAX_VOXEL_CONFIG_MASK)
+        {
+            return false;
+        }
+        
+        compact_voxel_info.push_back(_VoxelInfo(index1D));
+        _VoxelInfo& vx_info = compact_voxel_info.back();
+        init_voxel_info(vx_info, voxel_vals, iso_value);
+        
+        const float3 voxel_corner_pts[8] =
+        {
+            {x0, y0, z0},
+            {x1, y0, z0},
+            {x1, y1, z0},
+            {x0, y1, z0},
+            {x0, y0, z1},
+            {x1, y0, z1},
+            {x1, y1, z1},
+            {x0, y1, z1}
+        };
+        
+        float3 voxel_edge_vertices[3];
+        uint8_t num_edge_vertices = calc_voxel_edge_vertices(voxel_edge_vertices, vx_info, voxel_corner_pts,
+                                                             voxel_vals, iso_value);
+        edge_vertex_stream.insert(edge_vertex_stream.end(), voxel_edge_vertices,
+                                  voxel_edge_vertices + num_edge_vertices);
+        return true;
+    }
+    
+    // Move the edge vertices from 'edge_vertex_stream' (in compact order) to the slots that
+    // correct_voxels_info assigned to them in 'compact_vertices'.
+    void place_edge_vertices(std::vector<float3>& compact_vertices, const std::vector<_VoxelInfo>& compact_voxel_info,
+                             const std::vector<float3>& edge_vertex_stream)
+    {
+        const float3* edge_vertex = edge_vertex_stream.data();
+        for (const _VoxelInfo& vx_info : compact_voxel_info)
+        {
+            uint8_t num_edge_vertices = vx_info.num_edge_vertices();
+            std::copy(edge_vertex, edge_vertex + num_edge_vertices,
+                      compact_vertices.begin() + vx_info.edge_vertex_begin());
+            edge_vertex += num_edge_vertices;
+        }
+    }
+    
+    // Rest of the pipeline for the front ends that build 'compact_voxel_info' and
+    // 'edge_vertex_stream' themselves: resolve the ambiguous configs, lay out the vertices, move
+    // the edge vertices in place and run finish_dmc.
+    template <typename IndexMap>
+    void finish_dmc_from_stream(std::vector<float3>& compact_vertices, std::vector<uint3>& compact_triangles,
+                                std::vector<_VoxelInfo>& compact_voxel_info, std::vector<float3>& edge_vertex_stream,
+                                const IndexMap& full_voxel_index_map,
+                                const float3& xyz_min, const float3& xyz_max, const uint3& num_voxels_dim,
+                                unsigned num_smooth, DmcStats* stats, Timer& timer)
+    {
+        unsigned num_total_vertices = correct_voxels_info(compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+        if (stats) stats->correct_voxels_info_ms = timer.lap_ms();
+        
+        compact_vertices.clear();
+        compact_vertices.resize(num_total_vertices);
+        place_edge_vertices(compact_vertices, compact_voxel_info, edge_vertex_stream);
+        if (stats)
+        {
+            stats->sample_edge_vertices_ms = timer.lap_ms();
+            record_peak_bytes(stats->edge_vertex_stream_bytes, edge_vertex_stream);
+        }
+        std::vector<float3>().swap(edge_vertex_stream);
+        
+        finish_dmc(compact_vertices, compact_triangles, compact_voxel_info, full_voxel_index_map,
+                   xyz_min, xyz_max, num_voxels_dim, num_smooth, stats, timer);
+    }
+    
+    // finish_dmc_from_stream with a SparseVoxelIndexMap ('compact_voxel_info' sorted by index1D).
+    void finish_dmc_sparse(std::vector<float3>& compact_vertices, std::vector<uint3>& compact_triangles,
+                           std::vector<_VoxelInfo>& compact_voxel_info, std::vector<float3>& edge_vertex_stream,
+                           const float3& xyz_min, const float3& xyz_max, const uint3& num_voxels_dim,
+                           unsigned num_smooth, DmcStats* stats, Timer& timer)
+    {
+        SparseVoxelIndexMap full_voxel_index_map(compact_voxel_info, num_voxels_dim);
+        if (stats) stats->full_voxel_index_map_bytes = full_voxel_index_map.num_bytes();
+        
+        finish_dmc_from_stream(compact_vertices, compact_triangles, compact_voxel_info, edge_vertex_stream,
+                               full_voxel_index_map, xyz_min, xyz_max, num_voxels_dim, num_smooth, stats, timer);
+    }
+    
+    // A field for the fused run_dmc is either an Isosurface-like object with value(x, y, z) or
+    // any callable field(x, y, z). The int/long argument prefers value() when both exist.
+    template <typename Field>
+    auto eval_field(const Field& field, float x, float y, float z, int) -> decltype(field.value(x, y, z))
+    {
+        return field.value(x, y, z);
+    }
+    
+    template <typename Field>
+    auto eval_field(const Field& field, float x, float y, float z, long) -> decltype(field(x, y, z))
+    {
+        return field(x, y, z);
+    }
+    
+    // Fused sample-and-extract for analytic fields: the same mesh as sampling 'field' into a
+    // (num_voxels_dim + 1) grid over [xyz_min, xyz_max] and calling run_dmc on it, without ever
+    // allocating that grid. The field is evaluated one z-slice at a time into a rolling pair of
+    // slices; each voxel slab is classified as soon as both of its slices are there, and the
+    // active voxels get their info and edge intersection vertices right away. Everything kept
+    // afterwards is per active voxel (with a SparseVoxelIndexMap for the lookups), so memory
+    // scales with the surface rather than the volume. Slices are sampled on the worker threads,
+    // 'field' must be safe to call concurrently.
+    template <typename Field>
+    void run_dmc(std::vector<float3>& compact_vertices, std::vector<uint3>& compact_triangles,
+                 const Field& field, const uint3& num_voxels_dim, const float3& xyz_min, const float3& xyz_max,
+                 float iso_value, unsigned num_smooth = 0, DmcStats* stats = nullptr)
+    {
+        Timer timer;
+        if (stats) *stats = DmcStats();
+        
+        compact_triangles.clear();
+        
+        const float3 xyz_range = xyz_max - xyz_min;
+        const unsigned dim_x = num_voxels_dim.x + 1;
+        const unsigned dim_y = num_voxels_dim.y + 1;
+        
+        std::vector<float> xs(dim_x), ys(dim_y);
+        for (unsigned i = 0; i < dim_x; ++i) xs[i] = ijk_to_xyz(i, num_voxels_dim.x, xyz_range.x, xyz_min.x);
+        for (unsigned j = 0; j < dim_y; ++j) ys[j] = ijk_to_xyz(j, num_voxels_dim.y, xyz_range.y, xyz_min.y);
+        
+        // 'slice0' holds the grid points of z-index k, 'slice1' those of k + 1.
+        std::vector<float> slice0((size_t)dim_x * dim_y), slice1((size_t)dim_x * dim_y);
+        double sample_field_ms = 0.0;
+        auto sample_slice = [&](std::vector<float>& slice, unsigned k)
+        {
+            Timer slice_timer;
+            const float z = ijk_to_xyz(k, num_voxels_dim.z, xyz_range.z, xyz_min.z);
+            parallel_for(0, dim_y, 1, [&](size_t j_begin, size_t j_end)
+            {
+                for (size_t j = j_begin; j < j_end; ++j)
+                {
+                    float* row = slice.data() + j * dim_x;
+                    for (unsigned i = 0; i < dim_x; ++i)
+                    {
+                        row[i] = eval_field(field, xs[i], ys[j], z, 0);
+                    }
+                }
+            });
+            sample_field_ms += slice_timer.elapsed_ms();
+        };
+        
+        std::vector<_VoxelInfo> compact_voxel_info;
+        // Edge intersection vertices of the active voxels, in compact order. They can only be moved
+        // to 'compact_vertices' once correct_voxels_info has laid out the vertices of each voxel.
+        std::vector<float3> edge_vertex_stream;
+        
+        sample_slice(slice1, 0);
+        for (unsigned k = 0; k < num_voxels_dim.z; ++k)
+        {
+            std::swap(slice0, slice1);
+            sample_slice(slice1, k + 1);
+            
+            const float z0 = ijk_to_xyz(k,     num_voxels_dim.z, xyz_range.z, xyz_min.z);
+            const float z1 = ijk_to_xyz(k + 1, num_voxels_dim.z, xyz_range.z, xyz_min.z);
+            
+            for (unsigned j = 0; j < num_voxels_dim.y; ++j)
+            {
+                const float* row00 = slice0.data() + (size_t)j * dim_x;
+                const float* row01 = row00 + dim_x;
+                const float* row10 = slice1.data() + (size_t)j * dim_x;
+                const float* row11 = row10 + dim_x;
+                
+                for (unsigned i = 0; i < num_voxels_dim.x; ++i)
+                {
+                    const float voxel_vals[8] =
+                    {
+                        row00[i], row00[i + 1], row01[i + 1], row01[i],
+                        row10[i], row10[i + 1], row11[i + 1], row11[i]
+                    };
+                    
+                    voxel_index1D_type index1D;
+                    index3D_to_1D(i, j, k, num_voxels_dim.x, num_voxels_dim.y, index1D);
+                    append_if_active(compact_voxel_info, edge_vertex_stream, index1D, voxel_vals,
+                                     xs[i], xs[i + 1], ys[j], ys[j + 1], z0, z1, iso_value);
+                }
+            }
+        }
+        if (stats)
+        {
+            stats->sample_field_ms = sample_field_ms;
+            stats->flag_active_voxels_ms = timer.lap_ms() - sample_field_ms;
+            stats->field_slices_bytes = (slice0.capacity() + slice1.capacity()) * sizeof(float);
+        }
+        std::vector<float>().swap(slice0);
+        std::vector<float>().swap(slice1);
+        
+        finish_dmc_sparse(compact_vertices, compact_triangles, compact_voxel_info, edge_vertex_stream,
+                          xyz_min, xyz_max, num_voxels_dim, num_smooth, stats, timer);
     }
 }; // namespace dmc
 
@@ -0,0 +1,132 @@
+//
+//  field_sampler.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef field_sampler_h
+#define field_sampler_h
+
+#include <algorithm>
+#include <vector>
+
+#include "utils.h"
+#include "parallel.h"
+#include "isosurface.h"
+
+namespace surface
+{
+    // Number of points handed to Isosurface::value_batch at once.
+    const unsigned SAMPLE_BATCH_SIZE = 256;
+    
+    // The x, y and z coordinates of every grid point along each axis, computed once instead of
+    // calling ijk_to_xyz for every sample. Point i of an axis with 'dim' points maps to
+    // ijk_to_xyz(i, dim - 1, range, min), the same mapping run_dmc uses.
+    class GridCoordinates
+    {
+    public:
+        GridCoordinates(unsigned dim_x, unsigned dim_y, unsigned dim_z,
+                        const utils::float3& xyz_min, const utils::float3& xyz_max)
+        {
+            utils::float3 xyz_range = xyz_max - xyz_min;
+            fill_axis(m_xs, dim_x, xyz_range.x, xyz_min.x);
+            fill_axis(m_ys, dim_y, xyz_range.y, xyz_min.y);
+            fill_axis(m_zs, dim_z, xyz_range.z, xyz_min.z);
+        }
+        
+        const float* xs() const { return m_xs.data(); }
+        float x(unsigned i) const { return m_xs[i]; }
+        float y(unsigned j) const { return m_ys[j]; }
+        float z(unsigned k) const { return m_zs[k]; }
+    
+    private:
+        static void fill_axis(std::vector<float>& coords, unsigned dim, float range, float min)
+        {
+            coords.resize(dim);
+            for (unsigned i = 0; i < dim; ++i)
+            {
+                coords[i] = utils::ijk_to_xyz(i, dim - 1, range, min);
+            }
+        }
+        
+        std::vector<float> m_xs;
+        std::vector<float> m_ys;
+        std::vector<float> m_zs;
+    };
+    
+    // Fill 'scalar_grid' with field(x, y, z) over [xyz_min, xyz_max]. 'field' is any callable,
+    // so the call is inlined into the row loop. The k-slabs are sampled in parallel, 'field'
+    // must therefore be safe to call from several threads. The slabs are split with
+    // parallel_for_static, so a grid made with deferred_fill is first touched by the threads
+    // that later scan the same slabs.
+    template <typename Field, typename Layout, typename Allocator>
+    void sample_field(utils::Array3D<float, Layout, Allocator>& scalar_grid, const Field& field,
+                      const utils::float3& xyz_min, const utils::float3& xyz_max)
+    {
+        const GridCoordinates coords(scalar_grid.dim_x(), scalar_grid.dim_y(), scalar_grid.dim_z(), xyz_min, xyz_max);
+        const unsigned dim_x = scalar_grid.dim_x();
+        
+        utils::parallel_for_static(0, scalar_grid.dim_z(), [&](size_t k_begin, size_t k_end)
+        {
+            for (unsigned k = (unsigned)k_begin; k < k_end; ++k)
+            {
+                const float z = coords.z(k);
+                for (unsigned j = 0; j < scalar_grid.dim_y(); ++j)
+                {
+                    const float y = coords.y(j);
+                    auto row = scalar_grid.row(j, k);
+                    for (unsigned i = 0; i < dim_x; ++i)
+                    {
+                        row[i] = field(coords.x(i), y, z);
+                    }
+                }
+            }
+        });
+    }
+    
+    // Same as sample_field for an Isosurface behind a base reference. Each row is evaluated
+    // with value_batch in batches of SAMPLE_BATCH_SIZE points, one virtual call per batch. Rows
+    // that are not contiguous in the grid's layout are evaluated into a buffer and copied.
+    template <typename Layout, typename Allocator>
+    void sample_surface(utils::Array3D<float, Layout, Allocator>& scalar_grid, const Isosurface& surface,
+                        const utils::float3& xyz_min, const utils::float3& xyz_max)
+    {
+        const GridCoordinates coords(scalar_grid.dim_x(), scalar_grid.dim_y(), scalar_grid.dim_z(), xyz_min, xyz_max);
+        const unsigned dim_x = scalar_grid.dim_x();
+        
+        utils::parallel_for_static(0, scalar_grid.dim_z(), [&](size_t k_begin, size_t k_end)
+        {
+            float ys[SAMPLE_BATCH_SIZE];
+            float zs[SAMPLE_BATCH_SIZE];
+            float vals[SAMPLE_BATCH_SIZE];
+            
+            for (unsigned k = (unsigned)k_begin; k < k_end; ++k)
+            {
+                std::fill(zs, zs + SAMPLE_BATCH_SIZE, coords.z(k));
+                for (unsigned j = 0; j < scalar_grid.dim_y(); ++j)
+                {
+                    std::fill(ys, ys + SAMPLE_BATCH_SIZE, coords.y(j));
+                    auto row = scalar_grid.row(j, k);
+                    for (unsigned i = 0; i < dim_x; i += SAMPLE_BATCH_SIZE)
+                    {
+                        unsigned n = std::min(SAMPLE_BATCH_SIZE, dim_x - i);
+                        if (Layout::contiguous_rows)
+                        {
+                            surface.value_batch(coords.xs() + i, ys, zs, &row[i], n);
+                            continue;
+                        }
+                        surface.value_batch(coords.xs() + i, ys, zs, vals, n);
+                        for (unsigned t = 0; t < n; ++t)
+                        {
+                            row[i + t] = vals[t];
+                        }
+                    }
+                }
+            }
+        });
+    }
+}; // namespace surface
+
+#endif /* field_sampler_h */
@@ -0,0 +1,287 @@
+//
+//  grid_pyramid.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef grid_pyramid_h
+#define grid_pyramid_h
+
+#include <algorithm>
+#include <vector>
+
+#include "utils.h"
+#include "parallel.h"
+
+namespace utils
+{
+    // Number of voxels along an axis of a grid of 'num_voxels' voxels downsampled by 2. The
+    // coarse grid spans 2 * downsampled_num_voxels(num_voxels) fine voxels, one more than the
+    // fine grid when num_voxels is odd.
+    inline unsigned downsampled_num_voxels(unsigned num_voxels) { return (num_voxels + 1) / 2; }
+    
+    // The box spanned by a grid of 'num_voxels_dim' voxels over [xyz_min, xyz_max] downsampled
+    // 'levels' times: same origin and voxels 2^levels times larger.
+    inline float3 downsampled_xyz_max(const float3& xyz_min, const float3& xyz_max, const uint3& num_voxels_dim,
+                                      unsigned levels)
+    {
+        uint3 coarse_dim = num_voxels_dim;
+        for (unsigned level = 0; level < levels; ++level)
+        {
+            coarse_dim = make_uint3(downsampled_num_voxels(coarse_dim.x), downsampled_num_voxels(coarse_dim.y),
+                                    downsampled_num_voxels(coarse_dim.z));
+        }
+        const float3 xyz_range = xyz_max - xyz_min;
+        const float scale = (float)(1u << levels);
+        return make_float3(xyz_min.x + xyz_range.x * (coarse_dim.x * scale / num_voxels_dim.x),
+                           xyz_min.y + xyz_range.y * (coarse_dim.y * scale / num_voxels_dim.y),
+                           xyz_min.z + xyz_range.z * (coarse_dim.z * scale / num_voxels_dim.z));
+    }
+    
+    // How downsample_grid combines the fine grid points around a coarse one: the 3 x 3 x 3 points
+    // nearest to it, the fine grid being clamped at its border.
+    enum class DownsampleMode
+    {
+        // Weighted by 1/4, 1/2, 1/4 along each axis. The tent weights keep a linear field, and so
+        // a flat iso surface, where it is.
+        AVERAGE,
+        // Smallest or largest of the points, a conservative bound of the fine values.
+        MIN,
+        MAX,
+        // For binary (0 / 1) grids, such as segmented scans: 1 if the points of at least 0.5
+        // make up at least half of the AVERAGE weights, 0 otherwise.
+        MAJORITY
+    };
+    
+    // Coarse rows handed to one parallel_for chunk by downsample_grid and build_grid_pyramid.
+    const size_t DOWNSAMPLE_ROW_GRAIN = 16;
+    
+    // The fine taps 2c - 1, 2c and 2c + 1 of coarse point c along an axis of 'last' + 1 fine
+    // points, clamped.
+    inline void downsample_taps(unsigned c, unsigned last, unsigned* taps)
+    {
+        taps[1] = std::min(2 * c, last);
+        taps[0] = (taps[1] > 0) ? taps[1] - 1 : 0;
+        taps[2] = std::min(taps[1] + 1, last);
+    }
+    
+    // How each DownsampleMode reduces values: first() and add() fold the fine points of the
+    // y/z pass, with their tent weight 'w', and combine() makes the coarse value from the folds
+    // of the x taps 2i - 1, 2i and 2i + 1.
+    template <DownsampleMode Mode> struct DownsampleReduce;
+    
+    template <>
+    struct DownsampleReduce<DownsampleMode::AVERAGE>
+    {
+        template <typename T> static T first(T v, T w) { return w * v; }
+        template <typename T> static T add(T acc, T v, T w) { return acc + w * v; }
+        template <typename T> static T combine(T a, T b, T c) { return (T)0.25f * a + (T)0.5f * b + (T)0.25f * c; }
+    };
+    
+    template <>
+    struct DownsampleReduce<DownsampleMode::MIN>
+    {
+        template <typename T> static T first(T v, T) { return v; }
+        template <typename T> static T add(T acc, T v, T) { return std::min(acc, v); }
+        template <typename T> static T combine(T a, T b, T c) { return std::min(a, std::min(b, c)); }
+    };
+    
+    template <>
+    struct DownsampleReduce<DownsampleMode::MAX>
+    {
+        template <typename T> static T first(T v, T) { return v; }
+        template <typename T> static T add(T acc, T v, T) { return std::max(acc, v); }
+        template <typename T> static T combine(T a, T b, T c) { return std::max(a, std::max(b, c)); }
+    };
+    
+    template <>
+    struct DownsampleReduce<DownsampleMode::MAJORITY>
+    {
+        template <typename T> static T first(T v, T w) { return (v >= (T)0.5f) ? w : T(); }
+        template <typename T> static T add(T acc, T v, T w) { return acc + first(v, w); }
+        template <typename T> static T combine(T a, T b, T c)
+        {
+            return DownsampleReduce<DownsampleMode::AVERAGE>::combine(a, b, c) >= (T)0.5f ? (T)1 : T();
+        }
+    };
+    
+    // Width of the blocks of downsample_row's y/z pass. The fixed trip count lets the compiler
+    // unroll a block and keep it in vector registers.
+    const unsigned DOWNSAMPLE_BLOCK_WIDTH = 8;
+    
+    // One coarse row from the 3 x 3 fine rows (y taps, then z taps) around it. The y/z pass
+    // combines the nine rows into 'column' block by block, reading each row once; the x pass then
+    // reduces three neighbors of 'column' per coarse point. MIN and MAX ignore the weights.
+    template <DownsampleMode Mode, typename T>
+    void downsample_row(T* coarse_row, unsigned coarse_dim_x, const T* const* fine_rows, unsigned fine_dim_x, T* column)
+    {
+        typedef DownsampleReduce<Mode> reduce;
+        const float tent[3] = { 0.25f, 0.5f, 0.25f };
+        T weights[9];
+        for (unsigned r = 0; r < 9; ++r)
+        {
+            weights[r] = (T)(tent[r % 3] * tent[r / 3]);
+        }
+        
+        unsigned x0 = 0;
+        for (; x0 + DOWNSAMPLE_BLOCK_WIDTH <= fine_dim_x; x0 += DOWNSAMPLE_BLOCK_WIDTH)
+        {
+            T block[DOWNSAMPLE_BLOCK_WIDTH];
+            for (unsigned u = 0; u < DOWNSAMPLE_BLOCK_WIDTH; ++u)
+            {
+                block[u] = reduce::first(fine_rows[0][x0 + u], weights[0]);
+            }
+            for (unsigned r = 1; r < 9; ++r)
+            {
+                for (unsigned u = 0; u < DOWNSAMPLE_BLOCK_WIDTH; ++u)
+                {
+                    block[u] = reduce::add(block[u], fine_rows[r][x0 + u], weights[r]);
+                }
+            }
+            std::copy(block, block + DOWNSAMPLE_BLOCK_WIDTH, column + x0);
+        }
+        for (; x0 < fine_dim_x; ++x0)
+        {
+            T val = reduce::first(fine_rows[0][x0], weights[0]);
+            for (unsigned r = 1; r < 9; ++r)
+            {
+                val = reduce::add(val, fine_rows[r][x0], weights[r]);
+            }
+            column[x0] = val;
+        }
+        
+        const unsigned last = fine_dim_x - 1;
+        for (unsigned i = 0; i < coarse_dim_x; ++i)
+        {
+            unsigned x[3];
+            downsample_taps(i, last, x);
+            coarse_row[i] = reduce::combine(column[x[0]], column[x[1]], column[x[2]]);
+        }
+    }
+    
+    // The z-slabs [k_begin, k_end) of 'coarse', 'fine' downsampled by 2, in parallel over the
+    // coarse rows. The rows of layouts that are not contiguous are copied out first.
+    template <DownsampleMode Mode, typename T, typename Layout, typename Allocator>
+    void downsample_slabs(Array3D<T>& coarse, const Array3D<T, Layout, Allocator>& fine, unsigned k_begin, unsigned k_end)
+    {
+        if (k_begin >= k_end) return;
+        
+        const unsigned fine_dim_x = fine.dim_x();
+        const unsigned coarse_dim_y = coarse.dim_y();
+        parallel_for(0, (size_t)(k_end - k_begin) * coarse_dim_y, DOWNSAMPLE_ROW_GRAIN, [&](size_t row_begin, size_t row_end)
+        {
+            std::vector<T> column(fine_dim_x);
+            std::vector<T> row_copies(Layout::contiguous_rows ? 0 : 9 * (size_t)fine_dim_x);
+            const T* fine_rows[9];
+            
+            for (size_t r = row_begin; r < row_end; ++r)
+            {
+                const unsigned j = (unsigned)(r % coarse_dim_y), k = k_begin + (unsigned)(r / coarse_dim_y);
+                unsigned ys[3], zs[3];
+                downsample_taps(j, fine.dim_y() - 1, ys);
+                downsample_taps(k, fine.dim_z() - 1, zs);
+                for (unsigned t = 0; t < 9; ++t)
+                {
+                    const unsigned y = ys[t % 3], z = zs[t / 3];
+                    if (Layout::contiguous_rows)
+                    {
+                        fine_rows[t] = &fine(0, y, z);
+                        continue;
+                    }
+                    auto row = fine.row(y, z);
+                    T* copy = row_copies.data() + t * (size_t)fine_dim_x;
+                    for (unsigned i = 0; i < fine_dim_x; ++i)
+                    {
+                        copy[i] = row[i];
+                    }
+                    fine_rows[t] = copy;
+                }
+                downsample_row<Mode>(&coarse(0, j, k), coarse.dim_x(), fine_rows, fine_dim_x, column.data());
+            }
+        });
+    }
+    
+    template <typename T, typename Layout, typename Allocator>
+    void downsample_slabs(Array3D<T>& coarse, const Array3D<T, Layout, Allocator>& fine, DownsampleMode mode,
+                          unsigned k_begin, unsigned k_end)
+    {
+        switch (mode)
+        {
+        case DownsampleMode::AVERAGE:
+            downsample_slabs<DownsampleMode::AVERAGE>(coarse, fine, k_begin, k_end);
+            break;
+        case DownsampleMode::MIN:
+            downsample_slabs<DownsampleMode::MIN>(coarse, fine, k_begin, k_end);
+            break;
+        case DownsampleMode::MAX:
+            downsample_slabs<DownsampleMode::MAX>(coarse, fine, k_begin, k_end);
+            break;
+        case DownsampleMode::MAJORITY:
+            downsample_slabs<DownsampleMode::MAJORITY>(coarse, fine, k_begin, k_end);
+            break;
+        }
+    }
+    
+    // An uninitialized grid the size of 'fine' downsampled by 2.
+    template <typename T, typename Layout, typename Allocator>
+    Array3D<T> make_downsampled_grid(const Array3D<T, Layout, Allocator>& fine)
+    {
+        return Array3D<T>(downsampled_num_voxels(fine.dim_x() - 1) + 1, downsampled_num_voxels(fine.dim_y() - 1) + 1,
+                          downsampled_num_voxels(fine.dim_z() - 1) + 1, deferred_fill);
+    }
+    
+    // Downsample the grid points of 'fine' by 2 along each axis into 'coarse': the coarse point
+    // (i, j, k) combines, as 'mode' says, the fine points around (2i, 2j, 2k).
+    template <typename T, typename Layout, typename Allocator>
+    void downsample_grid(Array3D<T>& coarse, const Array3D<T, Layout, Allocator>& fine,
+                         DownsampleMode mode = DownsampleMode::AVERAGE)
+    {
+        coarse = make_downsampled_grid(fine);
+        downsample_slabs(coarse, fine, mode, 0, coarse.dim_z());
+    }
+    
+    // Mip pyramid of 'grid': pyramid[l - 1] is 'grid' downsampled 2^l times by downsample_grid,
+    // for l = 1 .. num_levels (2x, 4x, 8x, ...). The levels are built in one pass along z: each
+    // z-slab of the coarsest level is completed, level by level, as soon as the slabs below it
+    // are, so every level reads the slabs it needs of the level below while they are still in
+    // cache rather than reloading the whole level.
+    template <typename T, typename Layout, typename Allocator>
+    void build_grid_pyramid(std::vector<Array3D<T>>& pyramid, const Array3D<T, Layout, Allocator>& grid,
+                            unsigned num_levels, DownsampleMode mode = DownsampleMode::AVERAGE)
+    {
+        pyramid.clear();
+        if (num_levels == 0) return;
+        
+        pyramid.reserve(num_levels);
+        pyramid.push_back(make_downsampled_grid(grid));
+        for (unsigned level = 1; level < num_levels; ++level)
+        {
+            pyramid.push_back(make_downsampled_grid(pyramid.back()));
+        }
+        
+        // Slabs [0, done[l - 1]) of level l are built.
+        std::vector<unsigned> done(num_levels, 0), target(num_levels);
+        for (unsigned k = 0; k < pyramid.back().dim_z(); ++k)
+        {
+            // The slabs each level needs for slab k of the coarsest one: coarse slab c reads the
+            // fine slabs up to 2c + 1.
+            target[num_levels - 1] = k + 1;
+            for (unsigned level = num_levels - 1; level > 0; --level)
+            {
+                target[level - 1] = std::min(pyramid[level - 1].dim_z(), 2 * target[level]);
+            }
+            
+            downsample_slabs(pyramid[0], grid, mode, done[0], target[0]);
+            for (unsigned level = 1; level < num_levels; ++level)
+            {
+                downsample_slabs(pyramid[level], pyramid[level - 1], mode, done[level], target[level]);
+            }
+            done = target;
+        }
+    }
+    
+}; // namespace utils
+
+#endif /* grid_pyramid_h */
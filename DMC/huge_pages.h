@@ -0,0 +1,175 @@
+//
+//  huge_pages.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef huge_pages_h
+#define huge_pages_h
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include "utils.h"
+#include "parallel.h"
+
+namespace utils
+{
+    // Size of a transparent huge page on x86-64 and most aarch64 kernels.
+    const size_t HUGE_PAGE_SIZE = (size_t)2 << 20;
+    
+    // Ask the kernel to back the whole huge pages within [ptr, ptr + num_bytes) with transparent
+    // huge pages. Only pages that have not been touched yet are affected. No-op off Linux.
+    inline void advise_huge_pages(void* ptr, size_t num_bytes)
+    {
+#ifdef MADV_HUGEPAGE
+        uintptr_t begin = ((uintptr_t)ptr + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+        uintptr_t end = ((uintptr_t)ptr + num_bytes) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+        if (begin < end)
+        {
+            madvise((void*)begin, end - begin, MADV_HUGEPAGE);
+        }
+#else
+        (void)ptr;
+        (void)num_bytes;
+#endif
+    }
+    
+    // 'alignment' aligned block, nullptr on failure; release it with free_aligned. std::aligned_alloc
+    // is missing from MSVC's C runtime and from macOS before 10.15.
+    inline void* allocate_aligned(size_t alignment, size_t num_bytes)
+    {
+#if defined(_WIN32)
+        return _aligned_malloc(num_bytes, alignment);
+#elif defined(__APPLE__)
+        void* ptr = nullptr;
+        return posix_memalign(&ptr, alignment, num_bytes) == 0 ? ptr : nullptr;
+#else
+        return std::aligned_alloc(alignment, num_bytes);
+#endif
+    }
+    
+    inline void free_aligned(void* ptr)
+    {
+#ifdef _WIN32
+        _aligned_free(ptr);
+#else
+        std::free(ptr);
+#endif
+    }
+    
+    // Allocator for the large, volume sized buffers (grids, dense index maps, voxel flags). Blocks
+    // of at least HUGE_PAGE_SIZE bytes are huge page aligned and advised as huge pages, which cuts
+    // the TLB misses of the random accesses into them. Elements are default-initialized, so a
+    // vector of trivial types can be sized without touching its pages: whoever writes them first
+    // decides, on NUMA machines, which node they live on (see parallel_first_touch).
+    template <typename T>
+    class HugePageAllocator
+    {
+    public:
+        typedef T value_type;
+        
+        HugePageAllocator() = default;
+        template <typename U> HugePageAllocator(const HugePageAllocator<U>&) { }
+        
+        T* allocate(size_t n)
+        {
+            size_t num_bytes = n * sizeof(T);
+            if (num_bytes < HUGE_PAGE_SIZE)
+            {
+                return static_cast<T*>(::operator new(num_bytes));
+            }
+            
+            num_bytes = (num_bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+            void* ptr = allocate_aligned(HUGE_PAGE_SIZE, num_bytes);
+            if (!ptr)
+            {
+                throw std::bad_alloc();
+            }
+            advise_huge_pages(ptr, num_bytes);
+            return static_cast<T*>(ptr);
+        }
+        
+        void deallocate(T* ptr, size_t n)
+        {
+            if (n * sizeof(T) < HUGE_PAGE_SIZE)
+            {
+                ::operator delete(ptr);
+                return;
+            }
+            free_aligned(ptr);
+        }
+        
+        template <typename U>
+        void construct(U* ptr)
+        {
+            ::new ((void*)ptr) U;
+        }
+        
+        template <typename U, typename... Args>
+        void construct(U* ptr, Args&&... args)
+        {
+            ::new ((void*)ptr) U(std::forward<Args>(args)...);
+        }
+    };
+    
+    template <typename T, typename U>
+    bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return true; }
+    
+    template <typename T, typename U>
+    bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) { return false; }
+    
+    template <typename T>
+    using huge_page_vector = std::vector<T, HugePageAllocator<T>>;
+    
+    // Size 'vec' to 'n' copies of 'value'. The items are split into slabs of 'slab_size' and the
+    // slabs written by parallel_for_static, so each page is first touched by the thread that owns
+    // that part of the range in the passes using the same slab partition. Only avoids a serial
+    // touch if the allocator default-initializes, like HugePageAllocator.
+    template <typename T, typename Allocator>
+    void parallel_first_touch(std::vector<T, Allocator>& vec, size_t n, const T& value, size_t slab_size = 1)
+    {
+        std::vector<T, Allocator>().swap(vec);
+        vec.resize(n);
+        slab_size = std::max<size_t>(1, slab_size);
+        parallel_for_static(0, (n + slab_size - 1) / slab_size, [&](size_t slab_begin, size_t slab_end)
+        {
+            std::fill(vec.begin() + slab_begin * slab_size, vec.begin() + std::min(n, slab_end * slab_size), value);
+        });
+    }
+    
+    // Fill a grid made with the deferred_fill constructor, z-slab by z-slab with
+    // parallel_for_static, the slab partition the extraction passes over the grid use.
+    template <typename T, typename Layout, typename Allocator>
+    void parallel_first_touch(Array3D<T, Layout, Allocator>& grid, const T& value)
+    {
+        parallel_for_static(0, grid.dim_z(), [&](size_t k_begin, size_t k_end)
+        {
+            for (unsigned k = (unsigned)k_begin; k < k_end; ++k)
+            {
+                for (unsigned j = 0; j < grid.dim_y(); ++j)
+                {
+                    auto row = grid.row(j, k);
+                    for (unsigned i = 0; i < grid.dim_x(); ++i)
+                    {
+                        row[i] = value;
+                    }
+                }
+            }
+        });
+    }
+}; // namespace utils
+
+#endif /* huge_pages_h */
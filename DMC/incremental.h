@@ -0,0 +1,397 @@
+//
+//  incremental.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef incremental_h
+#define incremental_h
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include "utils.h"
+#include "parallel.h"
+#include "dmc.h"
+#include "sparse_blocks.h"
+
+namespace dmc
+{
+    // Edge length, in voxels, of the chunks of an IncrementalDmc. Must be a multiple of
+    // INCREMENTAL_BRICK_SIZE.
+    const unsigned DMC_CHUNK_SIZE = 32;
+    // Granularity of the halo around a chunk.
+    const unsigned INCREMENTAL_BRICK_SIZE = 8;
+    
+    // Part of the mesh produced by the voxels of one chunk. 'triangles' index 'vertices'; the
+    // vertices shared with the neighbor chunks are repeated in each of them, at the same position.
+    struct DmcChunkMesh
+    {
+        std::vector<float3> vertices;
+        std::vector<uint3> triangles;
+    };
+    
+    // Index map of a window: dense over the voxels of the box [box_begin, box_end), the voxels
+    // outside it being inactive. Cheaper to query than a SparseVoxelIndexMap, for one compact
+    // index per voxel of the box.
+    class BoxVoxelIndexMap
+    {
+    public:
+        BoxVoxelIndexMap(const std::vector<_VoxelInfo>& compact_voxel_info, const uint3& num_voxels_dim,
+                         const uint3& box_begin, const uint3& box_end)
+        : m_num_voxels_dim(num_voxels_dim)
+        , m_box_begin(box_begin)
+        , m_box_dim(make_uint3(box_end.x - box_begin.x, box_end.y - box_begin.y, box_end.z - box_begin.z))
+        , m_map((size_t)m_box_dim.x * m_box_dim.y * m_box_dim.z, INVALID_COMPACT_INDEX)
+        {
+            for (compact_index_type compact_index = 0; compact_index < compact_voxel_info.size(); ++compact_index)
+            {
+                size_t box_index = box_index1D(compact_voxel_info[compact_index].index1D());
+                assert(box_index < m_map.size());
+                m_map[box_index] = compact_index;
+            }
+        }
+        
+        // Returns INVALID_COMPACT_INDEX if the voxel is not active.
+        compact_index_type operator[](voxel_index1D_type index1D) const
+        {
+            size_t box_index = box_index1D(index1D);
+            return (box_index < m_map.size()) ? m_map[box_index] : INVALID_COMPACT_INDEX;
+        }
+        
+        size_t num_bytes() const { return m_map.capacity() * sizeof(compact_index_type); }
+    
+    private:
+        // Index of the voxel in the box, or an index past m_map for the voxels outside it (the
+        // unsigned differences wrap around for the voxels before it).
+        size_t box_index1D(voxel_index1D_type index1D) const
+        {
+            uint3 index3D;
+            index1D_to_3D(index1D, m_num_voxels_dim, index3D);
+            const unsigned x = index3D.x - m_box_begin.x, y = index3D.y - m_box_begin.y, z = index3D.z - m_box_begin.z;
+            if ((x >= m_box_dim.x) || (y >= m_box_dim.y) || (z >= m_box_dim.z))
+            {
+                return m_map.size();
+            }
+            return ((size_t)z * m_box_dim.y + y) * m_box_dim.x + x;
+        }
+        
+        uint3 m_num_voxels_dim;
+        uint3 m_box_begin;
+        uint3 m_box_dim;
+        std::vector<compact_index_type> m_map;
+    };
+    
+    // The voxels on the window border miss the neighbors outside of it.
+    template <>
+    struct index_map_traits<BoxVoxelIndexMap>
+    {
+        static const bool may_miss_voxels = true;
+    };
+    
+    // Extraction of a grid by chunks of chunk_size^3 voxels. A chunk is extracted from a window
+    // made of the chunk plus a halo of voxels around it and only keeps the triangles of its own
+    // voxels. The halo is wide enough for the LUT2 correction and every smoothing iteration to
+    // see the same neighborhood as a run over the whole grid, so each chunk mesh is final on its
+    // own and the chunk meshes put together are the run_dmc mesh. 'scalar_grid' is kept by
+    // reference.
+    class ChunkedDmc
+    {
+    public:
+        ChunkedDmc(const scalar_grid_type& scalar_grid, const float3& xyz_min, const float3& xyz_max,
+                   float iso_value, unsigned num_smooth = 0, unsigned chunk_size = DMC_CHUNK_SIZE)
+        : m_scalar_grid(scalar_grid)
+        , m_xyz_min(xyz_min)
+        , m_xyz_max(xyz_max)
+        , m_iso_value(iso_value)
+        , m_num_smooth(num_smooth)
+        , m_chunk_size(chunk_size)
+        {
+            assert(chunk_size % INCREMENTAL_BRICK_SIZE == 0);
+            get_num_voxels_dim_from_scalar_grid(m_num_voxels_dim, scalar_grid);
+            m_num_chunks_dim = make_uint3((m_num_voxels_dim.x + chunk_size - 1) / chunk_size,
+                                          (m_num_voxels_dim.y + chunk_size - 1) / chunk_size,
+                                          (m_num_voxels_dim.z + chunk_size - 1) / chunk_size);
+            // One voxel for the LUT2 correction, then each smoothing iteration reads the iso
+            // vertices of the voxels around an edge (+1) which are averaged from the edges that
+            // the voxels before them manage (-1).
+            unsigned halo = 2 + 2 * num_smooth;
+            m_halo = (halo + INCREMENTAL_BRICK_SIZE - 1) / INCREMENTAL_BRICK_SIZE * INCREMENTAL_BRICK_SIZE;
+        }
+        
+        const uint3& num_voxels_dim() const { return m_num_voxels_dim; }
+        const uint3& num_chunks_dim() const { return m_num_chunks_dim; }
+        size_t num_chunks() const { return (size_t)m_num_chunks_dim.x * m_num_chunks_dim.y * m_num_chunks_dim.z; }
+        unsigned chunk_size() const { return m_chunk_size; }
+        // Width, in voxels, of the halo around each chunk.
+        unsigned halo() const { return m_halo; }
+        
+        // Extract the chunks [chunk_begin, chunk_end) from a single window: the box of their voxels
+        // and the halo around it, clipped to the grid. on_chunk(chunk, mesh) is called for each
+        // of them in index order, 'chunk' being its index1D in num_chunks_dim() and 'mesh' a
+        // temporary it may move from. If 'cancelled' is given, it is checked between the stages
+        // and before each chunk, and once it is set no more stages run and no more chunks are
+        // passed to on_chunk; returns false if it stopped that way.
+        template <typename ChunkFn>
+        bool extract_chunks(const uint3& chunk_begin, const uint3& chunk_end, const ChunkFn& on_chunk,
+                            const std::atomic<bool>* cancelled = nullptr) const
+        {
+            auto stopped = [cancelled]() { return cancelled && cancelled->load(); };
+            
+            const uint3 box_begin = make_uint3(chunk_begin.x * m_chunk_size, chunk_begin.y * m_chunk_size,
+                                               chunk_begin.z * m_chunk_size);
+            const uint3 box_end = make_uint3(std::min(chunk_end.x * m_chunk_size, m_num_voxels_dim.x),
+                                             std::min(chunk_end.y * m_chunk_size, m_num_voxels_dim.y),
+                                             std::min(chunk_end.z * m_chunk_size, m_num_voxels_dim.z));
+            
+            SparseBlockSet window(m_num_voxels_dim, INCREMENTAL_BRICK_SIZE);
+            const uint3& num_bricks_dim = window.num_blocks_dim();
+            auto brick_range = [&](unsigned voxel_begin, unsigned voxel_end, unsigned num_bricks,
+                                   unsigned& brick_begin, unsigned& brick_end)
+            {
+                brick_begin = (voxel_begin - std::min(voxel_begin, m_halo)) / INCREMENTAL_BRICK_SIZE;
+                brick_end = std::min(num_bricks, (voxel_end + m_halo + INCREMENTAL_BRICK_SIZE - 1) / INCREMENTAL_BRICK_SIZE);
+            };
+            unsigned bx0, bx1, by0, by1, bz0, bz1;
+            brick_range(box_begin.x, box_end.x, num_bricks_dim.x, bx0, bx1);
+            brick_range(box_begin.y, box_end.y, num_bricks_dim.y, by0, by1);
+            brick_range(box_begin.z, box_end.z, num_bricks_dim.z, bz0, bz1);
+            
+            std::vector<voxel_index1D_type> brick_indices;
+            for (unsigned bz = bz0; bz < bz1; ++bz)
+            {
+                for (unsigned by = by0; by < by1; ++by)
+                {
+                    for (unsigned bx = bx0; bx < bx1; ++bx)
+                    {
+                        voxel_index1D_type brick_index1D;
+                        index3D_to_1D(bx, by, bz, num_bricks_dim.x, num_bricks_dim.y, brick_index1D);
+                        brick_indices.push_back(brick_index1D);
+                    }
+                }
+            }
+            window.set_blocks(std::move(brick_indices));
+            
+            std::vector<_VoxelInfo> compact_voxel_info;
+            std::vector<float3> edge_vertex_stream;
+            classify_blocks(compact_voxel_info, edge_vertex_stream, window, m_xyz_min, m_xyz_max, m_iso_value,
+                            [&](size_t, unsigned i0, unsigned j, unsigned k, const float** rows)
+                            {
+                                rows[0] = &m_scalar_grid(i0, j,     k    );
+                                rows[1] = &m_scalar_grid(i0, j + 1, k    );
+                                rows[2] = &m_scalar_grid(i0, j,     k + 1);
+                                rows[3] = &m_scalar_grid(i0, j + 1, k + 1);
+                            });
+            if (stopped()) return false;
+            
+            // Same stages as finish_dmc_sparse; the voxels on the window border miss some of their
+            // neighbors, which only affects the halo.
+            const unsigned B = INCREMENTAL_BRICK_SIZE;
+            BoxVoxelIndexMap full_voxel_index_map(compact_voxel_info, m_num_voxels_dim, make_uint3(bx0 * B, by0 * B, bz0 * B),
+                                                  make_uint3(std::min(bx1 * B, m_num_voxels_dim.x),
+                                                             std::min(by1 * B, m_num_voxels_dim.y),
+                                                             std::min(bz1 * B, m_num_voxels_dim.z)));
+            unsigned num_total_vertices = correct_voxels_info(compact_voxel_info, full_voxel_index_map, m_num_voxels_dim);
+            
+            std::vector<float3> compact_vertices(num_total_vertices);
+            place_edge_vertices(compact_vertices, compact_voxel_info, edge_vertex_stream);
+            std::vector<float3>().swap(edge_vertex_stream);
+            
+            calc_iso_vertices(compact_vertices, compact_voxel_info, full_voxel_index_map, m_num_voxels_dim);
+            for (unsigned smooth_iter = 0; smooth_iter < m_num_smooth; ++smooth_iter)
+            {
+                if (stopped()) return false;
+                smooth_edge_vertices(compact_vertices, compact_voxel_info, full_voxel_index_map,
+                                     m_xyz_min, m_xyz_max, m_num_voxels_dim);
+                calc_iso_vertices(compact_vertices, compact_voxel_info, full_voxel_index_map, m_num_voxels_dim);
+            }
+            if (stopped()) return false;
+            
+            // The triangles of the voxels in the box, per chunk.
+            const uint3 box_chunks_dim = make_uint3(chunk_end.x - chunk_begin.x, chunk_end.y - chunk_begin.y,
+                                                    chunk_end.z - chunk_begin.z);
+            std::vector<std::vector<uint3>> chunk_triangles((size_t)box_chunks_dim.x * box_chunks_dim.y * box_chunks_dim.z);
+            for (const _VoxelInfo& vx_info : compact_voxel_info)
+            {
+                uint3 index3D;
+                index1D_to_3D(vx_info.index1D(), m_num_voxels_dim, index3D);
+                if ((index3D.x < box_begin.x) || (index3D.x >= box_end.x) ||
+                    (index3D.y < box_begin.y) || (index3D.y >= box_end.y) ||
+                    (index3D.z < box_begin.z) || (index3D.z >= box_end.z))
+                {
+                    continue;
+                }
+                size_t box_chunk;
+                index3D_to_1D((index3D.x - box_begin.x) / m_chunk_size, (index3D.y - box_begin.y) / m_chunk_size,
+                              (index3D.z - box_begin.z) / m_chunk_size, box_chunks_dim.x, box_chunks_dim.y, box_chunk);
+                generate_voxel_triangles(chunk_triangles[box_chunk], vx_info, compact_voxel_info,
+                                         full_voxel_index_map, m_num_voxels_dim);
+            }
+            
+            // Each chunk keeps only the vertices its triangles use, in order of first use.
+            std::vector<vertex_index_type> local_index(compact_vertices.size(), INVALID_UINT32);
+            for (size_t box_chunk = 0; box_chunk < chunk_triangles.size(); ++box_chunk)
+            {
+                if (stopped()) return false;
+                
+                uint3 box_chunk3D;
+                index1D_to_3D(box_chunk, box_chunks_dim, box_chunk3D);
+                size_t chunk;
+                index3D_to_1D(chunk_begin.x + box_chunk3D.x, chunk_begin.y + box_chunk3D.y, chunk_begin.z + box_chunk3D.z,
+                              m_num_chunks_dim.x, m_num_chunks_dim.y, chunk);
+                
+                DmcChunkMesh mesh;
+                std::vector<vertex_index_type> used_vertices;
+                auto to_local = [&](vertex_index_type index)
+                {
+                    if (local_index[index] == INVALID_UINT32)
+                    {
+                        local_index[index] = (vertex_index_type)mesh.vertices.size();
+                        mesh.vertices.push_back(compact_vertices[index]);
+                        used_vertices.push_back(index);
+                    }
+                    return local_index[index];
+                };
+                for (const uint3& tri : chunk_triangles[box_chunk])
+                {
+                    vertex_index_type a = to_local(tri.x);
+                    vertex_index_type b = to_local(tri.y);
+                    vertex_index_type c = to_local(tri.z);
+                    mesh.triangles.push_back(make_uint3(a, b, c));
+                }
+                for (vertex_index_type index : used_vertices)
+                {
+                    local_index[index] = INVALID_UINT32;
+                }
+                on_chunk(chunk, mesh);
+            }
+            return true;
+        }
+    
+    private:
+        const scalar_grid_type& m_scalar_grid;
+        float3 m_xyz_min;
+        float3 m_xyz_max;
+        float m_iso_value;
+        unsigned m_num_smooth;
+        unsigned m_chunk_size;
+        unsigned m_halo;
+        uint3 m_num_voxels_dim;
+        uint3 m_num_chunks_dim;
+    };
+    
+    // Incremental extraction for grids that are edited in small regions at a time. The mesh is
+    // kept as one DmcChunkMesh per chunk of a ChunkedDmc, which put together are the run_dmc mesh.
+    //
+    // After editing 'scalar_grid' (which is kept by reference), call update() with the box of
+    // grid points that changed: only the chunks whose window touches it are extracted again,
+    // and their indices are returned so that only those meshes need to be uploaded.
+    class IncrementalDmc
+    {
+    public:
+        IncrementalDmc(const scalar_grid_type& scalar_grid, const float3& xyz_min, const float3& xyz_max,
+                       float iso_value, unsigned num_smooth = 0, unsigned chunk_size = DMC_CHUNK_SIZE)
+        : m_chunked(scalar_grid, xyz_min, xyz_max, iso_value, num_smooth, chunk_size)
+        {
+            const uint3& num_chunks_dim = m_chunked.num_chunks_dim();
+            m_chunk_meshes.resize(m_chunked.num_chunks());
+            
+            // One window per layer of chunks, the layers in parallel.
+            parallel_for(0, num_chunks_dim.z, 1, [&](size_t cz_begin, size_t cz_end)
+            {
+                extract_chunk_box(make_uint3(0, 0, (unsigned)cz_begin),
+                                  make_uint3(num_chunks_dim.x, num_chunks_dim.y, (unsigned)cz_end));
+            });
+        }
+        
+        const uint3& num_chunks_dim() const { return m_chunked.num_chunks_dim(); }
+        size_t num_chunks() const { return m_chunk_meshes.size(); }
+        unsigned chunk_size() const { return m_chunked.chunk_size(); }
+        // Width, in voxels, of the halo around each chunk.
+        unsigned halo() const { return m_chunked.halo(); }
+        
+        const DmcChunkMesh& chunk_mesh(size_t chunk) const { return m_chunk_meshes[chunk]; }
+        
+        // The grid points in [dirty_begin, dirty_end) have changed. Extract the chunks that depend
+        // on them again and return their indices, in ascending order.
+        std::vector<size_t> update(const uint3& dirty_begin, const uint3& dirty_end)
+        {
+            const uint3& num_chunks_dim = m_chunked.num_chunks_dim();
+            std::vector<size_t> dirty_chunks;
+            unsigned begin[3], end[3];
+            if (!dirty_chunk_range(dirty_begin.x, dirty_end.x, num_chunks_dim.x, begin[0], end[0]) ||
+                !dirty_chunk_range(dirty_begin.y, dirty_end.y, num_chunks_dim.y, begin[1], end[1]) ||
+                !dirty_chunk_range(dirty_begin.z, dirty_end.z, num_chunks_dim.z, begin[2], end[2]))
+            {
+                return dirty_chunks;
+            }
+            
+            for (unsigned cz = begin[2]; cz < end[2]; ++cz)
+            {
+                for (unsigned cy = begin[1]; cy < end[1]; ++cy)
+                {
+                    for (unsigned cx = begin[0]; cx < end[0]; ++cx)
+                    {
+                        size_t chunk;
+                        index3D_to_1D(cx, cy, cz, num_chunks_dim.x, num_chunks_dim.y, chunk);
+                        dirty_chunks.push_back(chunk);
+                    }
+                }
+            }
+            extract_chunk_box(make_uint3(begin[0], begin[1], begin[2]), make_uint3(end[0], end[1], end[2]));
+            return dirty_chunks;
+        }
+        
+        // Concatenate all the chunk meshes into one mesh. The vertices on the chunk borders
+        // appear once per chunk.
+        void gather(std::vector<float3>& compact_vertices, std::vector<uint3>& compact_triangles) const
+        {
+            compact_vertices.clear();
+            compact_triangles.clear();
+            for (const DmcChunkMesh& mesh : m_chunk_meshes)
+            {
+                vertex_index_type vertex_begin = (vertex_index_type)compact_vertices.size();
+                compact_vertices.insert(compact_vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+                for (const uint3& tri : mesh.triangles)
+                {
+                    compact_triangles.push_back(make_uint3(tri.x + vertex_begin, tri.y + vertex_begin, tri.z + vertex_begin));
+                }
+            }
+        }
+    
+    private:
+        // Chunks [begin, end) along one axis whose window has a voxel with a corner in [dirty_begin, dirty_end).
+        bool dirty_chunk_range(unsigned dirty_begin, unsigned dirty_end, unsigned num_chunks,
+                               unsigned& begin, unsigned& end) const
+        {
+            if (dirty_begin >= dirty_end) return false;
+            
+            // Voxels [v0, v1) have a corner in the dirty points, the windows reaching them belong
+            // to the chunks within halo() voxels.
+            const int64_t halo = m_chunked.halo(), chunk_size = m_chunked.chunk_size();
+            int64_t v0 = (int64_t)dirty_begin - 1 - halo;
+            int64_t v1 = (int64_t)dirty_end + halo;
+            begin = (unsigned)std::max<int64_t>(0, v0 / chunk_size);
+            end = (unsigned)std::min<int64_t>(num_chunks, (v1 + chunk_size - 1) / chunk_size);
+            return begin < end;
+        }
+        
+        void extract_chunk_box(const uint3& chunk_begin, const uint3& chunk_end)
+        {
+            m_chunked.extract_chunks(chunk_begin, chunk_end, [&](size_t chunk, DmcChunkMesh& mesh)
+            {
+                m_chunk_meshes[chunk] = std::move(mesh);
+            });
+        }
+        
+        ChunkedDmc m_chunked;
+        std::vector<DmcChunkMesh> m_chunk_meshes;
+    };
+}; // namespace dmc
+
+#endif /* incremental_h */
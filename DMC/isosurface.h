@@ -0,0 +1,150 @@
+//
+//  isosurface.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef isosurface_h
+#define isosurface_h
+
+#include <cmath>
+#include <cstdint>
+
+namespace surface
+{
+    class Isosurface
+    {
+    public:
+        virtual ~Isosurface() = default;
+        
+        virtual float value(float x, float y, float z) const = 0;
+        
+        // Evaluate 'n' points at once, out[i] = value(xs[i], ys[i], zs[i]). Surfaces override it
+        // with a plain loop the compiler can vectorize, this default only saves the virtual calls.
+        virtual void value_batch(const float* xs, const float* ys, const float* zs, float* out, unsigned n) const
+        {
+            for (unsigned i = 0; i < n; ++i)
+            {
+                out[i] = value(xs[i], ys[i], zs[i]);
+            }
+        }
+        
+        // An upper bound L of the gradient magnitude, |value(p) - value(q)| <= L * |p - q|. The
+        // narrow band sampler uses it to rule out whole blocks from a few samples; 0 means that
+        // no bound is known and the sampler has to estimate one.
+        virtual float lipschitz_bound() const { return 0.0f; }
+    };
+    
+    class SphereSurface : public Isosurface
+    {
+    public:
+        float value(float x, float y, float z) const override
+        {
+            return sqrtf(x * x + y * y + z * z);
+        }
+        
+        void value_batch(const float* xs, const float* ys, const float* zs, float* out, unsigned n) const override
+        {
+            for (unsigned i = 0; i < n; ++i)
+            {
+                out[i] = sqrtf(xs[i] * xs[i] + ys[i] * ys[i] + zs[i] * zs[i]);
+            }
+        }
+        
+        float lipschitz_bound() const override { return 1.0f; }
+    };
+    
+    class GyroidSurface : public Isosurface
+    {
+    public:
+        float value(float x, float y, float z) const override
+        {
+            return 2.0 * (cosf(x) * sinf(y) + cosf(y) * sinf(z) + cosf(z) * sinf(x));
+        }
+        
+        void value_batch(const float* xs, const float* ys, const float* zs, float* out, unsigned n) const override
+        {
+            for (unsigned i = 0; i < n; ++i)
+            {
+                out[i] = 2.0 * (cosf(xs[i]) * sinf(ys[i]) + cosf(ys[i]) * sinf(zs[i]) + cosf(zs[i]) * sinf(xs[i]));
+            }
+        }
+        
+        // Each partial derivative is 2 * (cos * cos - sin * sin), at most 4 in magnitude.
+        float lipschitz_bound() const override { return 4.0f * sqrtf(3.0f); }
+    };
+    
+    // Fractal value noise in [-1, 1]. The lattice values come from an integer hash of the
+    // lattice point and 'seed', so the field is deterministic and needs no tables.
+    class NoiseSurface : public Isosurface
+    {
+    public:
+        explicit NoiseSurface(uint32_t seed = 1337, unsigned num_octaves = 4)
+        : m_seed(seed), m_num_octaves(num_octaves) { }
+        
+        float value(float x, float y, float z) const override
+        {
+            float sum = 0.0f, amplitude = 0.5f, norm = 0.0f;
+            for (unsigned octave = 0; octave < m_num_octaves; ++octave)
+            {
+                sum += amplitude * lattice_noise(x, y, z, m_seed + octave);
+                norm += amplitude;
+                x *= 2.0f; y *= 2.0f; z *= 2.0f;
+                amplitude *= 0.5f;
+            }
+            return sum / norm;
+        }
+        
+        // Per octave, a partial derivative is at most max(fade') * 2 = 3 times amplitude * frequency,
+        // which is 0.5 for every octave.
+        float lipschitz_bound() const override
+        {
+            float norm = 1.0f - ldexpf(1.0f, -(int)m_num_octaves);
+            return 1.5f * (float)m_num_octaves / norm * sqrtf(3.0f);
+        }
+    
+    private:
+        static float hash_to_unit(int32_t i, int32_t j, int32_t k, uint32_t seed)
+        {
+            uint32_t h = seed;
+            h ^= (uint32_t)i * 0x8da6b343u;
+            h ^= (uint32_t)j * 0xd8163841u;
+            h ^= (uint32_t)k * 0xcb1ab31fu;
+            h ^= h >> 16; h *= 0x7feb352du;
+            h ^= h >> 15; h *= 0x846ca68bu;
+            h ^= h >> 16;
+            return (float)(h & 0xffffff) * (2.0f / (float)0xffffff) - 1.0f;
+        }
+        
+        static float fade(float t) { return t * t * (3.0f - 2.0f * t); }
+        
+        static float lerp(float a, float b, float t) { return a + (b - a) * t; }
+        
+        static float lattice_noise(float x, float y, float z, uint32_t seed)
+        {
+            float fx = floorf(x), fy = floorf(y), fz = floorf(z);
+            int32_t i = (int32_t)fx, j = (int32_t)fy, k = (int32_t)fz;
+            float tx = fade(x - fx), ty = fade(y - fy), tz = fade(z - fz);
+            
+            float c000 = hash_to_unit(i,     j,     k,     seed);
+            float c100 = hash_to_unit(i + 1, j,     k,     seed);
+            float c010 = hash_to_unit(i,     j + 1, k,     seed);
+            float c110 = hash_to_unit(i + 1, j + 1, k,     seed);
+            float c001 = hash_to_unit(i,     j,     k + 1, seed);
+            float c101 = hash_to_unit(i + 1, j,     k + 1, seed);
+            float c011 = hash_to_unit(i,     j + 1, k + 1, seed);
+            float c111 = hash_to_unit(i + 1, j + 1, k + 1, seed);
+            
+            float c00 = lerp(c000, c100, tx), c10 = lerp(c010, c110, tx);
+            float c01 = lerp(c001, c101, tx), c11 = lerp(c011, c111, tx);
+            return lerp(lerp(c00, c10, ty), lerp(c01, c11, ty), tz);
+        }
+        
+        uint32_t m_seed;
+        unsigned m_num_octaves;
+    };
+}; // namespace surface
+
+#endif /* isosurface_h */
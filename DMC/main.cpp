@@ -11,77 +11,44 @@
 #include <cmath>
 
 #include "utils.h"
+#include "isosurface.h"
+#include "field_sampler.h"
 #include "png_loader.h"
+#include "mesh_io.h"
 #include "dmc.h"
+#include "mesh_reorder.h"
+#include "grid_pyramid.h"
+#include "adaptive_dmc.h"
 
 namespace
 {
-    class Isosurface
-    {
-    public:
-        virtual ~Isosurface() = default;
-        
-        virtual float value(float x, float y, float z) const = 0;
-    };
-    
-    class SphereSurface : public Isosurface
-    {
-    public:
-        float value(float x, float y, float z) const override
-        {
-            return sqrtf(x * x + y * y + z * z);
-        }
-    };
-    
-    class GyroidSurface : public Isosurface
-    {
-    public:
-        float value(float x, float y, float z) const override
-        {
-            return 2.0 * (cosf(x) * sinf(y) + cosf(y) * sinf(z) + cosf(z) * sinf(x));
-        }
-    };
-    
-    void test_dmc()
+    // Writes the mesh to 'out_filename' (format by extension), or as OBJ to stdout if it is null.
+    void test_dmc(const char* out_filename)
     {
         using namespace utils;
         using namespace png_load;
         using namespace dmc;
+        using namespace surface;
         
         SphereSurface surface;
         // GyroidSurface surface;
         float3 xyz_min(-5, -5, -5);
         float3 xyz_max(5, 5, 5);
-        float3 xyz_range = xyz_max - xyz_min;
         float iso_value = 4.0f;
         
         unsigned resolution = 20;
         Array3D<float> scalar_grid(resolution + 1, resolution + 1, resolution + 1);
         /*
-         // Actually it's 400x296x320, downsample
-         unsigned i_resl(400), j_resl(296), k_resl(236);
-         Array3D<float> scalar_grid(i_resl, j_resl, k_resl);
+         // 400x296x320, binary; extract it downsampled 2x by majority
+         unsigned i_resl(400), j_resl(296), k_resl(320);
+         Array3D<float> full_grid(i_resl, j_resl, k_resl);
          
          {
          PngLoader loader("walnut_pngs/walnut_", k_resl);
          std::vector<unsigned char> png_data;
          
-         float grid_val;
          for (unsigned slice_k = 0; slice_k < k_resl; ++slice_k)
          {
-         
-         png_data.clear();
-         loader.load(slice_k * 2, png_data);
-         
-         for (unsigned j = 0; j < j_resl; ++j)
-         {
-         for (unsigned i = 0; i < i_resl; ++i)
-         {
-         grid_val = png_data[4 * j * i_resl + 2 * i] > 0 ? 1.0f : 0.0f;
-         scalar_grid(i, j, slice_k) = grid_val;
-         }
-         }
-         
          png_data.clear();
          loader.load(slice_k, png_data);
          
@@ -89,40 +56,71 @@ namespace
          {
          for (unsigned i = 0; i < i_resl; ++i)
          {
-         grid_val = png_data[j * i_resl + i] > 0 ? 1.0f : 0.0f;
-         scalar_grid(i, j, slice_k) = grid_val;
+         full_grid(i, j, slice_k) = png_data[j * i_resl + i] > 0 ? 1.0f : 0.0f;
          }
          }
-         // std::cout << "done for slice " << slice_k << std::endl;
          }
          }
+         
+         downsample_grid(scalar_grid, full_grid, DownsampleMode::MAJORITY);
          */
         
-        for (unsigned k = 0; k < scalar_grid.dim_z(); ++k)
-        {
-            float z = ijk_to_xyz(k, resolution, xyz_range.z, xyz_min.z);
-            for (unsigned j = 0; j < scalar_grid.dim_y(); ++j)
-            {
-                float y = ijk_to_xyz(j, resolution, xyz_range.y, xyz_min.y);
-                for (unsigned i = 0; i < scalar_grid.dim_x(); ++i)
-                {
-                    float x = ijk_to_xyz(i, resolution, xyz_range.x, xyz_min.x);
-                    scalar_grid(i, j, k) = surface.value(x, y, z);
-                }
-            }
-        }
+        sample_surface(scalar_grid, surface, xyz_min, xyz_max);
         
         std::vector<float3> compact_vertices;
         std::vector<uint3> compact_triangles;
-        dmc::run_dmc(compact_vertices, compact_triangles, scalar_grid, xyz_min, xyz_max, iso_value, 15);
-        for (const auto& vertex : compact_vertices)
+        DmcStats stats;
+        dmc::run_dmc(compact_vertices, compact_triangles, scalar_grid, xyz_min, xyz_max, iso_value, 15, &stats);
+        dmc::reorder_mesh(compact_vertices, compact_triangles, &stats);
+        // stdout carries the mesh, keep the summary on stderr
+        std::cerr << "active voxels: " << stats.num_active_voxels
+        << " lut2 voxels: " << stats.num_lut2_voxels
+        << " vertices: " << stats.num_vertices
+        << " triangles: " << stats.num_triangles
+        << " total: " << stats.total_ms << " ms"
+        << " acmr: " << stats.acmr_before << " -> " << stats.acmr_after
+        << " (reorder " << stats.reorder_mesh_ms << " ms)" << std::endl;
+        bool written = out_filename ? mesh_io::write_mesh(out_filename, compact_vertices, compact_triangles)
+                                    : mesh_io::write_obj_parallel(stdout, compact_vertices, compact_triangles);
+        if (!written)
         {
-            std::cout << "v " << vertex.x << " " << vertex.y << " " << vertex.z << std::endl;
+            std::cerr << "failed to write the mesh" << std::endl;
         }
-        for (const auto& tri : compact_triangles)
+    }
+    
+    // run_adaptive_dmc must keep the noise isosurface as manifold as run_dmc does, both with
+    // exact merges only and with curved leaves merged. Returns false if it does not.
+    bool check_adaptive_dmc()
+    {
+        using namespace utils;
+        using namespace dmc;
+        using namespace surface;
+        
+        NoiseSurface surface;
+        float3 xyz_min(0, 0, 0);
+        float3 xyz_max(8, 8, 8);
+        float iso_value = 0.1f;
+        
+        unsigned resolution = 96;
+        Array3D<float> scalar_grid(resolution + 1, resolution + 1, resolution + 1);
+        sample_surface(scalar_grid, surface, xyz_min, xyz_max);
+        
+        bool manifold = true;
+        for (float max_error : {0.0f, 0.02f})
         {
-            std::cout << "f " << tri.x+1 << " " << tri.y+1 << " " << tri.z+1 << std::endl;
+            std::vector<float3> compact_vertices;
+            std::vector<uint3> compact_triangles;
+            DmcStats stats;
+            run_adaptive_dmc(compact_vertices, compact_triangles, scalar_grid, xyz_min, xyz_max, iso_value, max_error,
+                             ADAPTIVE_MAX_LEVEL, &stats);
+            size_t num_non_manifold = count_non_manifold_edges(compact_triangles);
+            std::cerr << "adaptive max_error " << max_error
+            << " leaves: " << stats.num_octree_leaves
+            << " triangles: " << stats.num_triangles
+            << " non-manifold edges: " << num_non_manifold << std::endl;
+            manifold &= (num_non_manifold == 0);
         }
+        return manifold;
     }
 }
 int main(int argc, const char * argv[]) {
@@ -132,7 +130,7 @@ int main(int argc, const char * argv[]) {
     
     // std::cout << argmax(1, 2, 3, 4, -2, -3, 6, 0) << std::endl;
     // std::cout << calc_radian({0,0}, {1,0}, {2.732, 1});
-    test_dmc();
+    test_dmc(argc > 1 ? argv[1] : nullptr);
     
-    return 0;
+    return check_adaptive_dmc() ? 0 : 1;
 }
@@ -0,0 +1,417 @@
+//
+//  mesh_io.cpp
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#include "mesh_io.h"
+
+#include <charconv>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "parallel.h"
+
+namespace mesh_io
+{
+    using namespace utils;
+    
+    static_assert(sizeof(float3) == 3 * sizeof(float), "float3 must be tightly packed for bulk writes");
+    static_assert(sizeof(uint3) == 3 * sizeof(uint32_t), "uint3 must be tightly packed for bulk writes");
+    
+    const char RAW_MAGIC[8] = {'D', 'M', 'C', 'R', 'A', 'W', '0', '1'};
+    
+    const size_t OBJ_CHUNK_LINES = 1 << 14;
+    
+    namespace
+    {
+        struct FileCloser
+        {
+            void operator()(std::FILE* file) const { std::fclose(file); }
+        };
+        
+        typedef std::unique_ptr<std::FILE, FileCloser> file_ptr;
+        
+        bool write_bytes(std::FILE* file, const void* data, size_t num_bytes)
+        {
+            return num_bytes == 0 || std::fwrite(data, 1, num_bytes, file) == num_bytes;
+        }
+        
+        // Copy the bytes of 'value' to 'out', returns the position right after them.
+        template <typename T>
+        char* copy_pod(char* out, const T& value)
+        {
+            std::memcpy(out, &value, sizeof(T));
+            return out + sizeof(T);
+        }
+        
+        bool is_little_endian()
+        {
+            const uint16_t probe = 1;
+            return *reinterpret_cast<const uint8_t*>(&probe) == 1;
+        }
+        
+        template <typename Writer>
+        bool write_to_file(const std::string& filename, const char* mode, const Writer& writer)
+        {
+            file_ptr file(std::fopen(filename.c_str(), mode));
+            if (!file)
+            {
+                return false;
+            }
+            if (!writer(file.get()))
+            {
+                return false;
+            }
+            return std::fclose(file.release()) == 0;
+        }
+        
+        bool has_extension(const std::string& filename, const char* ext)
+        {
+            size_t len = std::strlen(ext);
+            return filename.size() >= len && filename.compare(filename.size() - len, len, ext) == 0;
+        }
+        
+        // Longest line we ever format: 3 floats or 3 unsigned plus the separators.
+        const size_t OBJ_MAX_LINE_SIZE = 128;
+        
+        // Format one OBJ line at 'out', returns the position right after it. 'out' must have
+        // room for OBJ_MAX_LINE_SIZE chars.
+        char* format_obj_vertex(char* out, const float3& vertex)
+        {
+            char* end = out + OBJ_MAX_LINE_SIZE;
+            *out++ = 'v'; *out++ = ' ';
+            out = std::to_chars(out, end, vertex.x).ptr; *out++ = ' ';
+            out = std::to_chars(out, end, vertex.y).ptr; *out++ = ' ';
+            out = std::to_chars(out, end, vertex.z).ptr; *out++ = '\n';
+            return out;
+        }
+        
+        // OBJ indices are 1-based
+        char* format_obj_face(char* out, const uint3& tri)
+        {
+            char* end = out + OBJ_MAX_LINE_SIZE;
+            *out++ = 'f'; *out++ = ' ';
+            out = std::to_chars(out, end, tri.x + 1).ptr; *out++ = ' ';
+            out = std::to_chars(out, end, tri.y + 1).ptr; *out++ = ' ';
+            out = std::to_chars(out, end, tri.z + 1).ptr; *out++ = '\n';
+            return out;
+        }
+        
+        // Output buffer for text formats. Lines are formatted in place and flushed to the file
+        // in large blocks.
+        class TextBuffer
+        {
+        public:
+            static const size_t CAPACITY = 1 << 20;
+            
+            explicit TextBuffer(std::FILE* file) : m_file(file), m_data(CAPACITY), m_size(0), m_ok(true) { }
+            
+            // Returns where the next line goes, flushing first if it might not fit.
+            char* line_begin()
+            {
+                if (CAPACITY - m_size < OBJ_MAX_LINE_SIZE) flush();
+                return m_data.data() + m_size;
+            }
+            
+            void line_end(char* end) { m_size = end - m_data.data(); }
+            
+            bool flush()
+            {
+                m_ok = m_ok && write_bytes(m_file, m_data.data(), m_size);
+                m_size = 0;
+                return m_ok;
+            }
+        
+        private:
+            std::FILE* m_file;
+            std::vector<char> m_data;
+            size_t m_size;
+            bool m_ok;
+        };
+        
+        // Write all of 'iovecs' to 'fd', in order. writev may write less than asked for and
+        // accepts at most IOV_MAX entries per call, so loop until everything is out.
+        bool writev_all(int fd, std::vector<iovec>& iovecs)
+        {
+            size_t first = 0;
+            while (first < iovecs.size())
+            {
+                int count = (int)std::min<size_t>(iovecs.size() - first, IOV_MAX);
+                ssize_t written = ::writev(fd, &iovecs[first], count);
+                if (written < 0)
+                {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                
+                size_t remaining = (size_t)written;
+                while (first < iovecs.size() && remaining >= iovecs[first].iov_len)
+                {
+                    remaining -= iovecs[first].iov_len;
+                    ++first;
+                }
+                if (remaining)
+                {
+                    iovecs[first].iov_base = (char*)iovecs[first].iov_base + remaining;
+                    iovecs[first].iov_len -= remaining;
+                }
+            }
+            return true;
+        }
+    }
+    
+    bool write_ply(std::FILE* file, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles)
+    {
+        std::string header("ply\n");
+        header += is_little_endian() ? "format binary_little_endian 1.0\n" : "format binary_big_endian 1.0\n";
+        header += "element vertex " + std::to_string(compact_vertices.size()) + "\n";
+        header += "property float x\nproperty float y\nproperty float z\n";
+        header += "element face " + std::to_string(compact_triangles.size()) + "\n";
+        header += "property list uchar uint vertex_indices\nend_header\n";
+        
+        // Each face is a one byte count followed by three indices, 13 bytes, so the triangle
+        // buffer cannot be written as it is.
+        const size_t FACE_BYTES = 1 + 3 * sizeof(uint32_t);
+        std::vector<char> faces(compact_triangles.size() * FACE_BYTES);
+        char* face = faces.data();
+        for (const uint3& tri : compact_triangles)
+        {
+            *face = 3;
+            std::memcpy(face + 1, &tri, sizeof(uint3));
+            face += FACE_BYTES;
+        }
+        
+        return write_bytes(file, header.data(), header.size()) &&
+               write_bytes(file, compact_vertices.data(), compact_vertices.size() * sizeof(float3)) &&
+               write_bytes(file, faces.data(), faces.size());
+    }
+    
+    bool write_ply(const std::string& filename, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles)
+    {
+        return write_to_file(filename, "wb", [&](std::FILE* file)
+        {
+            return write_ply(file, compact_vertices, compact_triangles);
+        });
+    }
+    
+    bool write_stl(std::FILE* file, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles)
+    {
+        // STL is little endian by definition, which is what every platform we build for uses.
+        const size_t HEADER_BYTES = 80;
+        const size_t FACET_BYTES = 4 * sizeof(float3) + sizeof(uint16_t);
+        
+        std::vector<char> buffer(HEADER_BYTES + sizeof(uint32_t) + compact_triangles.size() * FACET_BYTES, ' ');
+        const char title[] = "DMC binary STL";
+        std::memcpy(buffer.data(), title, sizeof(title) - 1);
+        char* out = buffer.data() + HEADER_BYTES;
+        out = copy_pod(out, (uint32_t)compact_triangles.size());
+        
+        for (const uint3& tri : compact_triangles)
+        {
+            const float3& p0 = compact_vertices[tri.x];
+            const float3& p1 = compact_vertices[tri.y];
+            const float3& p2 = compact_vertices[tri.z];
+            
+            float3 normal = cross(p1 - p0, p2 - p0);
+            float len = sqrtf(dot(normal, normal));
+            if (len > 0.0f) normal /= len;
+            
+            out = copy_pod(out, normal);
+            out = copy_pod(out, p0);
+            out = copy_pod(out, p1);
+            out = copy_pod(out, p2);
+            out = copy_pod(out, (uint16_t)0);
+        }
+        
+        return write_bytes(file, buffer.data(), buffer.size());
+    }
+    
+    bool write_stl(const std::string& filename, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles)
+    {
+        return write_to_file(filename, "wb", [&](std::FILE* file)
+        {
+            return write_stl(file, compact_vertices, compact_triangles);
+        });
+    }
+    
+    bool write_raw(std::FILE* file, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles)
+    {
+        const uint32_t counts[2] = {(uint32_t)compact_vertices.size(), (uint32_t)compact_triangles.size()};
+        
+        return write_bytes(file, RAW_MAGIC, sizeof(RAW_MAGIC)) &&
+               write_bytes(file, counts, sizeof(counts)) &&
+               write_bytes(file, compact_vertices.data(), compact_vertices.size() * sizeof(float3)) &&
+               write_bytes(file, compact_triangles.data(), compact_triangles.size() * sizeof(uint3));
+    }
+    
+    bool write_raw(const std::string& filename, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles)
+    {
+        return write_to_file(filename, "wb", [&](std::FILE* file)
+        {
+            return write_raw(file, compact_vertices, compact_triangles);
+        });
+    }
+    
+    bool read_raw(const std::string& filename, vertex_buffer_type& compact_vertices,
+                  triangle_buffer_type& compact_triangles)
+    {
+        file_ptr file(std::fopen(filename.c_str(), "rb"));
+        if (!file)
+        {
+            return false;
+        }
+        
+        char magic[sizeof(RAW_MAGIC)];
+        uint32_t counts[2];
+        if (std::fread(magic, 1, sizeof(magic), file.get()) != sizeof(magic) ||
+            std::memcmp(magic, RAW_MAGIC, sizeof(magic)) != 0 ||
+            std::fread(counts, 1, sizeof(counts), file.get()) != sizeof(counts))
+        {
+            return false;
+        }
+        
+        compact_vertices.resize(counts[0]);
+        compact_triangles.resize(counts[1]);
+        size_t vertex_bytes = compact_vertices.size() * sizeof(float3);
+        size_t triangle_bytes = compact_triangles.size() * sizeof(uint3);
+        return std::fread(compact_vertices.data(), 1, vertex_bytes, file.get()) == vertex_bytes &&
+               std::fread(compact_triangles.data(), 1, triangle_bytes, file.get()) == triangle_bytes;
+    }
+    
+    bool write_obj(std::FILE* file, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles)
+    {
+        TextBuffer buffer(file);
+        
+        for (const float3& vertex : compact_vertices)
+        {
+            buffer.line_end(format_obj_vertex(buffer.line_begin(), vertex));
+        }
+        for (const uint3& tri : compact_triangles)
+        {
+            buffer.line_end(format_obj_face(buffer.line_begin(), tri));
+        }
+        return buffer.flush();
+    }
+    
+    bool write_obj_parallel(std::FILE* file, const vertex_buffer_type& compact_vertices,
+                            const triangle_buffer_type& compact_triangles)
+    {
+        // Whatever is still buffered in 'file' must land before our direct writes.
+        if (std::fflush(file) != 0)
+        {
+            return false;
+        }
+        int fd = fileno(file);
+        
+        const size_t num_vertex_chunks = (compact_vertices.size() + OBJ_CHUNK_LINES - 1) / OBJ_CHUNK_LINES;
+        const size_t num_face_chunks = (compact_triangles.size() + OBJ_CHUNK_LINES - 1) / OBJ_CHUNK_LINES;
+        const size_t num_chunks = num_vertex_chunks + num_face_chunks;
+        // Only a window of chunks is formatted at a time, so the text never has to fit in
+        // memory all at once.
+        const size_t window_size = 2 * num_worker_threads();
+        
+        std::vector<std::vector<char>> chunk_text(std::min(window_size, num_chunks));
+        std::vector<iovec> iovecs;
+        
+        for (size_t window_begin = 0; window_begin < num_chunks; window_begin += window_size)
+        {
+            size_t window_end = std::min(num_chunks, window_begin + window_size);
+            
+            parallel_for(window_begin, window_end, 1, [&](size_t chunk_begin, size_t chunk_end)
+            {
+                for (size_t chunk = chunk_begin; chunk < chunk_end; ++chunk)
+                {
+                    // The buffer grows with the formatted text rather than being sized for the
+                    // longest lines, and keeps its capacity for the next windows.
+                    std::vector<char>& text = chunk_text[chunk - window_begin];
+                    size_t size = 0;
+                    auto line_begin = [&]()
+                    {
+                        if (text.size() - size < OBJ_MAX_LINE_SIZE)
+                        {
+                            text.resize(std::max(2 * text.size(), size + OBJ_MAX_LINE_SIZE));
+                        }
+                        return text.data() + size;
+                    };
+                    
+                    if (chunk < num_vertex_chunks)
+                    {
+                        size_t first = chunk * OBJ_CHUNK_LINES;
+                        size_t last = std::min(compact_vertices.size(), first + OBJ_CHUNK_LINES);
+                        for (size_t i = first; i < last; ++i)
+                        {
+                            char* out = format_obj_vertex(line_begin(), compact_vertices[i]);
+                            size = out - text.data();
+                        }
+                    }
+                    else
+                    {
+                        size_t first = (chunk - num_vertex_chunks) * OBJ_CHUNK_LINES;
+                        size_t last = std::min(compact_triangles.size(), first + OBJ_CHUNK_LINES);
+                        for (size_t i = first; i < last; ++i)
+                        {
+                            char* out = format_obj_face(line_begin(), compact_triangles[i]);
+                            size = out - text.data();
+                        }
+                    }
+                    text.resize(size);
+                }
+            });
+            
+            iovecs.clear();
+            for (size_t chunk = window_begin; chunk < window_end; ++chunk)
+            {
+                std::vector<char>& text = chunk_text[chunk - window_begin];
+                iovecs.push_back({text.data(), text.size()});
+            }
+            if (!writev_all(fd, iovecs))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    bool write_obj(const std::string& filename, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles)
+    {
+        return write_to_file(filename, "w", [&](std::FILE* file)
+        {
+            return write_obj(file, compact_vertices, compact_triangles);
+        });
+    }
+    
+    bool write_obj_parallel(const std::string& filename, const vertex_buffer_type& compact_vertices,
+                            const triangle_buffer_type& compact_triangles)
+    {
+        return write_to_file(filename, "w", [&](std::FILE* file)
+        {
+            return write_obj_parallel(file, compact_vertices, compact_triangles);
+        });
+    }
+    
+    bool write_mesh(const std::string& filename, const vertex_buffer_type& compact_vertices,
+                    const triangle_buffer_type& compact_triangles)
+    {
+        if (has_extension(filename, ".ply")) return write_ply(filename, compact_vertices, compact_triangles);
+        if (has_extension(filename, ".stl")) return write_stl(filename, compact_vertices, compact_triangles);
+        if (has_extension(filename, ".raw")) return write_raw(filename, compact_vertices, compact_triangles);
+        return write_obj_parallel(filename, compact_vertices, compact_triangles);
+    }
+}; // namespace mesh_io
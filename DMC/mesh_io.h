@@ -0,0 +1,79 @@
+//
+//  mesh_io.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef mesh_io_h
+#define mesh_io_h
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+namespace mesh_io
+{
+    typedef std::vector<utils::float3> vertex_buffer_type;
+    typedef std::vector<utils::uint3> triangle_buffer_type;
+    
+    // All the writers return false if the file cannot be opened or a write fails. The FILE*
+    // versions leave 'file' open; the binary ones expect it to be opened in "wb" mode.
+    
+    // Binary PLY in the host byte order. The vertex block is written straight from
+    // 'compact_vertices', the face block is packed into one buffer and written at once.
+    bool write_ply(std::FILE* file, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles);
+    
+    bool write_ply(const std::string& filename, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles);
+    
+    // Binary STL. STL has no index buffer, so each triangle is expanded with its facet normal
+    // into one buffer and written at once.
+    bool write_stl(std::FILE* file, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles);
+    
+    bool write_stl(const std::string& filename, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles);
+    
+    // Raw dump: the 8 byte RAW_MAGIC, uint32 num_vertices, uint32 num_triangles, then both
+    // buffers exactly as they are laid out in memory (host byte order).
+    extern const char RAW_MAGIC[8];
+    
+    bool write_raw(std::FILE* file, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles);
+    
+    bool write_raw(const std::string& filename, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles);
+    
+    bool read_raw(const std::string& filename, vertex_buffer_type& compact_vertices,
+                  triangle_buffer_type& compact_triangles);
+    
+    // Text OBJ. Numbers are formatted with std::to_chars (shortest round trip, independent of
+    // the locale) into a large buffer which is flushed only when full.
+    bool write_obj(std::FILE* file, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles);
+    
+    bool write_obj(const std::string& filename, const vertex_buffer_type& compact_vertices,
+                   const triangle_buffer_type& compact_triangles);
+    
+    // Same output as write_obj, but 'compact_vertices' and 'compact_triangles' are cut into
+    // chunks of OBJ_CHUNK_LINES lines that are formatted on all the worker threads, each into its
+    // own buffer, and then written in order with writev. POSIX only.
+    extern const size_t OBJ_CHUNK_LINES;
+    
+    bool write_obj_parallel(std::FILE* file, const vertex_buffer_type& compact_vertices,
+                            const triangle_buffer_type& compact_triangles);
+    
+    bool write_obj_parallel(const std::string& filename, const vertex_buffer_type& compact_vertices,
+                            const triangle_buffer_type& compact_triangles);
+    
+    // Pick the writer by the extension of 'filename' (.ply, .stl, .raw or .obj).
+    bool write_mesh(const std::string& filename, const vertex_buffer_type& compact_vertices,
+                    const triangle_buffer_type& compact_triangles);
+}; // namespace mesh_io
+
+#endif /* mesh_io_h */
@@ -0,0 +1,350 @@
+//
+//  mesh_reorder.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef mesh_reorder_h
+#define mesh_reorder_h
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "utils.h"
+#include "parallel.h"
+#include "dmc.h"
+
+namespace dmc
+{
+    // Size of the FIFO post transform vertex cache that Tipsify optimizes for and calc_acmr
+    // simulates.
+    const unsigned VERTEX_CACHE_SIZE = 16;
+    // Triangles per batch in reorder_triangles_tipsify. The batches are optimized independently,
+    // on all the worker threads.
+    const size_t TIPSIFY_BATCH_TRIANGLES = 1 << 16;
+    // Length of the global vertex index range, per triangle, that tipsify_batch numbers through a
+    // direct table.
+    const size_t TIPSIFY_WINDOW_PER_TRIANGLE = 6;
+    
+    // Average cache miss ratio of 'compact_triangles': vertices transformed per triangle with a
+    // FIFO cache of 'cache_size' vertices, from 3 (no reuse) down to about 0.5.
+    double calc_acmr(const std::vector<uint3>& compact_triangles, size_t num_vertices,
+                     unsigned cache_size = VERTEX_CACHE_SIZE)
+    {
+        if (compact_triangles.empty()) return 0.0;
+        
+        // The miss count right after each vertex entered the cache, 0 if it never did. With a FIFO
+        // a vertex is evicted 'cache_size' misses later.
+        std::vector<size_t> entered(num_vertices, 0);
+        size_t num_misses = 0;
+        for (const uint3& tri : compact_triangles)
+        {
+            for (vertex_index_type v : { tri.x, tri.y, tri.z })
+            {
+                if ((entered[v] == 0) || (num_misses - entered[v] >= cache_size))
+                {
+                    ++num_misses;
+                    entered[v] = num_misses;
+                }
+            }
+        }
+        return (double)num_misses / compact_triangles.size();
+    }
+    
+    // Spread the low 21 bits of 'v' to every third bit.
+    inline uint64_t expand_bits_21(uint32_t v)
+    {
+        uint64_t x = v & 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x << 8)  & 0x100f00f00f00f00full;
+        x = (x | x << 4)  & 0x10c30c30c30c30c3ull;
+        x = (x | x << 2)  & 0x1249249249249249ull;
+        return x;
+    }
+    
+    inline uint64_t morton_code_3D(uint32_t x, uint32_t y, uint32_t z)
+    {
+        return expand_bits_21(x) | (expand_bits_21(y) << 1) | (expand_bits_21(z) << 2);
+    }
+    
+    // Sort the vertices along the Morton curve of their position in the mesh bounding box (21
+    // bits per axis) and remap the triangles (and 'compact_normals'). Spatially close vertices end
+    // up close in memory, which helps spatial queries and vertex fetch.
+    void reorder_vertices_morton(std::vector<float3>& compact_vertices, std::vector<uint3>& compact_triangles,
+                                 std::vector<float3>* compact_normals = nullptr)
+    {
+        const size_t num_vertices = compact_vertices.size();
+        if (num_vertices == 0) return;
+        
+        const size_t grain = VERTEX_PASS_GRAIN;
+        const size_t num_chunks = (num_vertices + grain - 1) / grain;
+        std::vector<float3> chunk_min(num_chunks), chunk_max(num_chunks);
+        parallel_for(0, num_vertices, grain, [&](size_t vertex_begin, size_t vertex_end)
+        {
+            float3 min_pt = compact_vertices[vertex_begin], max_pt = min_pt;
+            for (size_t i = vertex_begin + 1; i < vertex_end; ++i)
+            {
+                const float3& pt = compact_vertices[i];
+                min_pt = make_float3(std::min(min_pt.x, pt.x), std::min(min_pt.y, pt.y), std::min(min_pt.z, pt.z));
+                max_pt = make_float3(std::max(max_pt.x, pt.x), std::max(max_pt.y, pt.y), std::max(max_pt.z, pt.z));
+            }
+            chunk_min[vertex_begin / grain] = min_pt;
+            chunk_max[vertex_begin / grain] = max_pt;
+        });
+        float3 min_pt = chunk_min[0], max_pt = chunk_max[0];
+        for (size_t chunk = 1; chunk < num_chunks; ++chunk)
+        {
+            min_pt = make_float3(std::min(min_pt.x, chunk_min[chunk].x), std::min(min_pt.y, chunk_min[chunk].y),
+                                 std::min(min_pt.z, chunk_min[chunk].z));
+            max_pt = make_float3(std::max(max_pt.x, chunk_max[chunk].x), std::max(max_pt.y, chunk_max[chunk].y),
+                                 std::max(max_pt.z, chunk_max[chunk].z));
+        }
+        
+        const float max_cell = (float)((1u << 21) - 1);
+        const float3 extent = max_pt - min_pt;
+        const float3 scale = make_float3(extent.x > 0.0f ? max_cell / extent.x : 0.0f,
+                                         extent.y > 0.0f ? max_cell / extent.y : 0.0f,
+                                         extent.z > 0.0f ? max_cell / extent.z : 0.0f);
+        
+        struct MortonVertex
+        {
+            uint64_t code;
+            vertex_index_type index;
+        };
+        std::vector<MortonVertex> order(num_vertices);
+        parallel_for(0, num_vertices, grain, [&](size_t vertex_begin, size_t vertex_end)
+        {
+            for (size_t i = vertex_begin; i < vertex_end; ++i)
+            {
+                const float3 cell = compact_vertices[i] - min_pt;
+                order[i].code = morton_code_3D((uint32_t)(cell.x * scale.x), (uint32_t)(cell.y * scale.y),
+                                               (uint32_t)(cell.z * scale.z));
+                order[i].index = (vertex_index_type)i;
+            }
+        });
+        parallel_sort(order.begin(), order.end(), [](const MortonVertex& a, const MortonVertex& b)
+        {
+            return (a.code < b.code) || ((a.code == b.code) && (a.index < b.index));
+        });
+        
+        std::vector<vertex_index_type> vertex_remap(num_vertices);
+        std::vector<float3> sorted_vertices(num_vertices);
+        std::vector<float3> sorted_normals(compact_normals ? num_vertices : 0);
+        parallel_for(0, num_vertices, grain, [&](size_t vertex_begin, size_t vertex_end)
+        {
+            for (size_t i = vertex_begin; i < vertex_end; ++i)
+            {
+                vertex_index_type old_index = order[i].index;
+                sorted_vertices[i] = compact_vertices[old_index];
+                if (compact_normals)
+                {
+                    sorted_normals[i] = (*compact_normals)[old_index];
+                }
+                vertex_remap[old_index] = (vertex_index_type)i;
+            }
+        });
+        parallel_for(0, compact_triangles.size(), grain, [&](size_t tri_begin, size_t tri_end)
+        {
+            for (size_t i = tri_begin; i < tri_end; ++i)
+            {
+                remap_face_vertices(compact_triangles[i], vertex_remap);
+            }
+        });
+        
+        compact_vertices.swap(sorted_vertices);
+        if (compact_normals)
+        {
+            compact_normals->swap(sorted_normals);
+        }
+    }
+    
+    // Tipsify (Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex Locality and
+    // Reduced Overdraw", 2007) on 'num_tris' triangles: emit the fan of a vertex, then move on to
+    // the oldest vertex of that fan that will still be in the cache once its own fan is emitted,
+    // or back to a recent vertex with triangles left at a dead end.
+    void tipsify_batch(uint3* tris, size_t num_tris, unsigned cache_size)
+    {
+        // Batch local vertex numbering. Most vertices of a batch are within a short range of
+        // global indices above its smallest one: that window is numbered by first use through a
+        // direct table, the few vertices past it by binary search.
+        vertex_index_type lowest = INVALID_UINT32;
+        for (size_t t = 0; t < num_tris; ++t)
+        {
+            lowest = std::min(lowest, std::min(tris[t].x, std::min(tris[t].y, tris[t].z)));
+        }
+        const size_t window = TIPSIFY_WINDOW_PER_TRIANGLE * num_tris;
+        std::vector<unsigned> window_local(window, INVALID_UINT32);
+        std::vector<vertex_index_type> far_vertices;
+        unsigned num_local = 0;
+        for (size_t t = 0; t < num_tris; ++t)
+        {
+            for (vertex_index_type v : { tris[t].x, tris[t].y, tris[t].z })
+            {
+                size_t offset = v - lowest;
+                if (offset >= window)
+                {
+                    far_vertices.push_back(v);
+                }
+                else if (window_local[offset] == INVALID_UINT32)
+                {
+                    window_local[offset] = num_local++;
+                }
+            }
+        }
+        std::sort(far_vertices.begin(), far_vertices.end());
+        far_vertices.erase(std::unique(far_vertices.begin(), far_vertices.end()), far_vertices.end());
+        const unsigned num_window_local = num_local;
+        num_local += (unsigned)far_vertices.size();
+        
+        auto to_local = [&](vertex_index_type v)
+        {
+            size_t offset = v - lowest;
+            if (offset < window) return window_local[offset];
+            return num_window_local +
+                   (unsigned)(std::lower_bound(far_vertices.begin(), far_vertices.end(), v) - far_vertices.begin());
+        };
+        std::vector<uint3> local_tris(num_tris);
+        for (size_t t = 0; t < num_tris; ++t)
+        {
+            local_tris[t] = make_uint3(to_local(tris[t].x), to_local(tris[t].y), to_local(tris[t].z));
+        }
+        
+        // Vertex -> triangle adjacency; 'live' counts the triangles of each vertex not emitted yet.
+        std::vector<unsigned> adj_begin(num_local + 1, 0);
+        for (const uint3& tri : local_tris)
+        {
+            ++adj_begin[tri.x + 1]; ++adj_begin[tri.y + 1]; ++adj_begin[tri.z + 1];
+        }
+        for (unsigned v = 0; v < num_local; ++v)
+        {
+            adj_begin[v + 1] += adj_begin[v];
+        }
+        std::vector<unsigned> live(num_local);
+        std::vector<unsigned> adj(3 * num_tris);
+        std::vector<unsigned> adj_end(adj_begin.begin(), adj_begin.end() - 1);
+        for (unsigned t = 0; t < num_tris; ++t)
+        {
+            for (unsigned v : { local_tris[t].x, local_tris[t].y, local_tris[t].z })
+            {
+                adj[adj_end[v]++] = t;
+                ++live[v];
+            }
+        }
+        
+        std::vector<size_t> cache_time(num_local, 0);
+        std::vector<uint8_t> emitted(num_tris, 0);
+        std::vector<unsigned> dead_end;
+        std::vector<unsigned> candidates;
+        std::vector<uint3> reordered;
+        reordered.reserve(num_tris);
+        
+        size_t time = cache_size + 1;
+        unsigned cursor = 0;
+        unsigned fanning = 0;
+        while (fanning != INVALID_UINT32)
+        {
+            candidates.clear();
+            for (unsigned a = adj_begin[fanning]; a < adj_begin[fanning + 1]; ++a)
+            {
+                unsigned t = adj[a];
+                if (emitted[t]) continue;
+                emitted[t] = 1;
+                reordered.push_back(tris[t]);
+                
+                for (unsigned v : { local_tris[t].x, local_tris[t].y, local_tris[t].z })
+                {
+                    dead_end.push_back(v);
+                    candidates.push_back(v);
+                    --live[v];
+                    if (time - cache_time[v] > cache_size)
+                    {
+                        cache_time[v] = time;
+                        ++time;
+                    }
+                }
+            }
+            
+            // The candidate that stays in the cache while its remaining fan is emitted, the
+            // oldest one first. Candidates that would not stay in the cache are never picked.
+            unsigned next = INVALID_UINT32;
+            long long best_priority = 0;
+            for (unsigned v : candidates)
+            {
+                if (live[v] == 0) continue;
+                long long priority = 0;
+                if (time - cache_time[v] + 2 * live[v] <= cache_size)
+                {
+                    priority = (long long)(time - cache_time[v]);
+                }
+                if (priority > best_priority)
+                {
+                    best_priority = priority;
+                    next = v;
+                }
+            }
+            // Dead end: a recently used vertex with triangles left, else the next one in order.
+            while ((next == INVALID_UINT32) && !dead_end.empty())
+            {
+                unsigned v = dead_end.back();
+                dead_end.pop_back();
+                if (live[v] > 0) next = v;
+            }
+            for (; (next == INVALID_UINT32) && (cursor < num_local); ++cursor)
+            {
+                if (live[cursor] > 0) next = cursor;
+            }
+            fanning = next;
+        }
+        
+        assert(reordered.size() == num_tris);
+        std::copy(reordered.begin(), reordered.end(), tris);
+    }
+    
+    // Reorder 'compact_triangles' for the post transform vertex cache. The triangles are first
+    // sorted by their smallest vertex index, so that after reorder_vertices_morton every batch of
+    // TIPSIFY_BATCH_TRIANGLES is a compact patch of the surface, then each batch goes through
+    // Tipsify on its own, in parallel. The vertex indices are not changed.
+    void reorder_triangles_tipsify(std::vector<uint3>& compact_triangles, unsigned cache_size = VERTEX_CACHE_SIZE)
+    {
+        auto min_vertex = [](const uint3& tri) { return std::min(tri.x, std::min(tri.y, tri.z)); };
+        parallel_sort(compact_triangles.begin(), compact_triangles.end(), [&](const uint3& a, const uint3& b)
+        {
+            vertex_index_type min_a = min_vertex(a), min_b = min_vertex(b);
+            if (min_a != min_b) return min_a < min_b;
+            if (a.x != b.x) return a.x < b.x;
+            if (a.y != b.y) return a.y < b.y;
+            return a.z < b.z;
+        });
+        
+        const size_t num_tris = compact_triangles.size();
+        parallel_for(0, num_tris, TIPSIFY_BATCH_TRIANGLES, [&](size_t tri_begin, size_t tri_end)
+        {
+            tipsify_batch(compact_triangles.data() + tri_begin, tri_end - tri_begin, cache_size);
+        });
+    }
+    
+    // Optional mesh optimization stage for the output of run_dmc: reorder_vertices_morton, then
+    // reorder_triangles_tipsify. The mesh itself is unchanged. If 'stats' is given, its
+    // reorder_mesh_ms, acmr_before and acmr_after are filled (the rest is left as run_dmc set it).
+    void reorder_mesh(std::vector<float3>& compact_vertices, std::vector<uint3>& compact_triangles,
+                      DmcStats* stats = nullptr, std::vector<float3>* compact_normals = nullptr)
+    {
+        if (stats) stats->acmr_before = calc_acmr(compact_triangles, compact_vertices.size());
+        
+        Timer timer;
+        reorder_vertices_morton(compact_vertices, compact_triangles, compact_normals);
+        reorder_triangles_tipsify(compact_triangles);
+        
+        if (stats)
+        {
+            stats->reorder_mesh_ms = timer.elapsed_ms();
+            stats->acmr_after = calc_acmr(compact_triangles, compact_vertices.size());
+        }
+    }
+}; // namespace dmc
+
+#endif /* mesh_reorder_h */
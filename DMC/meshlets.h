@@ -0,0 +1,278 @@
+//
+//  meshlets.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef meshlets_h
+#define meshlets_h
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "utils.h"
+#include "parallel.h"
+#include "dmc.h"
+
+namespace dmc
+{
+    const unsigned MESHLET_MAX_VERTICES = 64;
+    const unsigned MESHLET_MAX_TRIANGLES = 124;
+    // Edge length, in voxels, of the bricks meshlets are built from. No meshlet spans two bricks.
+    const unsigned MESHLET_BRICK_SIZE = 8;
+    
+    struct Meshlet
+    {
+        // The meshlet's vertices are meshlet_vertices[vertex_offset, vertex_offset + vertex_count),
+        // its triangles the 8-bit local index triples at meshlet_triangles[3 * triangle_offset].
+        unsigned vertex_offset;
+        unsigned triangle_offset;
+        unsigned vertex_count;
+        unsigned triangle_count;
+        
+        // Bounding sphere of the vertices.
+        float3 center;
+        float radius;
+        // Normal cone of the triangles, on the side they face. The whole meshlet is back facing
+        // from 'camera' if dot(normalize(cone_apex - camera), cone_axis) >= cone_cutoff; a
+        // cutoff of 1 never culls.
+        float3 cone_apex;
+        float3 cone_axis;
+        float cone_cutoff;
+    };
+    
+    // Meshlet output of run_dmc, in place of the triangle buffer. The triangles are the ones of
+    // generate_triangles, grouped into meshlets of at most MESHLET_MAX_VERTICES vertices and
+    // MESHLET_MAX_TRIANGLES triangles.
+    struct MeshletMesh
+    {
+        std::vector<Meshlet> meshlets;
+        // Indices into compact_vertices.
+        std::vector<vertex_index_type> meshlet_vertices;
+        std::vector<uint8_t> meshlet_triangles;
+        
+        void clear()
+        {
+            meshlets.clear();
+            meshlet_vertices.clear();
+            meshlet_triangles.clear();
+        }
+        
+        size_t num_triangles() const { return meshlet_triangles.size() / 3; }
+        
+        size_t num_bytes() const
+        {
+            return meshlets.capacity() * sizeof(Meshlet) + meshlet_vertices.capacity() * sizeof(vertex_index_type) +
+                   meshlet_triangles.capacity() * sizeof(uint8_t);
+        }
+    };
+    
+    // Fill the bounding sphere and the normal cone of 'meshlet' from its triangles.
+    void calc_meshlet_bounds(Meshlet& meshlet, const MeshletMesh& mesh, const std::vector<float3>& compact_vertices)
+    {
+        const vertex_index_type* vertices = mesh.meshlet_vertices.data() + meshlet.vertex_offset;
+        const uint8_t* triangles = mesh.meshlet_triangles.data() + 3 * meshlet.triangle_offset;
+        
+        // Sphere around the center of the bounding box.
+        float3 min_pt = compact_vertices[vertices[0]], max_pt = min_pt;
+        for (unsigned i = 1; i < meshlet.vertex_count; ++i)
+        {
+            const float3& pt = compact_vertices[vertices[i]];
+            min_pt = make_float3(std::min(min_pt.x, pt.x), std::min(min_pt.y, pt.y), std::min(min_pt.z, pt.z));
+            max_pt = make_float3(std::max(max_pt.x, pt.x), std::max(max_pt.y, pt.y), std::max(max_pt.z, pt.z));
+        }
+        meshlet.center = (min_pt + max_pt) * 0.5f;
+        float radius_sq = 0.0f;
+        for (unsigned i = 0; i < meshlet.vertex_count; ++i)
+        {
+            float3 d = compact_vertices[vertices[i]] - meshlet.center;
+            radius_sq = std::max(radius_sq, dot(d, d));
+        }
+        meshlet.radius = sqrtf(radius_sq);
+        
+        // Cone axis: the average triangle normal. The cone is empty if some triangle faces away
+        // from it.
+        float3 normals[MESHLET_MAX_TRIANGLES];
+        float3 axis = make_float3(0, 0, 0);
+        for (unsigned t = 0; t < meshlet.triangle_count; ++t)
+        {
+            const float3& p0 = compact_vertices[vertices[triangles[3 * t]]];
+            const float3& p1 = compact_vertices[vertices[triangles[3 * t + 1]]];
+            const float3& p2 = compact_vertices[vertices[triangles[3 * t + 2]]];
+            normals[t] = cross(p1 - p0, p2 - p0);
+            normalize_if_nonzero(normals[t]);
+            axis += normals[t];
+        }
+        normalize_if_nonzero(axis);
+        meshlet.cone_axis = axis;
+        meshlet.cone_apex = meshlet.center;
+        meshlet.cone_cutoff = 1.0f;
+        
+        float min_dot = 1.0f;
+        for (unsigned t = 0; t < meshlet.triangle_count; ++t)
+        {
+            min_dot = std::min(min_dot, dot(normals[t], axis));
+        }
+        if (min_dot <= 0.0f)
+        {
+            return;
+        }
+        // Pull the apex back along the axis until it is behind every triangle plane.
+        float max_t = 0.0f;
+        for (unsigned t = 0; t < meshlet.triangle_count; ++t)
+        {
+            const float3& p0 = compact_vertices[vertices[triangles[3 * t]]];
+            float dn = dot(normals[t], axis);
+            if (dn > 0.0f)
+            {
+                max_t = std::max(max_t, dot(meshlet.center - p0, normals[t]) / dn);
+            }
+        }
+        meshlet.cone_apex = meshlet.center - axis * max_t;
+        meshlet.cone_cutoff = sqrtf(1.0f - min_dot * min_dot);
+    }
+    
+    // Append the meshlets of the active voxels 'voxels' (the ones of one brick, in index1D order)
+    // to 'mesh'. The two triangles of a quad always go to the same meshlet.
+    template <typename IndexMap>
+    void append_brick_meshlets(MeshletMesh& mesh, const compact_index_type* voxels, size_t num_voxels,
+                               const std::vector<float3>& compact_vertices,
+                               const std::vector<_VoxelInfo>& compact_voxel_info,
+                               const IndexMap& full_voxel_index_map, const uint3& num_voxels_dim)
+    {
+        Meshlet meshlet = Meshlet();
+        meshlet.vertex_offset = (unsigned)mesh.meshlet_vertices.size();
+        meshlet.triangle_offset = (unsigned)mesh.num_triangles();
+        
+        auto flush = [&]()
+        {
+            if (meshlet.triangle_count == 0) return;
+            calc_meshlet_bounds(meshlet, mesh, compact_vertices);
+            mesh.meshlets.push_back(meshlet);
+            
+            meshlet = Meshlet();
+            meshlet.vertex_offset = (unsigned)mesh.meshlet_vertices.size();
+            meshlet.triangle_offset = (unsigned)mesh.num_triangles();
+        };
+        auto find_local = [&](vertex_index_type v)
+        {
+            const vertex_index_type* begin = mesh.meshlet_vertices.data() + meshlet.vertex_offset;
+            const vertex_index_type* end = begin + meshlet.vertex_count;
+            return (unsigned)(std::find(begin, end, v) - begin);
+        };
+        
+        for (size_t i = 0; i < num_voxels; ++i)
+        {
+            const _VoxelInfo& vx_info = compact_voxel_info[voxels[i]];
+            for_each_voxel_quad(vx_info, compact_voxel_info, full_voxel_index_map, num_voxels_dim,
+                                [&](const uint4& quad)
+            {
+                const vertex_index_type corners[4] = { quad.x, quad.y, quad.z, quad.w };
+                unsigned num_new = 0;
+                for (vertex_index_type v : corners)
+                {
+                    num_new += (find_local(v) == meshlet.vertex_count);
+                }
+                if ((meshlet.vertex_count + num_new > MESHLET_MAX_VERTICES) ||
+                    (meshlet.triangle_count + 2 > MESHLET_MAX_TRIANGLES))
+                {
+                    flush();
+                }
+                
+                uint8_t local[4];
+                for (unsigned c = 0; c < 4; ++c)
+                {
+                    unsigned l = find_local(corners[c]);
+                    if (l == meshlet.vertex_count)
+                    {
+                        mesh.meshlet_vertices.push_back(corners[c]);
+                        ++meshlet.vertex_count;
+                    }
+                    local[c] = (uint8_t)l;
+                }
+                // Same split as generate_voxel_triangles.
+                const uint8_t tris[6] = { local[0], local[1], local[2], local[2], local[3], local[0] };
+                mesh.meshlet_triangles.insert(mesh.meshlet_triangles.end(), tris, tris + 6);
+                meshlet.triangle_count += 2;
+            });
+        }
+        flush();
+    }
+    
+    // Meshlet output for finish_dmc. The active voxels are bucketed by MESHLET_BRICK_SIZE^3
+    // brick, the bricks are cut into meshlets in parallel (the triangles of a brick are spatially
+    // coherent, so its meshlets are compact) and the meshlets are then concatenated in brick order.
+    template <typename IndexMap>
+    void generate_faces(MeshletMesh& mesh, const std::vector<float3>& compact_vertices,
+                        const std::vector<_VoxelInfo>& compact_voxel_info,
+                        const IndexMap& full_voxel_index_map, const uint3& num_voxels_dim)
+    {
+        mesh.clear();
+        
+        std::vector<compact_index_type> voxels;
+        std::vector<size_t> brick_begin;
+        bucket_voxels_by_brick(voxels, brick_begin, nullptr, compact_voxel_info, num_voxels_dim, MESHLET_BRICK_SIZE);
+        
+        // Each chunk of bricks builds its own meshlets, the chunks are then appended in order.
+        // Bricks are chunked by their number of active voxels, which is what they cost.
+        const size_t num_bricks = brick_begin.size() - 1;
+        std::vector<size_t> chunk_begin;
+        split_by_weight(chunk_begin, brick_begin, num_bricks, VERTEX_PASS_GRAIN);
+        std::vector<MeshletMesh> chunk_meshes(chunk_begin.size() - 1);
+        parallel_for(0, chunk_meshes.size(), 1, [&](size_t chunk, size_t)
+        {
+            MeshletMesh& chunk_mesh = chunk_meshes[chunk];
+            for (size_t brick = chunk_begin[chunk]; brick < chunk_begin[chunk + 1]; ++brick)
+            {
+                append_brick_meshlets(chunk_mesh, voxels.data() + brick_begin[brick],
+                                      brick_begin[brick + 1] - brick_begin[brick], compact_vertices,
+                                      compact_voxel_info, full_voxel_index_map, num_voxels_dim);
+            }
+        });
+        
+        for (const MeshletMesh& chunk_mesh : chunk_meshes)
+        {
+            const unsigned vertex_base = (unsigned)mesh.meshlet_vertices.size();
+            const unsigned triangle_base = (unsigned)mesh.num_triangles();
+            for (Meshlet meshlet : chunk_mesh.meshlets)
+            {
+                meshlet.vertex_offset += vertex_base;
+                meshlet.triangle_offset += triangle_base;
+                mesh.meshlets.push_back(meshlet);
+            }
+            mesh.meshlet_vertices.insert(mesh.meshlet_vertices.end(), chunk_mesh.meshlet_vertices.begin(),
+                                         chunk_mesh.meshlet_vertices.end());
+            mesh.meshlet_triangles.insert(mesh.meshlet_triangles.end(), chunk_mesh.meshlet_triangles.begin(),
+                                          chunk_mesh.meshlet_triangles.end());
+        }
+    }
+    
+    // The hooks finish_dmc and compact_iso_vertices use for the other face buffers.
+    inline void remap_faces(MeshletMesh& mesh, const std::vector<vertex_index_type>& vertex_remap)
+    {
+        parallel_for(0, mesh.meshlet_vertices.size(), VERTEX_PASS_GRAIN, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                mesh.meshlet_vertices[i] = vertex_remap[mesh.meshlet_vertices[i]];
+            }
+        });
+    }
+    
+    inline void record_face_counts(DmcStats& stats, const MeshletMesh& mesh)
+    {
+        stats.num_meshlets = mesh.meshlets.size();
+        stats.num_triangles = mesh.num_triangles();
+    }
+    
+    inline void record_peak_bytes(size_t& peak_bytes, const MeshletMesh& mesh)
+    {
+        peak_bytes = std::max(peak_bytes, mesh.num_bytes());
+    }
+}; // namespace dmc
+
+#endif /* meshlets_h */
@@ -0,0 +1,255 @@
+//
+//  minmax_pyramid.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef minmax_pyramid_h
+#define minmax_pyramid_h
+
+#include <algorithm>
+#include <vector>
+
+#include "utils.h"
+#include "parallel.h"
+#include "dmc.h"
+#include "sparse_blocks.h"
+
+namespace dmc
+{
+    // Edge length, in voxels, of the bricks at the bottom of a MinMaxPyramid.
+    const unsigned MINMAX_BRICK_SIZE = 8;
+    
+    // Value range of the grid points of every brick of brick_size^3 voxels of 'scalar_grid' (the
+    // (brick_size + 1)^3 points that are corners of its voxels), bricks in index1D order.
+    inline void compute_brick_ranges(std::vector<float>& mins, std::vector<float>& maxs,
+                                     const scalar_grid_type& scalar_grid, unsigned brick_size)
+    {
+        uint3 num_voxels_dim;
+        get_num_voxels_dim_from_scalar_grid(num_voxels_dim, scalar_grid);
+        const uint3 num_bricks_dim = make_uint3((num_voxels_dim.x + brick_size - 1) / brick_size,
+                                                (num_voxels_dim.y + brick_size - 1) / brick_size,
+                                                (num_voxels_dim.z + brick_size - 1) / brick_size);
+        mins.resize((size_t)num_bricks_dim.x * num_bricks_dim.y * num_bricks_dim.z);
+        maxs.resize(mins.size());
+        
+        parallel_for(0, num_bricks_dim.z, 1, [&](size_t bz_begin, size_t bz_end)
+        {
+            for (unsigned bz = (unsigned)bz_begin; bz < bz_end; ++bz)
+            {
+                unsigned k0 = bz * brick_size, k1 = std::min(k0 + brick_size, num_voxels_dim.z);
+                for (unsigned by = 0; by < num_bricks_dim.y; ++by)
+                {
+                    unsigned j0 = by * brick_size, j1 = std::min(j0 + brick_size, num_voxels_dim.y);
+                    for (unsigned bx = 0; bx < num_bricks_dim.x; ++bx)
+                    {
+                        unsigned i0 = bx * brick_size, i1 = std::min(i0 + brick_size, num_voxels_dim.x);
+                        
+                        float min_val = scalar_grid(i0, j0, k0), max_val = min_val;
+                        for (unsigned k = k0; k <= k1; ++k)
+                        {
+                            for (unsigned j = j0; j <= j1; ++j)
+                            {
+                                const float* row = &scalar_grid(i0, j, k);
+                                for (unsigned i = 0; i <= i1 - i0; ++i)
+                                {
+                                    min_val = std::min(min_val, row[i]);
+                                    max_val = std::max(max_val, row[i]);
+                                }
+                            }
+                        }
+                        
+                        size_t brick = ((size_t)bz * num_bricks_dim.y + by) * num_bricks_dim.x + bx;
+                        mins[brick] = min_val;
+                        maxs[brick] = max_val;
+                    }
+                }
+            }
+        });
+    }
+    
+    // Classify the voxels of 'bricks' in 'scalar_grid' and run the sparse pipeline on them. Shared
+    // by the run_dmc flavours that look the bricks up in an acceleration structure.
+    void run_dmc_on_bricks(std::vector<float3>& compact_vertices, std::vector<uint3>& compact_triangles,
+                           const scalar_grid_type& scalar_grid, const SparseBlockSet& bricks,
+                           const float3& xyz_min, const float3& xyz_max, float iso_value,
+                           unsigned num_smooth, DmcStats* stats, Timer& timer)
+    {
+        compact_triangles.clear();
+        
+        std::vector<_VoxelInfo> compact_voxel_info;
+        std::vector<float3> edge_vertex_stream;
+        classify_blocks(compact_voxel_info, edge_vertex_stream, bricks, xyz_min, xyz_max, iso_value,
+                        [&](size_t, unsigned i0, unsigned j, unsigned k, const float** rows)
+                        {
+                            rows[0] = &scalar_grid(i0, j,     k    );
+                            rows[1] = &scalar_grid(i0, j + 1, k    );
+                            rows[2] = &scalar_grid(i0, j,     k + 1);
+                            rows[3] = &scalar_grid(i0, j + 1, k + 1);
+                        });
+        if (stats) stats->flag_active_voxels_ms = timer.lap_ms();
+        
+        finish_dmc_sparse(compact_vertices, compact_triangles, compact_voxel_info, edge_vertex_stream,
+                          xyz_min, xyz_max, bricks.num_voxels_dim(), num_smooth, stats, timer);
+    }
+    
+    // Value range acceleration structure of a scalar grid for empty space skipping. Level 0
+    // holds the min and max of the (brick_size + 1)^3 grid points of every brick of
+    // brick_size^3 voxels, each level above merges 2x2x2 nodes of the one below, up to a single
+    // root. A voxel can only be active if min < iso_value <= max holds for its brick, so
+    // find_bricks() only descends into the nodes that pass the same test.
+    //
+    // Building it is one pass over the grid; it does not depend on iso_value and can be reused
+    // for every extraction of the same grid.
+    class MinMaxPyramid
+    {
+    public:
+        MinMaxPyramid(const scalar_grid_type& scalar_grid, unsigned brick_size = MINMAX_BRICK_SIZE)
+        : m_brick_size(brick_size)
+        {
+            get_num_voxels_dim_from_scalar_grid(m_num_voxels_dim, scalar_grid);
+            
+            Level level;
+            level.dim = make_uint3((m_num_voxels_dim.x + brick_size - 1) / brick_size,
+                                   (m_num_voxels_dim.y + brick_size - 1) / brick_size,
+                                   (m_num_voxels_dim.z + brick_size - 1) / brick_size);
+            compute_brick_ranges(level.mins, level.maxs, scalar_grid, brick_size);
+            m_levels.push_back(std::move(level));
+            
+            while ((m_levels.back().dim.x > 1) || (m_levels.back().dim.y > 1) || (m_levels.back().dim.z > 1))
+            {
+                m_levels.push_back(reduce(m_levels.back()));
+            }
+        }
+        
+        const uint3& num_voxels_dim() const { return m_num_voxels_dim; }
+        unsigned brick_size() const { return m_brick_size; }
+        unsigned num_levels() const { return (unsigned)m_levels.size(); }
+        
+        // Fill 'bricks' with the bricks that may contain an active voxel at 'iso_value'.
+        void find_bricks(SparseBlockSet& bricks, float iso_value) const
+        {
+            struct Node { uint3 index3D; unsigned level; };
+            std::vector<Node> stack(1, { make_uint3(0, 0, 0), num_levels() - 1 });
+            std::vector<voxel_index1D_type> brick_indices;
+            
+            while (!stack.empty())
+            {
+                Node node = stack.back();
+                stack.pop_back();
+                
+                const Level& level = m_levels[node.level];
+                const uint3& n = node.index3D;
+                if (!(level.node_min(n.x, n.y, n.z) < iso_value && iso_value <= level.node_max(n.x, n.y, n.z)))
+                {
+                    continue;
+                }
+                
+                if (node.level == 0)
+                {
+                    voxel_index1D_type brick_index1D;
+                    index3D_to_1D(n, level.dim, brick_index1D);
+                    brick_indices.push_back(brick_index1D);
+                    continue;
+                }
+                
+                const uint3& child_dim = m_levels[node.level - 1].dim;
+                for (unsigned child = 0; child < 8; ++child)
+                {
+                    uint3 child3D = make_uint3(2 * n.x + (child & 1), 2 * n.y + ((child >> 1) & 1), 2 * n.z + (child >> 2));
+                    if ((child3D.x < child_dim.x) && (child3D.y < child_dim.y) && (child3D.z < child_dim.z))
+                    {
+                        stack.push_back({ child3D, node.level - 1 });
+                    }
+                }
+            }
+            
+            std::sort(brick_indices.begin(), brick_indices.end());
+            bricks.set_blocks(std::move(brick_indices));
+        }
+        
+        size_t num_bytes() const
+        {
+            size_t num_bytes = 0;
+            for (const Level& level : m_levels)
+            {
+                num_bytes += (level.mins.capacity() + level.maxs.capacity()) * sizeof(float);
+            }
+            return num_bytes;
+        }
+    
+    private:
+        struct Level
+        {
+            uint3 dim;
+            std::vector<float> mins;
+            std::vector<float> maxs;
+            
+            size_t offset(unsigned x, unsigned y, unsigned z) const { return ((size_t)z * dim.y + y) * dim.x + x; }
+            float& node_min(unsigned x, unsigned y, unsigned z) { return mins[offset(x, y, z)]; }
+            float& node_max(unsigned x, unsigned y, unsigned z) { return maxs[offset(x, y, z)]; }
+            float node_min(unsigned x, unsigned y, unsigned z) const { return mins[offset(x, y, z)]; }
+            float node_max(unsigned x, unsigned y, unsigned z) const { return maxs[offset(x, y, z)]; }
+        };
+        
+        static Level reduce(const Level& fine)
+        {
+            Level coarse;
+            coarse.dim = make_uint3((fine.dim.x + 1) / 2, (fine.dim.y + 1) / 2, (fine.dim.z + 1) / 2);
+            coarse.mins.resize((size_t)coarse.dim.x * coarse.dim.y * coarse.dim.z);
+            coarse.maxs.resize(coarse.mins.size());
+            
+            for (unsigned z = 0; z < coarse.dim.z; ++z)
+            {
+                for (unsigned y = 0; y < coarse.dim.y; ++y)
+                {
+                    for (unsigned x = 0; x < coarse.dim.x; ++x)
+                    {
+                        float min_val = fine.node_min(2 * x, 2 * y, 2 * z);
+                        float max_val = fine.node_max(2 * x, 2 * y, 2 * z);
+                        for (unsigned child = 1; child < 8; ++child)
+                        {
+                            unsigned cx = 2 * x + (child & 1), cy = 2 * y + ((child >> 1) & 1), cz = 2 * z + (child >> 2);
+                            if ((cx < fine.dim.x) && (cy < fine.dim.y) && (cz < fine.dim.z))
+                            {
+                                min_val = std::min(min_val, fine.node_min(cx, cy, cz));
+                                max_val = std::max(max_val, fine.node_max(cx, cy, cz));
+                            }
+                        }
+                        coarse.node_min(x, y, z) = min_val;
+                        coarse.node_max(x, y, z) = max_val;
+                    }
+                }
+            }
+            return coarse;
+        }
+        
+        uint3 m_num_voxels_dim;
+        unsigned m_brick_size;
+        // m_levels[0] are the bricks, m_levels.back() the root.
+        std::vector<Level> m_levels;
+    };
+    
+    // Same mesh as run_dmc on 'scalar_grid', but only the voxels of the bricks that 'pyramid'
+    // (built from the same grid) reports for 'iso_value' are classified; the active voxels then go
+    // through the sparse pipeline of the fused run_dmc. Memory and time scale with the bricks the
+    // surface passes through rather than with the whole grid.
+    void run_dmc(std::vector<float3>& compact_vertices, std::vector<uint3>& compact_triangles,
+                 const scalar_grid_type& scalar_grid, const MinMaxPyramid& pyramid,
+                 const float3& xyz_min, const float3& xyz_max, float iso_value,
+                 unsigned num_smooth = 0, DmcStats* stats = nullptr)
+    {
+        Timer timer;
+        if (stats) *stats = DmcStats();
+        
+        SparseBlockSet bricks(pyramid.num_voxels_dim(), pyramid.brick_size());
+        pyramid.find_bricks(bricks, iso_value);
+        
+        run_dmc_on_bricks(compact_vertices, compact_triangles, scalar_grid, bricks, xyz_min, xyz_max, iso_value,
+                          num_smooth, stats, timer);
+    }
+}; // namespace dmc
+
+#endif /* minmax_pyramid_h */
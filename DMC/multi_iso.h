@@ -0,0 +1,133 @@
+//
+//  multi_iso.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef multi_iso_h
+#define multi_iso_h
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+#include "utils.h"
+#include "dmc.h"
+
+namespace dmc
+{
+    // Extract one mesh per value of 'iso_values' (sorted ascending) from a single sweep over
+    // 'scalar_grid'. Each voxel's corners are read and its coordinates computed once; the levels
+    // it is active for are the ones in (min corner, max corner], found by binary search, and each
+    // of them gets the voxel's info and edge vertices in its own compact buffers. The rest runs
+    // per level, with one dense index map reused by all the levels. The meshes are the same as
+    // those of one run_dmc per level.
+    //
+    // If 'stats' is given it gets one DmcStats per level. The sweep is shared: every level
+    // reports it as flag_active_voxels_ms, and total_ms only counts that level's own stages.
+    void run_dmc_multi_iso(std::vector<std::vector<float3>>& compact_vertices_per_level,
+                           std::vector<std::vector<uint3>>& compact_triangles_per_level,
+                           const scalar_grid_type& scalar_grid, const float3& xyz_min, const float3& xyz_max,
+                           const std::vector<float>& iso_values, unsigned num_smooth = 0,
+                           std::vector<DmcStats>* stats = nullptr)
+    {
+        assert(std::is_sorted(iso_values.begin(), iso_values.end()));
+        const size_t num_levels = iso_values.size();
+        
+        Timer timer;
+        if (stats) stats->assign(num_levels, DmcStats());
+        
+        uint3 num_voxels_dim;
+        get_num_voxels_dim_from_scalar_grid(num_voxels_dim, scalar_grid);
+        const float3 xyz_range = xyz_max - xyz_min;
+        
+        std::vector<float> xs(num_voxels_dim.x + 1), ys(num_voxels_dim.y + 1);
+        for (unsigned i = 0; i < xs.size(); ++i) xs[i] = ijk_to_xyz(i, num_voxels_dim.x, xyz_range.x, xyz_min.x);
+        for (unsigned j = 0; j < ys.size(); ++j) ys[j] = ijk_to_xyz(j, num_voxels_dim.y, xyz_range.y, xyz_min.y);
+        
+        std::vector<std::vector<_VoxelInfo>> compact_voxel_info(num_levels);
+        std::vector<std::vector<float3>> edge_vertex_stream(num_levels);
+        
+        for (unsigned k = 0; k < num_voxels_dim.z; ++k)
+        {
+            const float z0 = ijk_to_xyz(k,     num_voxels_dim.z, xyz_range.z, xyz_min.z);
+            const float z1 = ijk_to_xyz(k + 1, num_voxels_dim.z, xyz_range.z, xyz_min.z);
+            
+            for (unsigned j = 0; j < num_voxels_dim.y; ++j)
+            {
+                const float* row00 = &scalar_grid(0, j,     k    );
+                const float* row01 = &scalar_grid(0, j + 1, k    );
+                const float* row10 = &scalar_grid(0, j,     k + 1);
+                const float* row11 = &scalar_grid(0, j + 1, k + 1);
+                
+                for (unsigned i = 0; i < num_voxels_dim.x; ++i)
+                {
+                    const float voxel_vals[8] =
+                    {
+                        row00[i], row00[i + 1], row01[i + 1], row01[i],
+                        row10[i], row10[i + 1], row11[i + 1], row11[i]
+                    };
+                    const float min_val = *std::min_element(voxel_vals, voxel_vals + 8);
+                    const float max_val = *std::max_element(voxel_vals, voxel_vals + 8);
+                    
+                    // The voxel is active for min_val < iso_value <= max_val.
+                    auto first = std::upper_bound(iso_values.begin(), iso_values.end(), min_val);
+                    auto last = std::upper_bound(first, iso_values.end(), max_val);
+                    if (first == last)
+                    {
+                        continue;
+                    }
+                    
+                    voxel_index1D_type index1D;
+                    index3D_to_1D(i, j, k, num_voxels_dim.x, num_voxels_dim.y, index1D);
+                    for (auto iso_iter = first; iso_iter != last; ++iso_iter)
+                    {
+                        size_t level = iso_iter - iso_values.begin();
+                        append_if_active(compact_voxel_info[level], edge_vertex_stream[level], index1D, voxel_vals,
+                                         xs[i], xs[i + 1], ys[j], ys[j + 1], z0, z1, *iso_iter);
+                    }
+                }
+            }
+        }
+        const double sweep_ms = timer.lap_ms();
+        
+        // One dense index map, filled with the voxels of each level in turn.
+        std::vector<compact_index_type> full_voxel_index_map((size_t)num_voxels_dim.x * num_voxels_dim.y * num_voxels_dim.z,
+                                                             INVALID_COMPACT_INDEX);
+        
+        compact_vertices_per_level.resize(num_levels);
+        compact_triangles_per_level.resize(num_levels);
+        for (size_t level = 0; level < num_levels; ++level)
+        {
+            Timer level_timer;
+            DmcStats* level_stats = stats ? &(*stats)[level] : nullptr;
+            
+            std::vector<_VoxelInfo>& level_voxel_info = compact_voxel_info[level];
+            for (compact_index_type compact_index = 0; compact_index < level_voxel_info.size(); ++compact_index)
+            {
+                full_voxel_index_map[level_voxel_info[compact_index].index1D()] = compact_index;
+            }
+            if (level_stats)
+            {
+                level_stats->flag_active_voxels_ms = sweep_ms;
+                level_stats->compact_voxel_flags_ms = level_timer.lap_ms();
+                record_peak_bytes(level_stats->full_voxel_index_map_bytes, full_voxel_index_map);
+            }
+            
+            compact_triangles_per_level[level].clear();
+            finish_dmc_from_stream(compact_vertices_per_level[level], compact_triangles_per_level[level],
+                                   level_voxel_info, edge_vertex_stream[level], full_voxel_index_map,
+                                   xyz_min, xyz_max, num_voxels_dim, num_smooth, level_stats, level_timer);
+            
+            for (const _VoxelInfo& vx_info : level_voxel_info)
+            {
+                full_voxel_index_map[vx_info.index1D()] = INVALID_COMPACT_INDEX;
+            }
+            std::vector<_VoxelInfo>().swap(level_voxel_info);
+        }
+    }
+}; // namespace dmc
+
+#endif /* multi_iso_h */
@@ -0,0 +1,283 @@
+//
+//  narrow_band.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef narrow_band_h
+#define narrow_band_h
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "utils.h"
+#include "parallel.h"
+#include "dmc.h"
+#include "sparse_blocks.h"
+
+namespace dmc
+{
+    // Edge length, in voxels, of the blocks of a SparseBlockGrid.
+    const unsigned NARROW_BAND_BLOCK_SIZE = 8;
+    
+    // Field samples stored only for the blocks of a SparseBlockSet. Each block keeps its own
+    // (block_size + 1)^3 grid points, x fastest, so that all 8 corners of its voxels are local;
+    // the points on a shared face are stored by both blocks.
+    class SparseBlockGrid : public SparseBlockSet
+    {
+    public:
+        SparseBlockGrid(const uint3& num_voxels_dim, unsigned block_size = NARROW_BAND_BLOCK_SIZE)
+        : SparseBlockSet(num_voxels_dim, block_size)
+        , m_block_dim(block_size + 1) { }
+        
+        // Grid points per block along each axis, block_size + 1.
+        unsigned block_dim() const { return m_block_dim; }
+        
+        // Allocate the blocks in 'block_indices' (sorted, no duplicates), dropping the previous
+        // ones. The samples are zero until they are written through block_samples().
+        void set_blocks(std::vector<voxel_index1D_type> block_indices)
+        {
+            SparseBlockSet::set_blocks(std::move(block_indices));
+            m_samples.assign(num_blocks() * block_num_pts(), 0.0f);
+        }
+        
+        size_t block_num_pts() const { return (size_t)m_block_dim * m_block_dim * m_block_dim; }
+        
+        float* block_samples(size_t slot) { return m_samples.data() + slot * block_num_pts(); }
+        const float* block_samples(size_t slot) const { return m_samples.data() + slot * block_num_pts(); }
+        
+        size_t num_bytes() const { return SparseBlockSet::num_bytes() + m_samples.capacity() * sizeof(float); }
+    
+    private:
+        unsigned m_block_dim;
+        std::vector<float> m_samples;
+    };
+    
+    // A field may provide lipschitz_bound() (see surface::Isosurface); 0 means no bound is known.
+    template <typename Field>
+    auto field_lipschitz_bound(const Field& field, int) -> decltype((float)field.lipschitz_bound())
+    {
+        return field.lipschitz_bound();
+    }
+    
+    template <typename Field>
+    float field_lipschitz_bound(const Field&, long) { return 0.0f; }
+    
+    // Fill 'block_grid' with the blocks of its volume over [xyz_min, xyz_max] that the surface
+    // 'field' = iso_value may pass through, and return the number of field evaluations spent.
+    //
+    // The volume is split into a few coarse cells which are refined as an octree down to single
+    // blocks. A cell only costs its 8 corner samples: with the Lipschitz bound L, no point of the
+    // cell is further than half its diagonal d from a corner, so if iso_value is outside
+    // [min corner - L * d, max corner + L * d] the whole cell is dropped. Only the blocks that
+    // survive down to the finest level are sampled densely, so the work follows the area of the
+    // surface instead of the volume. With a valid bound the active voxels, and thus the mesh, are
+    // exactly those of the dense grid.
+    //
+    // 'lipschitz' overrides the bound of 'field'. If neither gives one, each cell estimates it as
+    // twice the steepest slope along its 12 edges; that is a heuristic and may miss features
+    // smaller than a coarse cell. 'field' is called from the worker threads.
+    template <typename Field>
+    size_t sample_narrow_band(SparseBlockGrid& block_grid, const Field& field,
+                              const float3& xyz_min, const float3& xyz_max, float iso_value, float lipschitz = 0.0f)
+    {
+        const uint3& num_voxels_dim = block_grid.num_voxels_dim();
+        const uint3& num_blocks_dim = block_grid.num_blocks_dim();
+        const unsigned block_size = block_grid.block_size();
+        const float3 xyz_range = xyz_max - xyz_min;
+        if (lipschitz <= 0.0f) lipschitz = field_lipschitz_bound(field, 0);
+        
+        std::vector<float> xs(num_voxels_dim.x + 1), ys(num_voxels_dim.y + 1), zs(num_voxels_dim.z + 1);
+        for (unsigned i = 0; i < xs.size(); ++i) xs[i] = ijk_to_xyz(i, num_voxels_dim.x, xyz_range.x, xyz_min.x);
+        for (unsigned j = 0; j < ys.size(); ++j) ys[j] = ijk_to_xyz(j, num_voxels_dim.y, xyz_range.y, xyz_min.y);
+        for (unsigned k = 0; k < zs.size(); ++k) zs[k] = ijk_to_xyz(k, num_voxels_dim.z, xyz_range.z, xyz_min.z);
+        
+        // Coarsest level: cells of 2^top_level blocks, at most 8 of them along each axis.
+        unsigned max_num_blocks = std::max(num_blocks_dim.x, std::max(num_blocks_dim.y, num_blocks_dim.z));
+        unsigned top_level = 0;
+        while (((max_num_blocks + (1u << top_level) - 1) >> top_level) > 8) ++top_level;
+        
+        const unsigned top_cell_blocks = 1u << top_level;
+        const uint3 num_top_cells_dim = make_uint3((num_blocks_dim.x + top_cell_blocks - 1) >> top_level,
+                                                   (num_blocks_dim.y + top_cell_blocks - 1) >> top_level,
+                                                   (num_blocks_dim.z + top_cell_blocks - 1) >> top_level);
+        const size_t num_top_cells = (size_t)num_top_cells_dim.x * num_top_cells_dim.y * num_top_cells_dim.z;
+        
+        // May the surface cross the cell of 2^level blocks whose first block is 'block3D'?
+        auto may_cross = [&](const uint3& block3D, unsigned level, size_t& num_evals)
+        {
+            unsigned cell_size = block_size << level;
+            unsigned i0 = block3D.x * block_size, i1 = std::min(i0 + cell_size, num_voxels_dim.x);
+            unsigned j0 = block3D.y * block_size, j1 = std::min(j0 + cell_size, num_voxels_dim.y);
+            unsigned k0 = block3D.z * block_size, k1 = std::min(k0 + cell_size, num_voxels_dim.z);
+            
+            // Same corner order as a voxel.
+            const float corner_vals[8] =
+            {
+                eval_field(field, xs[i0], ys[j0], zs[k0], 0),
+                eval_field(field, xs[i1], ys[j0], zs[k0], 0),
+                eval_field(field, xs[i1], ys[j1], zs[k0], 0),
+                eval_field(field, xs[i0], ys[j1], zs[k0], 0),
+                eval_field(field, xs[i0], ys[j0], zs[k1], 0),
+                eval_field(field, xs[i1], ys[j0], zs[k1], 0),
+                eval_field(field, xs[i1], ys[j1], zs[k1], 0),
+                eval_field(field, xs[i0], ys[j1], zs[k1], 0)
+            };
+            num_evals += 8;
+            
+            float ext_x = xs[i1] - xs[i0], ext_y = ys[j1] - ys[j0], ext_z = zs[k1] - zs[k0];
+            float bound = lipschitz;
+            if (bound <= 0.0f)
+            {
+                // The cell edges along x, y and z as pairs of corners.
+                static const uint8_t edge_pts[3][4][2] =
+                {
+                    { {0, 1}, {3, 2}, {4, 5}, {7, 6} },
+                    { {0, 3}, {1, 2}, {4, 7}, {5, 6} },
+                    { {0, 4}, {1, 5}, {2, 6}, {3, 7} }
+                };
+                const float ext[3] = { ext_x, ext_y, ext_z };
+                for (unsigned axis = 0; axis < 3; ++axis)
+                {
+                    if (ext[axis] <= 0.0f) continue;
+                    for (unsigned edge = 0; edge < 4; ++edge)
+                    {
+                        float slope = fabsf(corner_vals[edge_pts[axis][edge][1]] - corner_vals[edge_pts[axis][edge][0]]) / ext[axis];
+                        bound = std::max(bound, 2.0f * slope);
+                    }
+                }
+            }
+            
+            // A little slack for the rounding in the corner samples.
+            float reach = bound * 0.5f * sqrtf(ext_x * ext_x + ext_y * ext_y + ext_z * ext_z) * 1.001f + 1e-6f;
+            float min_val = *std::min_element(corner_vals, corner_vals + 8);
+            float max_val = *std::max_element(corner_vals, corner_vals + 8);
+            return (min_val - reach <= iso_value) && (iso_value <= max_val + reach);
+        };
+        
+        std::vector<std::vector<voxel_index1D_type>> top_cell_blocks_found(num_top_cells);
+        std::vector<size_t> top_cell_num_evals(num_top_cells, 0);
+        parallel_for(0, num_top_cells, 1, [&](size_t cell_begin, size_t cell_end)
+        {
+            struct Cell { uint3 block3D; unsigned level; };
+            std::vector<Cell> stack;
+            
+            for (size_t cell = cell_begin; cell < cell_end; ++cell)
+            {
+                uint3 top3D;
+                index1D_to_3D(cell, num_top_cells_dim, top3D);
+                stack.push_back({ make_uint3(top3D.x << top_level, top3D.y << top_level, top3D.z << top_level), top_level });
+                
+                while (!stack.empty())
+                {
+                    Cell cur = stack.back();
+                    stack.pop_back();
+                    if (!may_cross(cur.block3D, cur.level, top_cell_num_evals[cell]))
+                    {
+                        continue;
+                    }
+                    
+                    if (cur.level == 0)
+                    {
+                        voxel_index1D_type block_index1D;
+                        index3D_to_1D(cur.block3D, num_blocks_dim, block_index1D);
+                        top_cell_blocks_found[cell].push_back(block_index1D);
+                        continue;
+                    }
+                    
+                    unsigned half = 1u << (cur.level - 1);
+                    for (unsigned child = 0; child < 8; ++child)
+                    {
+                        uint3 child3D = make_uint3(cur.block3D.x + (child & 1 ? half : 0),
+                                                   cur.block3D.y + (child & 2 ? half : 0),
+                                                   cur.block3D.z + (child & 4 ? half : 0));
+                        if ((child3D.x < num_blocks_dim.x) && (child3D.y < num_blocks_dim.y) &&
+                            (child3D.z < num_blocks_dim.z))
+                        {
+                            stack.push_back({ child3D, cur.level - 1 });
+                        }
+                    }
+                }
+            }
+        });
+        
+        std::vector<voxel_index1D_type> block_indices;
+        size_t num_evals = 0;
+        for (size_t cell = 0; cell < num_top_cells; ++cell)
+        {
+            block_indices.insert(block_indices.end(), top_cell_blocks_found[cell].begin(), top_cell_blocks_found[cell].end());
+            num_evals += top_cell_num_evals[cell];
+        }
+        std::sort(block_indices.begin(), block_indices.end());
+        block_grid.set_blocks(std::move(block_indices));
+        
+        // Sample the surviving blocks densely; points outside the volume are left at 0.
+        const unsigned block_dim = block_grid.block_dim();
+        std::vector<size_t> block_num_evals(block_grid.num_blocks(), 0);
+        parallel_for(0, block_grid.num_blocks(), 1, [&](size_t slot_begin, size_t slot_end)
+        {
+            for (size_t slot = slot_begin; slot < slot_end; ++slot)
+            {
+                uint3 block3D = block_grid.block_index3D(slot);
+                unsigned i0 = block3D.x * block_size, j0 = block3D.y * block_size, k0 = block3D.z * block_size;
+                unsigned ni = std::min(block_dim, num_voxels_dim.x + 1 - i0);
+                unsigned nj = std::min(block_dim, num_voxels_dim.y + 1 - j0);
+                unsigned nk = std::min(block_dim, num_voxels_dim.z + 1 - k0);
+                
+                float* samples = block_grid.block_samples(slot);
+                for (unsigned lk = 0; lk < nk; ++lk)
+                {
+                    for (unsigned lj = 0; lj < nj; ++lj)
+                    {
+                        float* row = samples + ((size_t)lk * block_dim + lj) * block_dim;
+                        for (unsigned li = 0; li < ni; ++li)
+                        {
+                            row[li] = eval_field(field, xs[i0 + li], ys[j0 + lj], zs[k0 + lk], 0);
+                        }
+                    }
+                }
+                block_num_evals[slot] = (size_t)ni * nj * nk;
+            }
+        });
+        for (size_t n : block_num_evals) num_evals += n;
+        
+        return num_evals;
+    }
+    
+    // Extract the mesh from a narrow band sampled with sample_narrow_band. Only the voxels of the
+    // allocated blocks are classified, the rest is the same sparse pipeline as the fused run_dmc.
+    void run_dmc(std::vector<float3>& compact_vertices, std::vector<uint3>& compact_triangles,
+                 const SparseBlockGrid& block_grid, const float3& xyz_min, const float3& xyz_max,
+                 float iso_value, unsigned num_smooth = 0, DmcStats* stats = nullptr)
+    {
+        Timer timer;
+        if (stats) *stats = DmcStats();
+        
+        compact_triangles.clear();
+        
+        const unsigned block_size = block_grid.block_size();
+        const unsigned block_dim = block_grid.block_dim();
+        const size_t slice_stride = (size_t)block_dim * block_dim;
+        
+        std::vector<_VoxelInfo> compact_voxel_info;
+        std::vector<float3> edge_vertex_stream;
+        classify_blocks(compact_voxel_info, edge_vertex_stream, block_grid, xyz_min, xyz_max, iso_value,
+                        [&](size_t slot, unsigned, unsigned j, unsigned k, const float** rows)
+                        {
+                            rows[0] = block_grid.block_samples(slot) + (k % block_size) * slice_stride +
+                                      (j % block_size) * block_dim;
+                            rows[1] = rows[0] + block_dim;
+                            rows[2] = rows[0] + slice_stride;
+                            rows[3] = rows[2] + block_dim;
+                        });
+        if (stats) stats->flag_active_voxels_ms = timer.lap_ms();
+        
+        finish_dmc_sparse(compact_vertices, compact_triangles, compact_voxel_info, edge_vertex_stream,
+                          xyz_min, xyz_max, block_grid.num_voxels_dim(), num_smooth, stats, timer);
+    }
+}; // namespace dmc
+
+#endif /* narrow_band_h */
@@ -0,0 +1,398 @@
+//
+//  parallel.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef parallel_h
+#define parallel_h
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace utils
+{
+    // Number of threads parallel_for uses. Defaults to the hardware concurrency, set it to 1
+    // to run everything on the calling thread. Passes already running keep their pool (see
+    // thread_pool()), so it may change while an AsyncDmc extracts in the background.
+    inline std::atomic<unsigned>& num_worker_threads_ref()
+    {
+        static std::atomic<unsigned> num_threads(std::max(1u, std::thread::hardware_concurrency()));
+        return num_threads;
+    }
+    
+    inline unsigned num_worker_threads() { return num_worker_threads_ref(); }
+    
+    inline void set_num_worker_threads(unsigned num_threads) { num_worker_threads_ref() = std::max(1u, num_threads); }
+    
+    // Persistent worker threads, so the passes of an extraction do not each pay for starting
+    // threads. run(num_jobs, job) calls job(t) for every t in [0, num_jobs): job 0 on the calling
+    // thread, job t on worker t, so a given t always runs on the same thread. It returns when all
+    // of them are done. A run issued from inside a job (a nested parallel_for) has no free
+    // workers and runs its jobs one after the other on the calling thread; runs from different
+    // outside threads take turns.
+    class ThreadPool
+    {
+    public:
+        explicit ThreadPool(unsigned num_threads)
+        {
+            for (unsigned t = 1; t < std::max(1u, num_threads); ++t)
+            {
+                m_workers.emplace_back([this, t]() { worker_loop(t); });
+            }
+        }
+        
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_wake.notify_all();
+            for (std::thread& worker : m_workers)
+            {
+                worker.join();
+            }
+        }
+        
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+        
+        unsigned num_threads() const { return (unsigned)m_workers.size() + 1; }
+        
+        // How many jobs of a run from the calling thread actually run in parallel.
+        unsigned concurrency() const { return in_job() ? 1 : num_threads(); }
+        
+        template <typename Job>
+        void run(unsigned num_jobs, const Job& job)
+        {
+            num_jobs = std::min(num_jobs, num_threads());
+            if (in_job() || (num_jobs <= 1))
+            {
+                for (unsigned t = 0; t < num_jobs; ++t)
+                {
+                    job(t);
+                }
+                return;
+            }
+            
+            std::lock_guard<std::mutex> run_lock(m_run_mutex);
+            const std::function<void(unsigned)> job_fn(job);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_job = &job_fn;
+                m_num_jobs = num_jobs;
+                m_num_pending = num_jobs - 1;
+                ++m_generation;
+            }
+            m_wake.notify_all();
+            
+            in_job() = true;
+            job(0);
+            in_job() = false;
+            
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_done.wait(lock, [this]() { return m_num_pending == 0; });
+            m_job = nullptr;
+        }
+    
+    private:
+        static bool& in_job()
+        {
+            static thread_local bool flag = false;
+            return flag;
+        }
+        
+        void worker_loop(unsigned t)
+        {
+            in_job() = true;
+            size_t seen_generation = 0;
+            for (;;)
+            {
+                const std::function<void(unsigned)>* job = nullptr;
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_wake.wait(lock, [&]() { return m_stop || (m_generation != seen_generation); });
+                    if (m_stop) return;
+                    seen_generation = m_generation;
+                    if (t < m_num_jobs) job = m_job;
+                }
+                if (!job) continue;
+                
+                (*job)(t);
+                
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (--m_num_pending == 0)
+                {
+                    m_done.notify_one();
+                }
+            }
+        }
+        
+        std::vector<std::thread> m_workers;
+        std::mutex m_run_mutex;
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::condition_variable m_done;
+        const std::function<void(unsigned)>* m_job = nullptr;
+        unsigned m_num_jobs = 0;
+        unsigned m_num_pending = 0;
+        size_t m_generation = 0;
+        bool m_stop = false;
+    };
+    
+    // The pool parallel_for and the other helpers here run on, with num_worker_threads() threads.
+    // It is made on first use and remade when num_worker_threads() changes. Callers hold on to the
+    // pointer for the length of their run, so a pool that is remade while another thread (an
+    // AsyncDmc, say) is still running on it lives until that run is over.
+    inline std::shared_ptr<ThreadPool> thread_pool()
+    {
+        static std::mutex mutex;
+        static std::shared_ptr<ThreadPool> pool;
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!pool || (pool->num_threads() != num_worker_threads()))
+        {
+            pool = std::make_shared<ThreadPool>(num_worker_threads());
+        }
+        return pool;
+    }
+    
+    // A thread's share of the chunks of a parallel_for: [begin, end) packed into one word so that
+    // the owner taking from the front and thieves taking from the back agree with a single CAS.
+    class alignas(64) StealableRange
+    {
+    public:
+        void reset(size_t begin, size_t end) { m_range.store(pack(begin, end)); }
+        
+        bool pop_front(size_t& chunk)
+        {
+            uint64_t range = m_range.load();
+            while (begin_of(range) < end_of(range))
+            {
+                if (m_range.compare_exchange_weak(range, pack(begin_of(range) + 1, end_of(range))))
+                {
+                    chunk = begin_of(range);
+                    return true;
+                }
+            }
+            return false;
+        }
+        
+        // Move the back half of this range to 'thief', whose own range must be empty.
+        bool steal_into(StealableRange& thief)
+        {
+            uint64_t range = m_range.load();
+            while (begin_of(range) < end_of(range))
+            {
+                size_t begin = begin_of(range), end = end_of(range);
+                size_t mid = end - (end - begin + 1) / 2;
+                if (m_range.compare_exchange_weak(range, pack(begin, mid)))
+                {
+                    thief.reset(mid, end);
+                    return true;
+                }
+            }
+            return false;
+        }
+    
+    private:
+        static uint64_t pack(size_t begin, size_t end) { return ((uint64_t)begin << 32) | (uint64_t)end; }
+        static size_t begin_of(uint64_t range) { return (size_t)(range >> 32); }
+        static size_t end_of(uint64_t range) { return (size_t)(range & 0xffffffffu); }
+        
+        std::atomic<uint64_t> m_range;
+    };
+    
+    // Split [begin, end) into chunks of 'grain' items and call fn(chunk_begin, chunk_end) for each
+    // of them, in parallel on thread_pool(). Chunks always start at begin + a multiple of
+    // 'grain'. Each thread starts on its own contiguous share of the chunks, and a thread that
+    // runs out steals the back half of another thread's remaining share, so chunks with uneven
+    // cost (bricks through dense and empty parts of a volume) still balance while each thread
+    // mostly walks neighbouring chunks. The calling thread works too and the call returns when
+    // all chunks are done.
+    template <typename Fn>
+    void parallel_for(size_t begin, size_t end, size_t grain, const Fn& fn)
+    {
+        if (begin >= end) return;
+        
+        grain = std::max<size_t>(1, grain);
+        size_t num_chunks = (end - begin + grain - 1) / grain;
+        assert(num_chunks < ((size_t)1 << 32));
+        auto run_chunk = [&](size_t chunk)
+        {
+            size_t chunk_begin = begin + chunk * grain;
+            fn(chunk_begin, std::min(end, chunk_begin + grain));
+        };
+        
+        std::shared_ptr<ThreadPool> pool = thread_pool();
+        unsigned num_threads = (unsigned)std::min<size_t>(pool->concurrency(), num_chunks);
+        if (num_threads <= 1)
+        {
+            for (size_t chunk = 0; chunk < num_chunks; ++chunk)
+            {
+                run_chunk(chunk);
+            }
+            return;
+        }
+        
+        std::vector<StealableRange> shares(num_threads);
+        for (unsigned t = 0; t < num_threads; ++t)
+        {
+            shares[t].reset(num_chunks * t / num_threads, num_chunks * (t + 1) / num_threads);
+        }
+        pool->run(num_threads, [&](unsigned t)
+        {
+            for (;;)
+            {
+                size_t chunk;
+                while (shares[t].pop_front(chunk))
+                {
+                    run_chunk(chunk);
+                }
+                
+                bool stolen = false;
+                for (unsigned i = 1; (i < num_threads) && !stolen; ++i)
+                {
+                    stolen = shares[(t + i) % num_threads].steal_into(shares[t]);
+                }
+                if (!stolen) return;
+            }
+        });
+    }
+    
+    // Split [begin, end) into num_worker_threads() contiguous ranges of (almost) equal size and
+    // call fn(range_begin, range_end) for the t-th range as job t of thread_pool(), the calling
+    // thread taking the first one. Unlike parallel_for the partition only depends on the range
+    // and the thread count, and job t always runs on the same pool thread, so passes over the
+    // same range meet the same items on the same thread: the partition to first-touch memory
+    // with (the threads are not pinned to cores here).
+    template <typename Fn>
+    void parallel_for_static(size_t begin, size_t end, const Fn& fn)
+    {
+        if (begin >= end) return;
+        
+        std::shared_ptr<ThreadPool> pool = thread_pool();
+        size_t num_threads = std::min<size_t>(pool->num_threads(), end - begin);
+        pool->run((unsigned)num_threads, [&](unsigned t)
+        {
+            fn(begin + (end - begin) * t / num_threads, begin + (end - begin) * (t + 1) / num_threads);
+        });
+    }
+    
+    // Split the items [0, n), whose weights are given as prefix sums (weight_offsets[i] is the
+    // total weight of the items before i, n + 1 entries), into chunks of about 'chunk_weight'
+    // each and at least one item. 'chunk_begin' gets the first item of every chunk, then n. Used
+    // to hand bricks to parallel_for by their number of active voxels rather than one by one.
+    template <typename Offsets>
+    void split_by_weight(std::vector<size_t>& chunk_begin, const Offsets& weight_offsets, size_t n,
+                         size_t chunk_weight)
+    {
+        chunk_begin.assign(1, 0);
+        while (chunk_begin.back() < n)
+        {
+            size_t first = chunk_begin.back();
+            auto target = weight_offsets[first] + chunk_weight;
+            // The last item boundary whose offset does not pass the target.
+            size_t last = std::upper_bound(weight_offsets.begin() + first + 1, weight_offsets.begin() + n + 1, target) -
+                          weight_offsets.begin() - 1;
+            chunk_begin.push_back(std::max(last, first + 1));
+        }
+    }
+    
+    // Exclusive prefix sum of count(i) for i in [0, n): offsets[i] is the sum of the counts before
+    // i and offsets[n] the total, which is also returned. Two parallel passes over chunks of
+    // 'grain' items (the chunk sums, then the offsets) around a serial scan of the chunk sums, so
+    // count() is called twice per item.
+    template <typename T, typename CountFn>
+    T parallel_exclusive_scan(std::vector<T>& offsets, size_t n, size_t grain, const CountFn& count)
+    {
+        grain = std::max<size_t>(1, grain);
+        size_t num_chunks = (n + grain - 1) / grain;
+        std::vector<T> chunk_offsets(num_chunks + 1, T());
+        
+        parallel_for(0, n, grain, [&](size_t chunk_begin, size_t chunk_end)
+        {
+            T sum = T();
+            for (size_t i = chunk_begin; i < chunk_end; ++i)
+            {
+                sum += count(i);
+            }
+            chunk_offsets[chunk_begin / grain + 1] = sum;
+        });
+        for (size_t chunk = 0; chunk < num_chunks; ++chunk)
+        {
+            chunk_offsets[chunk + 1] += chunk_offsets[chunk];
+        }
+        
+        offsets.resize(n + 1);
+        parallel_for(0, n, grain, [&](size_t chunk_begin, size_t chunk_end)
+        {
+            T sum = chunk_offsets[chunk_begin / grain];
+            for (size_t i = chunk_begin; i < chunk_end; ++i)
+            {
+                offsets[i] = sum;
+                sum += count(i);
+            }
+        });
+        offsets[n] = chunk_offsets[num_chunks];
+        return offsets[n];
+    }
+    
+    // Smallest run parallel_sort hands to one thread.
+    const size_t PARALLEL_SORT_MIN_RUN = 1 << 14;
+    
+    // std::sort of [first, last) on the worker threads: one run per thread is sorted, then the
+    // runs are merged pairwise, the merges of one round in parallel.
+    template <typename RandomIt, typename Compare>
+    void parallel_sort(RandomIt first, RandomIt last, const Compare& comp)
+    {
+        size_t n = last - first;
+        size_t num_runs = std::min<size_t>(num_worker_threads(), n / PARALLEL_SORT_MIN_RUN);
+        if (num_runs <= 1)
+        {
+            std::sort(first, last, comp);
+            return;
+        }
+        
+        std::vector<size_t> run_begin(num_runs + 1);
+        for (size_t run = 0; run <= num_runs; ++run)
+        {
+            run_begin[run] = n * run / num_runs;
+        }
+        parallel_for(0, num_runs, 1, [&](size_t runs_begin, size_t runs_end)
+        {
+            for (size_t run = runs_begin; run < runs_end; ++run)
+            {
+                std::sort(first + run_begin[run], first + run_begin[run + 1], comp);
+            }
+        });
+        for (size_t width = 1; width < num_runs; width *= 2)
+        {
+            parallel_for(0, (num_runs + 2 * width - 1) / (2 * width), 1, [&](size_t pairs_begin, size_t pairs_end)
+            {
+                for (size_t pair = pairs_begin; pair < pairs_end; ++pair)
+                {
+                    size_t lo = 2 * width * pair;
+                    size_t mid = std::min(lo + width, num_runs), hi = std::min(lo + 2 * width, num_runs);
+                    if (mid < hi)
+                    {
+                        std::inplace_merge(first + run_begin[lo], first + run_begin[mid], first + run_begin[hi], comp);
+                    }
+                }
+            });
+        }
+    }
+}; // namespace utils
+
+#endif /* parallel_h */
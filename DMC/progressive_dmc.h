@@ -0,0 +1,138 @@
+//
+//  progressive_dmc.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef progressive_dmc_h
+#define progressive_dmc_h
+
+#include <cassert>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "utils.h"
+#include "parallel.h"
+#include "dmc.h"
+#include "incremental.h"
+#include "async_dmc.h"
+#include "grid_pyramid.h"
+
+namespace dmc
+{
+    // Pyramid levels (grids downsampled 2^level times) of the previews of a ProgressiveDmc,
+    // coarsest first.
+    const unsigned PROGRESSIVE_PREVIEW_LEVELS[] = { 2, 1 };
+    
+    // Called by a ProgressiveDmc with each chunk mesh: the downsampling factor of the grid it was
+    // extracted from (1 for the final mesh), then as a ChunkMeshCallback.
+    typedef std::function<void(unsigned factor, size_t chunk, const uint3& chunk3D, DmcChunkMesh& mesh)>
+        ProgressiveChunkCallback;
+    
+    // Progressive extraction for interactive previews of large grids. The constructor extracts
+    // 'scalar_grid' downsampled 4x (see build_grid_pyramid), then 2x if the time left in
+    // 'preview_budget_ms' is expected to be enough (the 4x preview is always made), and reports
+    // every chunk of each preview. It then returns and the full resolution grid is extracted in
+    // the background by an AsyncDmc, whose chunks replace the preview ones as they complete.
+    //
+    // The preview of a chunk is extracted from the downsampled grid with chunks 'factor' times
+    // smaller, so it covers the same box as the chunk at full resolution and the chunk indices
+    // are the same at every factor. A preview can stick out of the grid by up to factor - 1 voxels
+    // on the far sides, where the coarse grid is larger. chunk_size must be a multiple of
+    // INCREMENTAL_BRICK_SIZE * 4.
+    class ProgressiveDmc
+    {
+    public:
+        ProgressiveDmc(const scalar_grid_type& scalar_grid, const float3& xyz_min, const float3& xyz_max,
+                       float iso_value, unsigned num_smooth, double preview_budget_ms,
+                       ProgressiveChunkCallback on_chunk, unsigned chunk_size = DMC_CHUNK_SIZE)
+        : m_on_chunk(std::move(on_chunk))
+        , m_preview_factor(0)
+        {
+            assert(chunk_size % (INCREMENTAL_BRICK_SIZE << PROGRESSIVE_PREVIEW_LEVELS[0]) == 0);
+            
+            Timer timer;
+            uint3 num_voxels_dim;
+            get_num_voxels_dim_from_scalar_grid(num_voxels_dim, scalar_grid);
+            
+            // pyramid[level - 1] is the grid downsampled 2^level times.
+            std::vector<scalar_grid_type> pyramid;
+            build_grid_pyramid(pyramid, scalar_grid, PROGRESSIVE_PREVIEW_LEVELS[0]);
+            
+            double last_ms = 0.0;
+            for (unsigned level : PROGRESSIVE_PREVIEW_LEVELS)
+            {
+                // Halving the voxels costs up to 8 times as much.
+                if (m_preview_factor && (timer.elapsed_ms() + 8.0 * last_ms > preview_budget_ms))
+                {
+                    break;
+                }
+                
+                Timer preview_timer;
+                const unsigned factor = 1u << level;
+                extract_preview(pyramid[level - 1], xyz_min, downsampled_xyz_max(xyz_min, xyz_max, num_voxels_dim, level),
+                                iso_value, num_smooth, factor, chunk_size, num_voxels_dim);
+                last_ms = preview_timer.elapsed_ms();
+                m_preview_factor = factor;
+            }
+            m_preview_ms = timer.elapsed_ms();
+            
+            m_refine.reset(new AsyncDmc(scalar_grid, xyz_min, xyz_max, iso_value, num_smooth,
+                                        [this](size_t chunk, const uint3& chunk3D, DmcChunkMesh& mesh)
+                                        {
+                                            m_on_chunk(1, chunk, chunk3D, mesh);
+                                        },
+                                        chunk_size));
+        }
+        
+        // The refinement's callback captures 'this'.
+        ProgressiveDmc(const ProgressiveDmc&) = delete;
+        ProgressiveDmc& operator=(const ProgressiveDmc&) = delete;
+        ProgressiveDmc(ProgressiveDmc&&) = delete;
+        ProgressiveDmc& operator=(ProgressiveDmc&&) = delete;
+        
+        // The factor of the finest preview made and the time the constructor took.
+        unsigned preview_factor() const { return m_preview_factor; }
+        double preview_ms() const { return m_preview_ms; }
+        
+        // The full resolution extraction, see AsyncDmc.
+        AsyncDmc& refinement() { return *m_refine; }
+        const AsyncDmc& refinement() const { return *m_refine; }
+        
+        void cancel() { m_refine->cancel(); }
+        bool wait() const { return m_refine->wait(); }
+        float progress() const { return m_refine->progress(); }
+    
+    private:
+        // Extract the downsampled grid 'coarse' by chunks covering the full resolution chunks. The
+        // whole grid is a single window, so unlike at full resolution no halo is extracted twice.
+        void extract_preview(const scalar_grid_type& coarse, const float3& xyz_min, const float3& xyz_max,
+                             float iso_value, unsigned num_smooth, unsigned factor, unsigned chunk_size,
+                             const uint3& num_voxels_dim)
+        {
+            ChunkedDmc chunked(coarse, xyz_min, xyz_max, iso_value, num_smooth, chunk_size / factor);
+            const uint3& num_chunks_dim = chunked.num_chunks_dim();
+            (void)num_voxels_dim;
+            assert(num_chunks_dim.x == (num_voxels_dim.x + chunk_size - 1) / chunk_size);
+            assert(num_chunks_dim.y == (num_voxels_dim.y + chunk_size - 1) / chunk_size);
+            assert(num_chunks_dim.z == (num_voxels_dim.z + chunk_size - 1) / chunk_size);
+            
+            chunked.extract_chunks(make_uint3(0, 0, 0), num_chunks_dim, [&](size_t chunk, DmcChunkMesh& mesh)
+            {
+                uint3 chunk3D;
+                index1D_to_3D(chunk, num_chunks_dim, chunk3D);
+                m_on_chunk(factor, chunk, chunk3D, mesh);
+            });
+        }
+        
+        ProgressiveChunkCallback m_on_chunk;
+        unsigned m_preview_factor;
+        double m_preview_ms;
+        std::unique_ptr<AsyncDmc> m_refine;
+    };
+}; // namespace dmc
+
+#endif /* progressive_dmc_h */
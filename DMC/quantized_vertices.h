@@ -0,0 +1,272 @@
+//
+//  quantized_vertices.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef quantized_vertices_h
+#define quantized_vertices_h
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "utils.h"
+#include "parallel.h"
+#include "dmc.h"
+
+namespace dmc
+{
+    // How the three fixed point offsets of a vertex are stored for each supported precision.
+    template <unsigned OffsetBits> struct VertexOffsetTraits;
+    
+    // Three 10-bit offsets packed into one word, x in the low bits.
+    template <>
+    struct VertexOffsetTraits<10>
+    {
+        typedef uint32_t offset_type;
+        
+        static offset_type pack(uint32_t x, uint32_t y, uint32_t z) { return x | (y << 10) | (z << 20); }
+        static uint32_t get(const offset_type& offset, unsigned axis) { return (offset >> (10 * axis)) & 0x3ff; }
+    };
+    
+    template <>
+    struct VertexOffsetTraits<16>
+    {
+        typedef std::array<uint16_t, 3> offset_type;
+        
+        static offset_type pack(uint32_t x, uint32_t y, uint32_t z) { return {{ (uint16_t)x, (uint16_t)y, (uint16_t)z }}; }
+        static uint32_t get(const offset_type& offset, unsigned axis) { return offset[axis]; }
+    };
+    
+    // Vertices per block of the voxel delta stream of QuantizedVertices.
+    const size_t QUANTIZED_BLOCK_SIZE = 64;
+    
+    // Append 'value' to 'out' as a little endian base 128 varint, returns the position after it.
+    inline uint8_t* write_varint(uint8_t* out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            *out++ = (uint8_t)(value | 0x80);
+            value >>= 7;
+        }
+        *out++ = (uint8_t)value;
+        return out;
+    }
+    
+    inline unsigned varint_size(uint64_t value)
+    {
+        unsigned size = 1;
+        for (; value >= 0x80; value >>= 7) ++size;
+        return size;
+    }
+    
+    inline const uint8_t* read_varint(const uint8_t* in, uint64_t& value)
+    {
+        value = 0;
+        for (unsigned shift = 0; ; shift += 7)
+        {
+            uint8_t byte = *in++;
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return in;
+        }
+    }
+    
+    // Signed voxel index differences as unsigned varints: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ...
+    inline uint64_t zigzag_encode(int64_t value) { return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63); }
+    inline int64_t zigzag_decode(uint64_t value) { return (int64_t)(value >> 1) ^ -(int64_t)(value & 1); }
+    
+    // Compressed vertex buffer: each vertex is the index1D of the grid voxel that contains it and
+    // its position inside that voxel as three OffsetBits (10 or 16) fixed point fractions. The
+    // quantization error is at most 1 / (2 * (2^OffsetBits - 1)) of a voxel per axis, well below
+    // the accuracy of the grid.
+    //
+    // The voxel indices are delta coded: each is stored as the zigzag varint of its difference to
+    // the previous vertex's, in blocks of QUANTIZED_BLOCK_SIZE vertices that start over from 0, so
+    // decode(i) only walks the block of i. run_dmc outputs the vertices in voxel order (see
+    // compact_iso_vertices), where most differences are 0 or a few voxels along x and fit in one
+    // byte: about 5.1 (10-bit) or 7.1 (16-bit) bytes per vertex instead of 12. Vertices in Morton
+    // order (reorder_mesh) take about one byte more.
+    //
+    // Smoothing can move an iso vertex slightly out of the voxel that owns it, so vertices are
+    // stored relative to the voxel they lie in. The voxel indices are 32-bit, so the grid must
+    // have fewer than 2^32 voxels.
+    template <unsigned OffsetBits>
+    struct QuantizedVertices
+    {
+        typedef VertexOffsetTraits<OffsetBits> traits;
+        typedef typename traits::offset_type offset_type;
+        
+        static const uint32_t MAX_OFFSET = (1u << OffsetBits) - 1;
+        
+        uint3 num_voxels_dim;
+        float3 xyz_min;
+        float3 voxel_size;
+        
+        // The voxel index varints of block b start at voxel_deltas[block_begin[b]].
+        std::vector<uint8_t> voxel_deltas;
+        std::vector<uint32_t> block_begin;
+        std::vector<offset_type> offsets;
+        
+        size_t size() const { return offsets.size(); }
+        
+        // Calls fn(i, voxel_index1D) for the vertices i of 'block', in order.
+        template <typename Fn>
+        void for_each_block_voxel(size_t block, const Fn& fn) const
+        {
+            const uint8_t* in = voxel_deltas.data() + block_begin[block];
+            const size_t end = std::min(size(), (block + 1) * QUANTIZED_BLOCK_SIZE);
+            int64_t voxel = 0;
+            for (size_t i = block * QUANTIZED_BLOCK_SIZE; i < end; ++i)
+            {
+                uint64_t delta;
+                in = read_varint(in, delta);
+                voxel += zigzag_decode(delta);
+                if (!fn(i, (voxel_index1D_type)voxel)) return;
+            }
+        }
+        
+        // xyz of vertex i inside the voxel 'index1D'.
+        float3 decode(size_t i, voxel_index1D_type index1D) const
+        {
+            uint3 index3D;
+            index1D_to_3D(index1D, num_voxels_dim, index3D);
+            const float scale = 1.0f / MAX_OFFSET;
+            return make_float3(xyz_min.x + (index3D.x + traits::get(offsets[i], 0) * scale) * voxel_size.x,
+                               xyz_min.y + (index3D.y + traits::get(offsets[i], 1) * scale) * voxel_size.y,
+                               xyz_min.z + (index3D.z + traits::get(offsets[i], 2) * scale) * voxel_size.z);
+        }
+        
+        float3 decode(size_t i) const
+        {
+            float3 pt;
+            for_each_block_voxel(i / QUANTIZED_BLOCK_SIZE, [&](size_t j, voxel_index1D_type index1D)
+            {
+                if (j < i) return true;
+                pt = decode(i, index1D);
+                return false;
+            });
+            return pt;
+        }
+        
+        size_t num_bytes() const
+        {
+            return voxel_deltas.capacity() + block_begin.capacity() * sizeof(uint32_t) +
+                   offsets.capacity() * sizeof(offset_type);
+        }
+    };
+    
+    // Quantize 'compact_vertices' (the output of run_dmc over 'num_voxels_dim' voxels spanning
+    // [xyz_min, xyz_max]) into 'quantized', in parallel: the voxels and offsets, the size of each
+    // block of voxel deltas, then the deltas at the prefix sums of those sizes.
+    template <unsigned OffsetBits>
+    void quantize_vertices(QuantizedVertices<OffsetBits>& quantized, const std::vector<float3>& compact_vertices,
+                           const uint3& num_voxels_dim, const float3& xyz_min, const float3& xyz_max)
+    {
+        typedef VertexOffsetTraits<OffsetBits> traits;
+        const uint32_t max_offset = QuantizedVertices<OffsetBits>::MAX_OFFSET;
+        assert((uint64_t)num_voxels_dim.x * num_voxels_dim.y * num_voxels_dim.z <= ((uint64_t)1 << 32));
+        
+        const size_t num_vertices = compact_vertices.size();
+        const size_t num_blocks = (num_vertices + QUANTIZED_BLOCK_SIZE - 1) / QUANTIZED_BLOCK_SIZE;
+        const float3 xyz_range = xyz_max - xyz_min;
+        quantized.num_voxels_dim = num_voxels_dim;
+        quantized.xyz_min = xyz_min;
+        quantized.voxel_size = make_float3(xyz_range.x / num_voxels_dim.x, xyz_range.y / num_voxels_dim.y,
+                                           xyz_range.z / num_voxels_dim.z);
+        quantized.offsets.resize(num_vertices);
+        std::vector<uint32_t> voxels(num_vertices);
+        
+        // The voxel along one axis and the fixed point offset inside it.
+        auto quantize_axis = [max_offset](float pos, float min_pos, float voxel_size, unsigned num_voxels,
+                                          uint32_t& voxel, uint32_t& offset)
+        {
+            float t = (pos - min_pos) / voxel_size;
+            float cell = std::min(std::max(std::floor(t), 0.0f), (float)(num_voxels - 1));
+            float frac = std::min(std::max(t - cell, 0.0f), 1.0f);
+            voxel = (uint32_t)cell;
+            offset = (uint32_t)std::lround(frac * max_offset);
+        };
+        
+        parallel_for(0, num_vertices, VERTEX_PASS_GRAIN, [&](size_t vertex_begin, size_t vertex_end)
+        {
+            for (size_t i = vertex_begin; i < vertex_end; ++i)
+            {
+                const float3& pt = compact_vertices[i];
+                uint3 voxel3D;
+                uint32_t ox, oy, oz;
+                quantize_axis(pt.x, xyz_min.x, quantized.voxel_size.x, num_voxels_dim.x, voxel3D.x, ox);
+                quantize_axis(pt.y, xyz_min.y, quantized.voxel_size.y, num_voxels_dim.y, voxel3D.y, oy);
+                quantize_axis(pt.z, xyz_min.z, quantized.voxel_size.z, num_voxels_dim.z, voxel3D.z, oz);
+                
+                voxel_index1D_type index1D;
+                index3D_to_1D(voxel3D, num_voxels_dim, index1D);
+                voxels[i] = (uint32_t)index1D;
+                quantized.offsets[i] = traits::pack(ox, oy, oz);
+            }
+        });
+        
+        // Calls fn(delta) with the zigzag coded voxel delta of each vertex of 'block', in order.
+        auto for_each_delta = [&](size_t block, auto fn)
+        {
+            const size_t begin = block * QUANTIZED_BLOCK_SIZE;
+            const size_t end = std::min(num_vertices, begin + QUANTIZED_BLOCK_SIZE);
+            for (size_t i = begin; i < end; ++i)
+            {
+                fn(zigzag_encode((int64_t)voxels[i] - (i > begin ? (int64_t)voxels[i - 1] : 0)));
+            }
+        };
+        
+        const size_t blocks_grain = VERTEX_PASS_GRAIN / QUANTIZED_BLOCK_SIZE;
+        quantized.block_begin.assign(num_blocks + 1, 0);
+        parallel_for(0, num_blocks, blocks_grain, [&](size_t block_begin, size_t block_end)
+        {
+            for (size_t block = block_begin; block < block_end; ++block)
+            {
+                uint32_t num_bytes = 0;
+                for_each_delta(block, [&](uint64_t delta) { num_bytes += varint_size(delta); });
+                quantized.block_begin[block + 1] = num_bytes;
+            }
+        });
+        for (size_t block = 0; block < num_blocks; ++block)
+        {
+            quantized.block_begin[block + 1] += quantized.block_begin[block];
+        }
+        
+        quantized.voxel_deltas.resize(quantized.block_begin[num_blocks]);
+        parallel_for(0, num_blocks, blocks_grain, [&](size_t block_begin, size_t block_end)
+        {
+            for (size_t block = block_begin; block < block_end; ++block)
+            {
+                uint8_t* out = quantized.voxel_deltas.data() + quantized.block_begin[block];
+                for_each_delta(block, [&](uint64_t delta) { out = write_varint(out, delta); });
+            }
+        });
+    }
+    
+    // Decode every vertex of 'quantized' back to xyz, in parallel by blocks.
+    template <unsigned OffsetBits>
+    void dequantize_vertices(std::vector<float3>& compact_vertices, const QuantizedVertices<OffsetBits>& quantized)
+    {
+        const size_t num_blocks = (quantized.size() + QUANTIZED_BLOCK_SIZE - 1) / QUANTIZED_BLOCK_SIZE;
+        compact_vertices.resize(quantized.size());
+        parallel_for(0, num_blocks, VERTEX_PASS_GRAIN / QUANTIZED_BLOCK_SIZE, [&](size_t block_begin, size_t block_end)
+        {
+            for (size_t block = block_begin; block < block_end; ++block)
+            {
+                quantized.for_each_block_voxel(block, [&](size_t i, voxel_index1D_type index1D)
+                {
+                    compact_vertices[i] = quantized.decode(i, index1D);
+                    return true;
+                });
+            }
+        });
+    }
+}; // namespace dmc
+
+#endif /* quantized_vertices_h */
@@ -0,0 +1,196 @@
+//
+//  span_space.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef span_space_h
+#define span_space_h
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+#include "utils.h"
+#include "dmc.h"
+#include "sparse_blocks.h"
+#include "minmax_pyramid.h"
+
+namespace dmc
+{
+    // Span space index of the bricks of a scalar grid, for interactive iso value changes: an
+    // interval tree over the brick value ranges. A brick can only hold an active voxel if
+    // iso_value is in (min, max], so each brick is stored as that interval, in the node whose
+    // center it contains. Looking up an iso value walks one root-to-leaf path and, in each node,
+    // reads the sorted intervals only as long as they match; the cost is O(log(#bricks) + #found)
+    // whatever the size of the grid. Bricks with min == max never match and are left out.
+    //
+    // The index does not depend on iso_value; build it once next to the grid (it has to be rebuilt
+    // when the grid changes).
+    class SpanSpaceIndex
+    {
+    public:
+        SpanSpaceIndex(const scalar_grid_type& scalar_grid, unsigned brick_size = MINMAX_BRICK_SIZE)
+        : m_brick_size(brick_size)
+        {
+            get_num_voxels_dim_from_scalar_grid(m_num_voxels_dim, scalar_grid);
+            
+            std::vector<float> mins, maxs;
+            compute_brick_ranges(mins, maxs, scalar_grid, brick_size);
+            
+            std::vector<Span> spans;
+            for (size_t brick = 0; brick < mins.size(); ++brick)
+            {
+                if (mins[brick] < maxs[brick])
+                {
+                    spans.push_back({ mins[brick], maxs[brick], (voxel_index1D_type)brick });
+                }
+            }
+            m_by_min.reserve(spans.size());
+            m_by_max.reserve(spans.size());
+            build(spans);
+        }
+        
+        const uint3& num_voxels_dim() const { return m_num_voxels_dim; }
+        unsigned brick_size() const { return m_brick_size; }
+        
+        // Fill 'bricks' with the bricks that may contain an active voxel at 'iso_value'.
+        void find_bricks(SparseBlockSet& bricks, float iso_value) const
+        {
+            std::vector<voxel_index1D_type> brick_indices;
+            
+            for (unsigned node_index = 0; node_index < m_nodes.size(); )
+            {
+                const Node& node = m_nodes[node_index];
+                if (iso_value < node.center)
+                {
+                    // Every span of the node ends at or after the center, it only has to start before iso_value.
+                    for (unsigned i = node.begin; (i < node.end) && (m_by_min[i].min < iso_value); ++i)
+                    {
+                        brick_indices.push_back(m_by_min[i].brick);
+                    }
+                    node_index = node.left;
+                }
+                else if (iso_value > node.center)
+                {
+                    // Every span of the node starts before the center, it only has to end at or after iso_value.
+                    for (unsigned i = node.begin; (i < node.end) && (m_by_max[i].max >= iso_value); ++i)
+                    {
+                        brick_indices.push_back(m_by_max[i].brick);
+                    }
+                    node_index = node.right;
+                }
+                else
+                {
+                    // The center itself: all the spans of the node and none of the subtrees.
+                    for (unsigned i = node.begin; i < node.end; ++i)
+                    {
+                        brick_indices.push_back(m_by_min[i].brick);
+                    }
+                    break;
+                }
+            }
+            
+            std::sort(brick_indices.begin(), brick_indices.end());
+            bricks.set_blocks(std::move(brick_indices));
+        }
+        
+        size_t num_bytes() const
+        {
+            return (m_by_min.capacity() + m_by_max.capacity()) * sizeof(Span) + m_nodes.capacity() * sizeof(Node);
+        }
+    
+    private:
+        // The brick interval (min, max].
+        struct Span
+        {
+            float min;
+            float max;
+            voxel_index1D_type brick;
+        };
+        
+        // The spans of a node are [begin, end) of m_by_min (ascending min) and of m_by_max
+        // (descending max). Spans with max < center are in the left subtree, those with
+        // min >= center in the right one. Missing children are INVALID_UINT32.
+        struct Node
+        {
+            float center;
+            unsigned begin;
+            unsigned end;
+            unsigned left;
+            unsigned right;
+        };
+        
+        // Returns the index of the node built for 'spans', or INVALID_UINT32 if there are none.
+        unsigned build(std::vector<Span>& spans)
+        {
+            if (spans.empty()) return INVALID_UINT32;
+            
+            // The median of all the end points as the center.
+            std::vector<float> end_pts;
+            end_pts.reserve(2 * spans.size());
+            for (const Span& span : spans)
+            {
+                end_pts.push_back(span.min);
+                end_pts.push_back(span.max);
+            }
+            std::nth_element(end_pts.begin(), end_pts.begin() + spans.size(), end_pts.end());
+            const float center = end_pts[spans.size()];
+            
+            std::vector<Span> left, right, mid;
+            for (const Span& span : spans)
+            {
+                if (span.max < center) left.push_back(span);
+                else if (span.min >= center) right.push_back(span);
+                else mid.push_back(span);
+            }
+            // The center is one of the end points and at least n + 1 of them are <= center, so
+            // with min < max for every span neither side can take them all and the tree is finite.
+            assert((left.size() < spans.size()) && (right.size() < spans.size()));
+            std::vector<Span>().swap(spans);
+            
+            unsigned node_index = (unsigned)m_nodes.size();
+            m_nodes.push_back({ center, (unsigned)m_by_min.size(), (unsigned)(m_by_min.size() + mid.size()),
+                                INVALID_UINT32, INVALID_UINT32 });
+            
+            std::sort(mid.begin(), mid.end(), [](const Span& a, const Span& b) { return a.min < b.min; });
+            m_by_min.insert(m_by_min.end(), mid.begin(), mid.end());
+            std::sort(mid.begin(), mid.end(), [](const Span& a, const Span& b) { return a.max > b.max; });
+            m_by_max.insert(m_by_max.end(), mid.begin(), mid.end());
+            
+            unsigned left_index = build(left);
+            unsigned right_index = build(right);
+            m_nodes[node_index].left = left_index;
+            m_nodes[node_index].right = right_index;
+            return node_index;
+        }
+        
+        uint3 m_num_voxels_dim;
+        unsigned m_brick_size;
+        
+        std::vector<Node> m_nodes;
+        std::vector<Span> m_by_min;
+        std::vector<Span> m_by_max;
+    };
+    
+    // Same mesh as run_dmc on 'scalar_grid', with the bricks to classify looked up in 'index'
+    // (built from the same grid).
+    void run_dmc(std::vector<float3>& compact_vertices, std::vector<uint3>& compact_triangles,
+                 const scalar_grid_type& scalar_grid, const SpanSpaceIndex& index,
+                 const float3& xyz_min, const float3& xyz_max, float iso_value,
+                 unsigned num_smooth = 0, DmcStats* stats = nullptr)
+    {
+        Timer timer;
+        if (stats) *stats = DmcStats();
+        
+        SparseBlockSet bricks(index.num_voxels_dim(), index.brick_size());
+        index.find_bricks(bricks, iso_value);
+        
+        run_dmc_on_bricks(compact_vertices, compact_triangles, scalar_grid, bricks, xyz_min, xyz_max, iso_value,
+                          num_smooth, stats, timer);
+    }
+}; // namespace dmc
+
+#endif /* span_space_h */
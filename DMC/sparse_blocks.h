@@ -0,0 +1,153 @@
+//
+//  sparse_blocks.h
+//  DMC
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+
+#ifndef sparse_blocks_h
+#define sparse_blocks_h
+
+#include <algorithm>
+#include <vector>
+
+#include "utils.h"
+#include "dmc.h"
+
+namespace dmc
+{
+    // A sorted subset of the blocks of block_size^3 voxels that tile a volume of num_voxels_dim
+    // voxels (the blocks on the far faces may be cut short). Blocks are kept sorted by their block
+    // index1D with a table of where each block row (by, bz) starts, so that the voxels of the set
+    // can be visited in index1D order without looking at the other blocks.
+    class SparseBlockSet
+    {
+    public:
+        SparseBlockSet(const uint3& num_voxels_dim, unsigned block_size)
+        : m_num_voxels_dim(num_voxels_dim)
+        , m_block_size(block_size)
+        , m_num_blocks_dim(make_uint3((num_voxels_dim.x + block_size - 1) / block_size,
+                                      (num_voxels_dim.y + block_size - 1) / block_size,
+                                      (num_voxels_dim.z + block_size - 1) / block_size))
+        , m_row_begin((size_t)m_num_blocks_dim.y * m_num_blocks_dim.z + 1, 0) { }
+        
+        const uint3& num_voxels_dim() const { return m_num_voxels_dim; }
+        unsigned block_size() const { return m_block_size; }
+        const uint3& num_blocks_dim() const { return m_num_blocks_dim; }
+        
+        // Replace the blocks of the set by 'block_indices' (sorted, no duplicates).
+        void set_blocks(std::vector<voxel_index1D_type> block_indices)
+        {
+            m_block_indices.swap(block_indices);
+            
+            size_t slot = 0;
+            for (size_t row = 0; row + 1 < m_row_begin.size(); ++row)
+            {
+                m_row_begin[row] = slot;
+                while ((slot < m_block_indices.size()) &&
+                       (m_block_indices[slot] / m_num_blocks_dim.x == row))
+                {
+                    ++slot;
+                }
+            }
+            m_row_begin.back() = slot;
+        }
+        
+        size_t num_blocks() const { return m_block_indices.size(); }
+        
+        voxel_index1D_type block_index1D(size_t slot) const { return m_block_indices[slot]; }
+        
+        uint3 block_index3D(size_t slot) const
+        {
+            uint3 index3D;
+            index1D_to_3D(m_block_indices[slot], m_num_blocks_dim, index3D);
+            return index3D;
+        }
+        
+        // The blocks of the block row (by, bz) are the slots [begin, end).
+        void block_row(unsigned by, unsigned bz, size_t& begin, size_t& end) const
+        {
+            size_t row = (size_t)bz * m_num_blocks_dim.y + by;
+            begin = m_row_begin[row];
+            end = m_row_begin[row + 1];
+        }
+        
+        size_t num_bytes() const
+        {
+            return m_block_indices.capacity() * sizeof(voxel_index1D_type) +
+                   m_row_begin.capacity() * sizeof(size_t);
+        }
+    
+    private:
+        uint3 m_num_voxels_dim;
+        unsigned m_block_size;
+        uint3 m_num_blocks_dim;
+        
+        std::vector<voxel_index1D_type> m_block_indices;
+        std::vector<size_t> m_row_begin;
+    };
+    
+    // Classify the voxels of the blocks in 'block_set' and append the active ones with their edge
+    // intersection vertices (see append_if_active). The voxels are visited slab by slab and row by
+    // row, so 'compact_voxel_info' comes out sorted by index1D, ready for finish_dmc_sparse.
+    // block_rows(slot, i0, j, k, rows) points rows[0..3] at the grid points (i0, j, k),
+    // (i0, j + 1, k), (i0, j, k + 1) and (i0, j + 1, k + 1), where i0 is the first voxel of the
+    // block row in 'slot'; the rows are read at i - i0 and i - i0 + 1 for each voxel i.
+    template <typename BlockRows>
+    void classify_blocks(std::vector<_VoxelInfo>& compact_voxel_info, std::vector<float3>& edge_vertex_stream,
+                         const SparseBlockSet& block_set, const float3& xyz_min, const float3& xyz_max,
+                         float iso_value, const BlockRows& block_rows)
+    {
+        const uint3& num_voxels_dim = block_set.num_voxels_dim();
+        const unsigned block_size = block_set.block_size();
+        const float3 xyz_range = xyz_max - xyz_min;
+        
+        std::vector<float> xs(num_voxels_dim.x + 1), ys(num_voxels_dim.y + 1);
+        for (unsigned i = 0; i < xs.size(); ++i) xs[i] = ijk_to_xyz(i, num_voxels_dim.x, xyz_range.x, xyz_min.x);
+        for (unsigned j = 0; j < ys.size(); ++j) ys[j] = ijk_to_xyz(j, num_voxels_dim.y, xyz_range.y, xyz_min.y);
+        
+        for (unsigned k = 0; k < num_voxels_dim.z; ++k)
+        {
+            const unsigned bz = k / block_size;
+            const float z0 = ijk_to_xyz(k,     num_voxels_dim.z, xyz_range.z, xyz_min.z);
+            const float z1 = ijk_to_xyz(k + 1, num_voxels_dim.z, xyz_range.z, xyz_min.z);
+            
+            for (unsigned j = 0; j < num_voxels_dim.y; ++j)
+            {
+                size_t slot_begin, slot_end;
+                block_set.block_row(j / block_size, bz, slot_begin, slot_end);
+                
+                for (size_t slot = slot_begin; slot < slot_end; ++slot)
+                {
+                    const unsigned i0 = block_set.block_index3D(slot).x * block_size;
+                    const unsigned i1 = std::min(i0 + block_size, num_voxels_dim.x);
+                    
+                    const float* rows[4];
+                    block_rows(slot, i0, j, k, rows);
+                    const float* row00 = rows[0];
+                    const float* row01 = rows[1];
+                    const float* row10 = rows[2];
+                    const float* row11 = rows[3];
+                    
+                    for (unsigned i = i0; i < i1; ++i)
+                    {
+                        const unsigned li = i - i0;
+                        const float voxel_vals[8] =
+                        {
+                            row00[li], row00[li + 1], row01[li + 1], row01[li],
+                            row10[li], row10[li + 1], row11[li + 1], row11[li]
+                        };
+                        
+                        voxel_index1D_type index1D;
+                        index3D_to_1D(i, j, k, num_voxels_dim.x, num_voxels_dim.y, index1D);
+                        append_if_active(compact_voxel_info, edge_vertex_stream, index1D, voxel_vals,
+                                         xs[i], xs[i + 1], ys[j], ys[j + 1], z0, z1, iso_value);
+                    }
+                }
+            }
+        }
+    }
+}; // namespace dmc
+
+#endif /* sparse_blocks_h */
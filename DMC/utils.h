@@ -13,6 +13,9 @@
 #include <iostream>
 #include <cmath>
 #include <functional>   // std::less, std::greater
+#include <chrono>
+#include <algorithm>
+#include <memory>
 
 namespace utils
 {
@@ -61,70 +64,255 @@ namespace utils
         return {x, y, z};
     }
     
-    // small 3D vector wrapper implemented using std::vector<T>
     template <typename T>
+    struct tuple4
+    {
+        tuple4() = default;
+        tuple4(T _x, T _y, T _z, T _w) : x(_x), y(_y), z(_z), w(_w) { }
+        
+        T x, y, z, w;
+    };
+    
+    using uint4 = tuple4<unsigned>;
+    
+    inline uint4 make_uint4(unsigned x, unsigned y, unsigned z, unsigned w)
+    {
+        return {x, y, z, w};
+    }
+    
+    // Storage layouts of Array3D. A layout maps (x, y, z) to a position in the flat storage as the
+    // sum of one offset per axis, so that the (y, z) part can be computed once per row. brick_dim()
+    // is the block of points that is stored contiguously; visiting the grid brick by brick (see
+    // for_each_brick) follows the storage order.
+    
+    // Plain x-fastest order. The whole grid is one brick.
+    class LinearLayout
+    {
+    public:
+        // Every row (fixed y, z) is contiguous.
+        static const bool contiguous_rows = true;
+        
+        LinearLayout(unsigned dim_x, unsigned dim_y, unsigned dim_z)
+        : m_dim(dim_x, dim_y, dim_z)
+        , m_dim_xy((size_t)dim_x * dim_y) { }
+        
+        size_t size() const { return m_dim_xy * m_dim.z; }
+        tuple3<unsigned> brick_dim() const { return m_dim; }
+        
+        size_t offset_x(unsigned x) const { return x; }
+        size_t offset_y(unsigned y) const { return (size_t)y * m_dim.x; }
+        size_t offset_z(unsigned z) const { return z * m_dim_xy; }
+    
+    private:
+        tuple3<unsigned> m_dim;
+        size_t m_dim_xy;
+    };
+    
+    // TILE_SIZE^3 tiles stored one after the other, in x-fastest tile order. The 8 corners of a
+    // voxel are then at most a few KB apart instead of a whole z-slice, which keeps the TLB and
+    // the caches warm on large grids. The grid is padded to whole tiles. Inside a tile the points
+    // are in x-fastest order, or in Z-curve (Morton) order if 'ZCurve' is set. The Z-curve is
+    // kept within the tiles: over the whole grid it would pad every axis to a power of two,
+    // almost 8x the memory for the usual 2^n + 1 point grids.
+    template <bool ZCurve>
+    class BasicTiledLayout
+    {
+    public:
+        static const bool contiguous_rows = false;
+        static const unsigned TILE_BITS = 3;
+        static const unsigned TILE_SIZE = 1u << TILE_BITS;
+        
+        BasicTiledLayout(unsigned dim_x, unsigned dim_y, unsigned dim_z)
+        {
+            const size_t tile_volume = (size_t)1 << (3 * TILE_BITS);
+            const size_t num_tiles_x = (dim_x + TILE_SIZE - 1) >> TILE_BITS;
+            const size_t num_tiles_y = (dim_y + TILE_SIZE - 1) >> TILE_BITS;
+            const size_t num_tiles_z = (dim_z + TILE_SIZE - 1) >> TILE_BITS;
+            m_tile_stride_y = num_tiles_x * tile_volume;
+            m_tile_stride_z = num_tiles_y * m_tile_stride_y;
+            m_size = num_tiles_z * m_tile_stride_z;
+        }
+        
+        size_t size() const { return m_size; }
+        tuple3<unsigned> brick_dim() const { return tuple3<unsigned>(TILE_SIZE, TILE_SIZE, TILE_SIZE); }
+        
+        size_t offset_x(unsigned x) const
+        {
+            return ((size_t)(x >> TILE_BITS) << (3 * TILE_BITS)) + in_tile(x & (TILE_SIZE - 1), 0);
+        }
+        size_t offset_y(unsigned y) const
+        {
+            return (y >> TILE_BITS) * m_tile_stride_y + in_tile(y & (TILE_SIZE - 1), 1);
+        }
+        size_t offset_z(unsigned z) const
+        {
+            return (z >> TILE_BITS) * m_tile_stride_z + in_tile(z & (TILE_SIZE - 1), 2);
+        }
+    
+    private:
+        // Offset of the local coordinate 'v' along 'axis' inside a tile.
+        static size_t in_tile(unsigned v, unsigned axis)
+        {
+            if (!ZCurve)
+            {
+                return (size_t)v << (axis * TILE_BITS);
+            }
+            static_assert(TILE_BITS == 3, "the spread below is for 3-bit coordinates");
+            return (size_t)((v & 1) | ((v & 2) << 2) | ((v & 4) << 4)) << axis;
+        }
+        
+        size_t m_tile_stride_y;
+        size_t m_tile_stride_z;
+        size_t m_size;
+    };
+    
+    typedef BasicTiledLayout<false> TiledLayout;
+    typedef BasicTiledLayout<true> MortonLayout;
+    
+    // Call fn(begin, end) for each brick of 'brick_dim' points (clipped to 'dim') of a dim.x *
+    // dim.y * dim.z grid, bricks in x-fastest order. Within a brick the points are
+    // [begin.x, end.x) * [begin.y, end.y) * [begin.z, end.z).
+    template <typename Fn>
+    void for_each_brick(const tuple3<unsigned>& dim, const tuple3<unsigned>& brick_dim, const Fn& fn)
+    {
+        for (unsigned z = 0; z < dim.z; z += brick_dim.z)
+        {
+            for (unsigned y = 0; y < dim.y; y += brick_dim.y)
+            {
+                for (unsigned x = 0; x < dim.x; x += brick_dim.x)
+                {
+                    fn(tuple3<unsigned>(x, y, z),
+                       tuple3<unsigned>(std::min(x + brick_dim.x, dim.x), std::min(y + brick_dim.y, dim.y),
+                                        std::min(z + brick_dim.z, dim.z)));
+                }
+            }
+        }
+    }
+    
+    // Tag for the Array3D constructor that leaves the values to be written by the caller.
+    struct deferred_fill_t { };
+    const deferred_fill_t deferred_fill = deferred_fill_t();
+    
+    // small 3D vector wrapper implemented using std::vector<T, Allocator>, stored in 'Layout'
+    // order (LinearLayout, TiledLayout or MortonLayout).
+    template <typename T, typename Layout = LinearLayout, typename Allocator = std::allocator<T>>
     class Array3D
     {
     public:
         typedef T value_type;
-        typedef typename std::vector<value_type>::iterator iterator;
-        typedef typename std::vector<value_type>::const_iterator const_iterator;
+        typedef Layout layout_type;
+        typedef std::vector<value_type, Allocator> storage_type;
+        typedef typename storage_type::iterator iterator;
+        typedef typename storage_type::const_iterator const_iterator;
+        
+        // One row (fixed y, z) of the array: row[x] is (x, y, z). The y/z part of the offset is
+        // computed once, for LinearLayout this is a plain pointer.
+        template <typename Ptr>
+        class RowView
+        {
+        public:
+            RowView(Ptr base, const Layout& layout) : m_base(base), m_layout(layout) { }
+            
+            auto operator[](unsigned x) const -> decltype(*Ptr()) { return m_base[m_layout.offset_x(x)]; }
+        
+        private:
+            Ptr m_base;
+            const Layout& m_layout;
+        };
+        
+        typedef RowView<T*> row_type;
+        typedef RowView<const T*> const_row_type;
         
         Array3D(unsigned dim_x, unsigned dim_y, unsigned dim_z, const T& value = T())
         : m_dim_x(dim_x)
         , m_dim_y(dim_y)
         , m_dim_z(dim_z)
-        , m_dim_xy(dim_x * dim_y)
-        , m_data(std::vector<value_type>(m_dim_xy * dim_z, value)) { }
+        , m_layout(dim_x, dim_y, dim_z)
+        , m_data(m_layout.size(), value) { }
+        
+        // The values are whatever the allocator's default construction leaves: T() for
+        // std::allocator, nothing at all for HugePageAllocator, whose pages are then first
+        // touched by the threads that fill the array (see parallel_first_touch and sample_field).
+        Array3D(unsigned dim_x, unsigned dim_y, unsigned dim_z, deferred_fill_t)
+        : m_dim_x(dim_x)
+        , m_dim_y(dim_y)
+        , m_dim_z(dim_z)
+        , m_layout(dim_x, dim_y, dim_z)
+        , m_data(m_layout.size()) { }
         
         const T& operator()(unsigned x, unsigned y, unsigned z) const
         {
-            return m_data[z * m_dim_xy + y * m_dim_x + x];
+            return m_data[m_layout.offset_z(z) + m_layout.offset_y(y) + m_layout.offset_x(x)];
         }
         
         T& operator()(unsigned x, unsigned y, unsigned z)
         {
-            return m_data[z * m_dim_xy + y * m_dim_x + x];
+            return m_data[m_layout.offset_z(z) + m_layout.offset_y(y) + m_layout.offset_x(x)];
+        }
+        
+        const_row_type row(unsigned y, unsigned z) const
+        {
+            return const_row_type(m_data.data() + m_layout.offset_z(z) + m_layout.offset_y(y), m_layout);
+        }
+        
+        row_type row(unsigned y, unsigned z)
+        {
+            return row_type(m_data.data() + m_layout.offset_z(z) + m_layout.offset_y(y), m_layout);
         }
         
         unsigned dim_x() const { return m_dim_x; }
         unsigned dim_y() const { return m_dim_y; }
         unsigned dim_z() const { return m_dim_z; }
         
+        tuple3<unsigned> brick_dim() const { return m_layout.brick_dim(); }
+        
+        // Call fn(begin, end) for each storage brick, in storage order.
+        template <typename Fn>
+        void for_each_brick(const Fn& fn) const
+        {
+            utils::for_each_brick(tuple3<unsigned>(m_dim_x, m_dim_y, m_dim_z), brick_dim(), fn);
+        }
+        
+        // The storage, in layout order (including the padding of the tiled layouts).
         iterator begin()                { return m_data.begin(); }
         iterator end()                  { return m_data.end(); }
         const_iterator cbegin() const   { return m_data.cbegin(); }
         const_iterator cend() const     { return m_data.cend(); }
-        
+    
     private:
         unsigned m_dim_x;
         unsigned m_dim_y;
         unsigned m_dim_z;
-        unsigned m_dim_xy;
+        Layout m_layout;
         
-        std::vector<value_type> m_data;
+        storage_type m_data;
     };
     
+    // The index functions are templated on the 1D index type so that grids with more than
+    // 2^32 voxels can use a 64-bit index. The arithmetic is carried out in 'Index'.
+    template <typename Index>
     inline void index3D_to_1D(unsigned i, unsigned j, unsigned k,
-                              unsigned num_voxels_i, unsigned num_voxels_j, unsigned& index1D)
+                              unsigned num_voxels_i, unsigned num_voxels_j, Index& index1D)
     {
-        index1D = (k * num_voxels_j + j) * num_voxels_i + i;
+        index1D = ((Index)k * num_voxels_j + j) * num_voxels_i + i;
     }
     
-    inline void index3D_to_1D(const uint3& index3D, const uint3& num_voxels_dim, unsigned& index1D)
+    template <typename Index>
+    inline void index3D_to_1D(const uint3& index3D, const uint3& num_voxels_dim, Index& index1D)
     {
         index3D_to_1D(index3D.x, index3D.y, index3D.z, num_voxels_dim.x, num_voxels_dim.y, index1D);
     }
     
-    inline void index1D_to_3D(unsigned index1D, const uint3& num_voxels_dim, uint3& index3D)
+    template <typename Index>
+    inline void index1D_to_3D(Index index1D, const uint3& num_voxels_dim, uint3& index3D)
     {
-        unsigned num_voxels_xy = num_voxels_dim.x * num_voxels_dim.y;
+        Index num_voxels_xy = (Index)num_voxels_dim.x * num_voxels_dim.y;
         
-        index3D.z = index1D / num_voxels_xy;
+        index3D.z = (unsigned)(index1D / num_voxels_xy);
         index1D = index1D % num_voxels_xy;
-        index3D.y = index1D / num_voxels_dim.x;
+        index3D.y = (unsigned)(index1D / num_voxels_dim.x);
         index1D = index1D % num_voxels_dim.x;
-        index3D.x = index1D;
+        index3D.x = (unsigned)index1D;
     }
     
     inline float ijk_to_xyz(unsigned i, unsigned size, float f_range, float f_min)
@@ -156,6 +344,35 @@ namespace utils
     {
         return argmin_impl<0, sizeof...(Ts)>(0, head, std::greater<T>(), head, rest...);
     }
+    
+    // Wall clock stopwatch. lap_ms() returns the time since the last lap (or construction)
+    // and restarts the lap.
+    class Timer
+    {
+    public:
+        typedef std::chrono::steady_clock clock_type;
+        
+        Timer() : m_start(clock_type::now()), m_lap(m_start) { }
+        
+        double elapsed_ms() const { return to_ms(clock_type::now() - m_start); }
+        
+        double lap_ms()
+        {
+            clock_type::time_point now = clock_type::now();
+            double ms = to_ms(now - m_lap);
+            m_lap = now;
+            return ms;
+        }
+    
+    private:
+        static double to_ms(clock_type::duration d)
+        {
+            return std::chrono::duration<double, std::milli>(d).count();
+        }
+        
+        clock_type::time_point m_start;
+        clock_type::time_point m_lap;
+    };
 }; // namespace utils
 
 template <typename T>
@@ -172,6 +389,13 @@ std::ostream& operator<<(std::ostream& os, const utils::tuple3<T>& t)
     return os;
 }
 
+template <typename T>
+std::ostream& operator<<(std::ostream& os, const utils::tuple4<T>& t)
+{
+    os << t.x << " " << t.y << " " << t.z << " " << t.w;
+    return os;
+}
+
 inline utils::float2& operator+=(utils::float2& lhs, const utils::float2& rhs)
 {
     lhs.x += rhs.x; lhs.y += rhs.y;
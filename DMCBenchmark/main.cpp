@@ -0,0 +1,523 @@
+//
+//  main.cpp
+//  DMCBenchmark
+//
+//  Created by Ye Kuang on 11/24/15.
+//  Copyright © 2015 Ye Kuang. All rights reserved.
+//
+//  Benchmarks run_dmc over synthetic fields and reports per-stage throughput as JSON, laid
+//  out like Google Benchmark's --benchmark_format=json so the same tooling can diff runs.
+//  BM_DMC cases extract from a sampled grid, BM_DMCFused cases use the fused run_dmc that
+//  evaluates the field itself (their sample_field time is part of the run). BM_DMCTiled and
+//  BM_DMCMorton are BM_DMC on a grid stored in TiledLayout / MortonLayout instead of the
+//  linear Array3D layout. After the timed iterations the last mesh of each case goes through
+//  reorder_mesh once, which reports its time and the vertex cache ACMR before and after it.
+//
+//  Flags:
+//      --benchmark_filter=<regex>          only run the cases whose name matches
+//      --benchmark_repetitions=<n>         repeat each case n times (adds a _mean entry)
+//      --benchmark_min_time=<seconds>      keep iterating a case until this much time passed
+//      --benchmark_out=<file>              write the JSON to a file instead of stdout
+//      --max_resolution=<n>                skip cases above n^3 (default 256, the 512^3 and
+//                                          1024^3 cases need several GB of memory)
+//
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <memory>
+#include <regex>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "../DMC/utils.h"
+#include "../DMC/isosurface.h"
+#include "../DMC/field_sampler.h"
+#include "../DMC/dmc.h"
+#include "../DMC/mesh_reorder.h"
+
+namespace
+{
+    using namespace utils;
+    using namespace surface;
+    
+    // How the library was configured, recorded in the JSON context so runs of different
+    // modes can be told apart: the passes run on thread_pool() unless it has a single thread.
+    const char* dmc_mode()
+    {
+        return (num_worker_threads() > 1) ? "parallel" : "serial";
+    }
+    
+    struct FieldSpec
+    {
+        const char* name;
+        std::unique_ptr<Isosurface> (*make)();
+        float3 xyz_min;
+        float3 xyz_max;
+        float iso_value;
+    };
+    
+    const float GYROID_EXTENT = 4.0f * (float)M_PI;
+    
+    const FieldSpec field_specs[] =
+    {
+        {
+            "sphere", []() -> std::unique_ptr<Isosurface> { return std::unique_ptr<Isosurface>(new SphereSurface); },
+            float3(-5, -5, -5), float3(5, 5, 5), 4.0f
+        },
+        {
+            "gyroid", []() -> std::unique_ptr<Isosurface> { return std::unique_ptr<Isosurface>(new GyroidSurface); },
+            float3(-GYROID_EXTENT, -GYROID_EXTENT, -GYROID_EXTENT),
+            float3(GYROID_EXTENT, GYROID_EXTENT, GYROID_EXTENT), 0.0f
+        },
+        {
+            "noise", []() -> std::unique_ptr<Isosurface> { return std::unique_ptr<Isosurface>(new NoiseSurface); },
+            float3(0, 0, 0), float3(8, 8, 8), 0.0f
+        },
+    };
+    
+    const unsigned resolutions[] = {64, 128, 256, 512, 1024};
+    const unsigned num_smooths[] = {0, 5, 15};
+    
+    enum class GridLayout { LINEAR, TILED, MORTON };
+    
+    struct LayoutSpec
+    {
+        const char* case_prefix;
+        GridLayout layout;
+    };
+    
+    const LayoutSpec grid_layouts[] =
+    {
+        { "BM_DMC/", GridLayout::LINEAR },
+        { "BM_DMCTiled/", GridLayout::TILED },
+        { "BM_DMCMorton/", GridLayout::MORTON },
+    };
+    
+    struct BenchmarkCase
+    {
+        std::string name;
+        const FieldSpec* field;
+        unsigned resolution;
+        unsigned num_smooth;
+        bool fused;
+        GridLayout layout;
+    };
+    
+    struct Options
+    {
+        std::string filter = ".*";
+        unsigned repetitions = 1;
+        double min_time_s = 0.5;
+        std::string out_path;
+        unsigned max_resolution = 256;
+    };
+    
+    // Averaged result of all the iterations of one repetition.
+    struct RunResult
+    {
+        std::string name;
+        std::string run_name;
+        unsigned iterations = 0;
+        double real_ms = 0.0;
+        double cpu_ms = 0.0;
+        double sample_field_ms = 0.0;
+        dmc::DmcStats stats;
+    };
+    
+    bool parse_flag(const char* arg, const char* flag, std::string& value)
+    {
+        size_t len = strlen(flag);
+        if (strncmp(arg, flag, len) != 0 || arg[len] != '=') return false;
+        value = arg + len + 1;
+        return true;
+    }
+    
+    bool parse_options(int argc, const char* argv[], Options& options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string value;
+            if (parse_flag(argv[i], "--benchmark_filter", value)) options.filter = value;
+            else if (parse_flag(argv[i], "--benchmark_repetitions", value)) options.repetitions = std::max(1, atoi(value.c_str()));
+            else if (parse_flag(argv[i], "--benchmark_min_time", value)) options.min_time_s = atof(value.c_str());
+            else if (parse_flag(argv[i], "--benchmark_out", value)) options.out_path = value;
+            else if (parse_flag(argv[i], "--max_resolution", value)) options.max_resolution = (unsigned)atoi(value.c_str());
+            else
+            {
+                std::cerr << "unknown flag: " << argv[i] << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    std::vector<BenchmarkCase> make_cases(const Options& options)
+    {
+        std::regex filter(options.filter);
+        std::vector<BenchmarkCase> cases;
+        
+        for (const FieldSpec& field : field_specs)
+        {
+            for (unsigned resolution : resolutions)
+            {
+                if (resolution > options.max_resolution) continue;
+                
+                auto add_cases = [&](const char* prefix, bool fused, GridLayout layout)
+                {
+                    for (unsigned num_smooth : num_smooths)
+                    {
+                        std::stringstream ss;
+                        ss << prefix << field.name << "/" << resolution << "/" << num_smooth;
+                        if (std::regex_search(ss.str(), filter))
+                        {
+                            cases.push_back({ss.str(), &field, resolution, num_smooth, fused, layout});
+                        }
+                    }
+                };
+                for (const LayoutSpec& layout : grid_layouts)
+                {
+                    add_cases(layout.case_prefix, false, layout.layout);
+                }
+                add_cases("BM_DMCFused/", true, GridLayout::LINEAR);
+            }
+        }
+        return cases;
+    }
+    
+    template <typename Layout>
+    void sample_field(Array3D<float, Layout>& scalar_grid, const FieldSpec& field)
+    {
+        std::unique_ptr<Isosurface> surface = field.make();
+        sample_surface(scalar_grid, *surface, field.xyz_min, field.xyz_max);
+    }
+    
+    void accumulate(dmc::DmcStats& sum, const dmc::DmcStats& stats)
+    {
+        sum.sample_field_ms += stats.sample_field_ms;
+        sum.flag_active_voxels_ms += stats.flag_active_voxels_ms;
+        sum.compact_voxel_flags_ms += stats.compact_voxel_flags_ms;
+        sum.init_voxels_info_ms += stats.init_voxels_info_ms;
+        sum.correct_voxels_info_ms += stats.correct_voxels_info_ms;
+        sum.sample_edge_vertices_ms += stats.sample_edge_vertices_ms;
+        sum.calc_iso_vertices_ms += stats.calc_iso_vertices_ms;
+        sum.smooth_ms += stats.smooth_ms;
+        sum.generate_triangles_ms += stats.generate_triangles_ms;
+        sum.compact_iso_vertices_ms += stats.compact_iso_vertices_ms;
+        sum.total_ms += stats.total_ms;
+        sum.reorder_mesh_ms += stats.reorder_mesh_ms;
+    }
+    
+    void scale(dmc::DmcStats& stats, double factor)
+    {
+        stats.sample_field_ms *= factor;
+        stats.flag_active_voxels_ms *= factor;
+        stats.compact_voxel_flags_ms *= factor;
+        stats.init_voxels_info_ms *= factor;
+        stats.correct_voxels_info_ms *= factor;
+        stats.sample_edge_vertices_ms *= factor;
+        stats.calc_iso_vertices_ms *= factor;
+        stats.smooth_ms *= factor;
+        stats.generate_triangles_ms *= factor;
+        stats.compact_iso_vertices_ms *= factor;
+        stats.total_ms *= factor;
+        stats.reorder_mesh_ms *= factor;
+    }
+    
+    // 'scalar_grid' is null for fused cases.
+    template <typename Grid>
+    RunResult run_case(const BenchmarkCase& bm_case, const Grid* scalar_grid, double sample_field_ms,
+                       double min_time_s)
+    {
+        RunResult result;
+        result.name = bm_case.name;
+        result.run_name = bm_case.name;
+        result.sample_field_ms = sample_field_ms;
+        
+        std::vector<float3> compact_vertices;
+        std::vector<uint3> compact_triangles;
+        dmc::DmcStats stats;
+        
+        dmc::DmcStats time_sum;
+        
+        const FieldSpec& field = *bm_case.field;
+        std::unique_ptr<Isosurface> surface = field.make();
+        const uint3 num_voxels_dim = make_uint3(bm_case.resolution, bm_case.resolution, bm_case.resolution);
+        
+        Timer timer;
+        std::clock_t cpu_begin = std::clock();
+        do
+        {
+            if (bm_case.fused)
+            {
+                dmc::run_dmc(compact_vertices, compact_triangles, *surface, num_voxels_dim, field.xyz_min,
+                             field.xyz_max, field.iso_value, bm_case.num_smooth, &stats);
+            }
+            else
+            {
+                dmc::run_dmc(compact_vertices, compact_triangles, *scalar_grid, field.xyz_min,
+                             field.xyz_max, field.iso_value, bm_case.num_smooth, &stats);
+            }
+            accumulate(time_sum, stats);
+            ++result.iterations;
+        } while (timer.elapsed_ms() < min_time_s * 1000.0);
+        
+        result.real_ms = timer.elapsed_ms() / result.iterations;
+        result.cpu_ms = (double)(std::clock() - cpu_begin) * 1000.0 / CLOCKS_PER_SEC / result.iterations;
+        
+        // Counters are identical between iterations, only the times are averaged.
+        scale(time_sum, 1.0 / result.iterations);
+        result.stats = stats;
+        scale(result.stats, 0.0);
+        accumulate(result.stats, time_sum);
+        if (bm_case.fused)
+        {
+            result.sample_field_ms = result.stats.sample_field_ms;
+        }
+        
+        dmc::reorder_mesh(compact_vertices, compact_triangles, &result.stats);
+        return result;
+    }
+    
+    double per_second(double count, double ms)
+    {
+        return ms > 0.0 ? count * 1000.0 / ms : 0.0;
+    }
+    
+    class JsonWriter
+    {
+    public:
+        explicit JsonWriter(std::ostream& os) : m_os(os) { m_os.precision(10); }
+        
+        void field(const char* key, const std::string& value, bool last = false)
+        {
+            m_os << "      \"" << key << "\": \"" << value << "\"" << (last ? "\n" : ",\n");
+        }
+        
+        void field(const char* key, double value, bool last = false)
+        {
+            m_os << "      \"" << key << "\": " << value << (last ? "\n" : ",\n");
+        }
+        
+        void stage(const char* name, double ms, double num_voxels)
+        {
+            std::string key(name);
+            field((key + "_ms").c_str(), ms);
+            field((key + "_voxels_per_second").c_str(), per_second(num_voxels, ms));
+        }
+        
+        void result(const RunResult& result, const char* run_type, unsigned repetitions, bool last)
+        {
+            const dmc::DmcStats& stats = result.stats;
+            double num_voxels = (double)stats.num_voxels;
+            
+            m_os << "    {\n";
+            field("name", result.name);
+            field("run_name", result.run_name);
+            field("run_type", std::string(run_type));
+            field("repetitions", (double)repetitions);
+            field("iterations", (double)result.iterations);
+            field("real_time", result.real_ms);
+            field("cpu_time", result.cpu_ms);
+            field("time_unit", std::string("ms"));
+            
+            field("voxels", num_voxels);
+            field("active_voxels", (double)stats.num_active_voxels);
+            field("lut2_voxels", (double)stats.num_lut2_voxels);
+            field("vertices", (double)stats.num_vertices);
+            field("triangles", (double)stats.num_triangles);
+            field("voxels_per_second", per_second(num_voxels, stats.total_ms));
+            field("triangles_per_second", per_second((double)stats.num_triangles, stats.total_ms));
+            
+            stage("sample_field", result.sample_field_ms, num_voxels);
+            stage("flag_active_voxels", stats.flag_active_voxels_ms, num_voxels);
+            stage("compact_voxel_flags", stats.compact_voxel_flags_ms, num_voxels);
+            stage("init_voxels_info", stats.init_voxels_info_ms, num_voxels);
+            stage("correct_voxels_info", stats.correct_voxels_info_ms, num_voxels);
+            stage("sample_edge_vertices", stats.sample_edge_vertices_ms, num_voxels);
+            stage("calc_iso_vertices", stats.calc_iso_vertices_ms, num_voxels);
+            stage("smooth", stats.smooth_ms, num_voxels);
+            field("generate_triangles_ms", stats.generate_triangles_ms);
+            field("generate_triangles_voxels_per_second", per_second(num_voxels, stats.generate_triangles_ms));
+            field("generate_triangles_triangles_per_second",
+                  per_second((double)stats.num_triangles, stats.generate_triangles_ms));
+            stage("compact_iso_vertices", stats.compact_iso_vertices_ms, num_voxels);
+            field("reorder_mesh_ms", stats.reorder_mesh_ms);
+            field("acmr_before", stats.acmr_before);
+            field("acmr_after", stats.acmr_after);
+            
+            field("peak_bytes", (double)(stats.voxel_flags_bytes + stats.full_voxel_index_map_bytes +
+                                         stats.compact_voxel_info_bytes + stats.compact_vertices_bytes +
+                                         stats.compact_triangles_bytes + stats.field_slices_bytes +
+                                         stats.edge_vertex_stream_bytes), true);
+            m_os << (last ? "    }\n" : "    },\n");
+        }
+        
+        void begin(unsigned num_threads)
+        {
+            char date[64];
+            std::time_t now = std::time(nullptr);
+            std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+            
+            m_os << "{\n  \"context\": {\n";
+            field("date", std::string(date));
+            field("num_cpus", (double)num_threads);
+            field("num_worker_threads", (double)num_worker_threads());
+            field("dmc_mode", std::string(dmc_mode()));
+#ifdef NDEBUG
+            field("library_build_type", std::string("release"), true);
+#else
+            field("library_build_type", std::string("debug"), true);
+#endif
+            m_os << "  },\n  \"benchmarks\": [\n";
+        }
+        
+        void end() { m_os << "  ]\n}\n"; }
+    
+    private:
+        std::ostream& m_os;
+    };
+
+    // The grid of the current field and resolution in each layout, sampled on first use.
+    class GridSet
+    {
+    public:
+        void reset(const FieldSpec* field, unsigned resolution)
+        {
+            m_linear.reset();
+            m_tiled.reset();
+            m_morton.reset();
+            m_field = field;
+            m_resolution = resolution;
+        }
+        
+        bool holds(const FieldSpec* field, unsigned resolution) const
+        {
+            return m_field == field && m_resolution == resolution;
+        }
+        
+        RunResult run_case(const BenchmarkCase& bm_case, double min_time_s)
+        {
+            switch (bm_case.layout)
+            {
+                case GridLayout::TILED:
+                    return run_on(bm_case, m_tiled, m_tiled_sample_ms, min_time_s);
+                case GridLayout::MORTON:
+                    return run_on(bm_case, m_morton, m_morton_sample_ms, min_time_s);
+                default:
+                    return run_on(bm_case, m_linear, m_linear_sample_ms, min_time_s);
+            }
+        }
+    
+    private:
+        template <typename Layout>
+        RunResult run_on(const BenchmarkCase& bm_case, std::unique_ptr<Array3D<float, Layout>>& grid,
+                         double& sample_field_ms, double min_time_s)
+        {
+            if (!grid)
+            {
+                grid.reset(new Array3D<float, Layout>(m_resolution + 1, m_resolution + 1, m_resolution + 1));
+                Timer timer;
+                sample_field(*grid, *m_field);
+                sample_field_ms = timer.elapsed_ms();
+            }
+            return ::run_case(bm_case, grid.get(), sample_field_ms, min_time_s);
+        }
+        
+        const FieldSpec* m_field = nullptr;
+        unsigned m_resolution = 0;
+        std::unique_ptr<Array3D<float>> m_linear;
+        std::unique_ptr<Array3D<float, TiledLayout>> m_tiled;
+        std::unique_ptr<Array3D<float, MortonLayout>> m_morton;
+        double m_linear_sample_ms = 0.0;
+        double m_tiled_sample_ms = 0.0;
+        double m_morton_sample_ms = 0.0;
+    };
+    
+    RunResult mean_of(const std::vector<RunResult>& runs)
+    {
+        RunResult mean = runs.front();
+        mean.name += "_mean";
+        mean.iterations = 0;
+        mean.real_ms = mean.cpu_ms = mean.sample_field_ms = 0.0;
+        scale(mean.stats, 0.0);
+        
+        for (const RunResult& run : runs)
+        {
+            mean.iterations += run.iterations;
+            mean.real_ms += run.real_ms;
+            mean.cpu_ms += run.cpu_ms;
+            mean.sample_field_ms += run.sample_field_ms;
+            accumulate(mean.stats, run.stats);
+        }
+        double factor = 1.0 / runs.size();
+        mean.real_ms *= factor;
+        mean.cpu_ms *= factor;
+        mean.sample_field_ms *= factor;
+        scale(mean.stats, factor);
+        return mean;
+    }
+}
+
+int main(int argc, const char * argv[]) {
+    Options options;
+    if (!parse_options(argc, argv, options))
+    {
+        return 1;
+    }
+
+    std::vector<BenchmarkCase> cases = make_cases(options);
+
+    std::ofstream out_file;
+    if (!options.out_path.empty())
+    {
+        out_file.open(options.out_path);
+        if (!out_file)
+        {
+            std::cerr << "cannot open " << options.out_path << std::endl;
+            return 1;
+        }
+    }
+    JsonWriter writer(options.out_path.empty() ? std::cout : out_file);
+    writer.begin(std::thread::hardware_concurrency());
+
+    // Cases are ordered by field and resolution, so each grid is sampled once and then shared
+    // by all the num_smooth variants of its layout. Fused cases do not need one.
+    GridSet grids;
+
+    for (size_t case_index = 0; case_index < cases.size(); ++case_index)
+    {
+        const BenchmarkCase& bm_case = cases[case_index];
+        if (!bm_case.fused && !grids.holds(bm_case.field, bm_case.resolution))
+        {
+            grids.reset(bm_case.field, bm_case.resolution);
+        }
+        
+        std::vector<RunResult> runs;
+        for (unsigned rep = 0; rep < options.repetitions; ++rep)
+        {
+            runs.push_back(bm_case.fused ? run_case(bm_case, (const Array3D<float>*)nullptr, 0.0, options.min_time_s)
+                                         : grids.run_case(bm_case, options.min_time_s));
+        }
+        
+        bool last_case = case_index + 1 == cases.size();
+        for (size_t rep = 0; rep < runs.size(); ++rep)
+        {
+            bool last = last_case && options.repetitions == 1;
+            writer.result(runs[rep], "iteration", options.repetitions, last);
+        }
+        if (options.repetitions > 1)
+        {
+            writer.result(mean_of(runs), "aggregate", options.repetitions, last_case);
+        }
+        std::cerr << bm_case.name << " done" << std::endl;
+    }
+
+    writer.end();
+    return 0;
+}